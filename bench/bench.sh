@@ -0,0 +1,110 @@
+#!/bin/sh
+#
+# End-to-end throughput benchmark of ipdecap, run by: make bench
+# Usage: bench.sh gentraffic ipdecap datadir [decap_bench]
+#
+# Generates one capture per encapsulation type with gentraffic (ESP: one per
+# encryption algorithm, with its configuration file), then reports the best
+# of BENCH_RUNS decapsulations of each one in packets/s and Gbit/s.
+# With decap_bench, run by make microbench, the decapsulation functions are
+# measured over the captures instead.
+# Captures are kept in datadir until the generation parameters change.
+
+set -e
+
+GEN="$1"
+IPDECAP="$2"
+DATA="$3"
+DECAP_BENCH="$4"
+
+: ${BENCH_PACKETS:=200000}
+: ${BENCH_SIZES:=imix}
+: ${BENCH_FLOWS:=4}
+: ${BENCH_RUNS:=3}
+
+if [ "$(date +%N)" = "N" ]; then
+  echo "date +%N is not supported, cannot measure time" >&2
+  exit 1
+fi
+
+now_ns() {
+  date +%s%N
+}
+
+params="$BENCH_PACKETS $BENCH_SIZES $BENCH_FLOWS"
+mkdir -p "$DATA"
+if [ "$(cat "$DATA/params" 2>/dev/null)" != "$params" ]; then
+  rm -f "$DATA"/*.cap "$DATA"/*.conf
+  echo "$params" > "$DATA/params"
+fi
+
+tests="ipip 6in4 gre vlan qinq"
+for algo in $("$GEN" -l); do
+  tests="$tests esp-$algo"
+done
+
+for test in $tests; do
+  case $test in
+    esp-*)
+      [ -f "$DATA/$test.cap" ] || "$GEN" -t esp -e "${test#esp-}" -n "$BENCH_PACKETS" -s "$BENCH_SIZES" \
+        -f "$BENCH_FLOWS" -o "$DATA/$test.cap" -c "$DATA/$test.conf" > /dev/null
+      ;;
+    qinq)
+      [ -f "$DATA/$test.cap" ] || "$GEN" -t vlan -q 2 -n "$BENCH_PACKETS" -s "$BENCH_SIZES" \
+        -f "$BENCH_FLOWS" -o "$DATA/$test.cap" > /dev/null
+      ;;
+    *)
+      [ -f "$DATA/$test.cap" ] || "$GEN" -t "$test" -n "$BENCH_PACKETS" -s "$BENCH_SIZES" \
+        -f "$BENCH_FLOWS" -o "$DATA/$test.cap" > /dev/null
+      ;;
+  esac
+done
+
+echo "*** $($IPDECAP -V | head -1), $BENCH_PACKETS packets, sizes: $BENCH_SIZES, $BENCH_FLOWS flows"
+
+# decap_bench finds the configuration file next to each capture
+if [ -n "$DECAP_BENCH" ]; then
+  "$DECAP_BENCH" $(for test in $tests; do echo "$DATA/$test.cap"; done)
+  exit 0
+fi
+
+echo "*** ipdecap options: ${BENCH_OPTS:-none}, best of $BENCH_RUNS runs"
+printf "%-24s %10s %12s %10s %12s %8s\n" "type" "packets" "bytes" "seconds" "packets/s" "Gbit/s"
+
+for test in $tests; do
+
+  cap="$DATA/$test.cap"
+  conf=""
+  case $test in
+    esp-*) conf="$DATA/$test.conf" ;;
+  esac
+
+  # Warm-up run, also checks every packet is decapsulated
+  warnings=$("$IPDECAP" -v $BENCH_OPTS -i "$cap" -o /dev/null ${conf:+-c "$conf"} 2>&1 \
+    | grep -c -i "warning\|no suitable\|ignoring" || true)
+
+  best=""
+  run=0
+  while [ $run -lt "$BENCH_RUNS" ]; do
+    start=$(now_ns)
+    "$IPDECAP" $BENCH_OPTS -i "$cap" -o /dev/null ${conf:+-c "$conf"}
+    end=$(now_ns)
+    elapsed=$((end - start))
+    if [ -z "$best" ] || [ $elapsed -lt "$best" ]; then
+      best=$elapsed
+    fi
+    run=$((run + 1))
+  done
+
+  # Packet bytes: file size without the pcap file and record headers
+  bytes=$(( $(wc -c < "$cap") - 24 - 16 * BENCH_PACKETS ))
+
+  awk -v t="$test" -v p="$BENCH_PACKETS" -v b="$bytes" -v ns="$best" 'BEGIN {
+    s = ns / 1e9
+    printf "%-24s %10d %12d %10.3f %12.0f %8.3f\n", t, p, b, s, p / s, b * 8 / s / 1e9
+  }'
+
+  if [ "$warnings" -ne 0 ]; then
+    echo "warning: $test: $warnings packets not decapsulated, see: $IPDECAP -v $BENCH_OPTS -i $cap${conf:+ -c $conf}" >&2
+  fi
+done
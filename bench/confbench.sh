@@ -0,0 +1,80 @@
+#!/bin/sh
+#
+# ESP configuration file load time benchmark, run by: make confbench
+# Usage: confbench.sh gentraffic ipdecap datadir
+#
+# For each encryption algorithm of BENCH_CONF_ALGOS, generates a small ESP
+# capture whose configuration file also has BENCH_SAS SAs no packet uses, then
+# reports the best of BENCH_RUNS loads in seconds and SAs/s: the time to
+# decapsulate the capture with the configuration file of its own SAs only is
+# subtracted.
+
+set -e
+
+GEN="$1"
+IPDECAP="$2"
+DATA="$3"
+
+: ${BENCH_SAS:=1000000}
+: ${BENCH_CONF_ALGOS:=null_enc aes128-cbc aes128-gcm16}
+: ${BENCH_RUNS:=3}
+
+if [ "$(date +%N)" = "N" ]; then
+  echo "date +%N is not supported, cannot measure time" >&2
+  exit 1
+fi
+
+now_ns() {
+  date +%s%N
+}
+
+# Best time of BENCH_RUNS decapsulations of capture $1 with configuration file $2
+best_run() {
+  best=""
+  run=0
+  while [ $run -lt "$BENCH_RUNS" ]; do
+    start=$(now_ns)
+    "$IPDECAP" -i "$1" -o /dev/null -c "$2"
+    end=$(now_ns)
+    elapsed=$((end - start))
+    if [ -z "$best" ] || [ $elapsed -lt "$best" ]; then
+      best=$elapsed
+    fi
+    run=$((run + 1))
+  done
+  echo "$best"
+}
+
+mkdir -p "$DATA"
+if [ "$(cat "$DATA/conf-params" 2>/dev/null)" != "$BENCH_SAS" ]; then
+  rm -f "$DATA"/conf-*
+  echo "$BENCH_SAS" > "$DATA/conf-params"
+fi
+
+echo "*** $($IPDECAP -V | head -1), ESP configuration files of $BENCH_SAS SAs, best of $BENCH_RUNS runs"
+printf "%-24s %10s %12s %10s %12s\n" "encryption" "SAs" "bytes" "seconds" "SAs/s"
+
+for algo in $BENCH_CONF_ALGOS; do
+
+  cap="$DATA/conf-$algo.cap"
+  [ -f "$DATA/conf-$algo-large.conf" ] || "$GEN" -t esp -e "$algo" -n 1000 -o "$cap" \
+    -c "$DATA/conf-$algo-large.conf" -x "$BENCH_SAS" > /dev/null
+  [ -f "$DATA/conf-$algo.conf" ] || "$GEN" -t esp -e "$algo" -n 1000 -o "$cap" \
+    -c "$DATA/conf-$algo.conf" > /dev/null
+
+  # The extra SAs must not change how the packets are decapsulated
+  warnings=$("$IPDECAP" -v -i "$cap" -o /dev/null -c "$DATA/conf-$algo-large.conf" 2>&1 \
+    | grep -c -i "warning\|no suitable\|ignoring" || true)
+
+  base=$(best_run "$cap" "$DATA/conf-$algo.conf")
+  large=$(best_run "$cap" "$DATA/conf-$algo-large.conf")
+
+  awk -v t="$algo" -v n="$BENCH_SAS" -v b="$(wc -c < "$DATA/conf-$algo-large.conf")" -v ns="$((large - base))" 'BEGIN {
+    s = ns / 1e9
+    printf "%-24s %10d %12d %10.3f %12.0f\n", t, n, b, s, (s > 0 ? n / s : 0)
+  }'
+
+  if [ "$warnings" -ne 0 ]; then
+    echo "warning: $algo: $warnings packets not decapsulated with $DATA/conf-$algo-large.conf" >&2
+  fi
+done
@@ -0,0 +1,847 @@
+/*
+  Copyright (c) 2012-2016 Loïc Pefferkorn <loic-ipdecap@loicp.eu>
+  ipdecap [http://loicpefferkorn.net/ipdecap]
+
+  This file is part of ipdecap.
+
+  Ipdecap is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Ipdecap is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ipdecap.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Synthetic tunnel traffic generator for benchmarks: writes large captures of
+ * IPIP, 6in4, GRE, 802.1Q tagged, ESP or nested encapsulated packets, the same for a
+ * given seed, and the ESP configuration file matching the generated SAs.
+ * Built with: make gentraffic
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <pcap.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+#include <net/ethernet.h>
+#include <arpa/inet.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/provider.h>
+#endif
+
+#include "config.h"
+#include "ipdecap.h"
+#include "cbc_batch.h"
+#include "gre.h"
+#include "esp.h"
+
+#define GEN_MAX_SIZES     16
+#define GEN_MAX_FLOWS     254     // Last byte of the tunnel endpoints addresses
+#define GEN_MIN_INNER     (sizeof(struct ip) + sizeof(struct udphdr))
+#define GEN_MIN_INNER6    (sizeof(struct ip6_hdr) + sizeof(struct udphdr))
+#define GEN_MAX_INNER     9000
+#define GEN_MAX_OUTER     (sizeof(struct ip6_hdr) + 8)  // With a destination options header
+#define GEN_MAX_TAGS      8       // VLAN tags of -t vlan packets
+#define GEN_AUTH_METHOD   "hmac_sha1-96"
+#define GEN_AUTH_KEY_LEN  20
+
+typedef enum gen_type_t { GEN_IPIP, GEN_6IN4, GEN_GRE, GEN_VLAN, GEN_ESP, GEN_GRE_ESP, GEN_IPIP_GRE } gen_type_t;
+
+static const char *type_names[] = { "ipip", "6in4", "gre", "vlan", "esp", "gre-esp", "ipip-gre" };
+
+// GRE flags combinations, used in turn
+static const u_int16_t gre_flags[] = { 0, GRE_KEY, GRE_SEQ, GRE_CHECKSUM, GRE_KEY | GRE_SEQ, GRE_CHECKSUM | GRE_KEY | GRE_SEQ };
+
+// Inner packet sizes, and the weight of each one
+typedef struct size_dist_t {
+  int count;
+  int size[GEN_MAX_SIZES];
+  int weight[GEN_MAX_SIZES];
+  int total;
+} size_dist_t;
+
+// Security association of a tunnel, written to the ESP configuration file
+typedef struct gen_sa_t {
+  u_int32_t spi;
+  u_int32_t seq;
+  u_char key[MY_MAX_KEY_LENGTH];
+  int key_len;              // With the AEAD salt
+  u_char auth_key[GEN_AUTH_KEY_LEN];
+  EVP_CIPHER_CTX *ctx;
+} gen_sa_t;
+
+struct global_args_t {
+  gen_type_t type;
+  unsigned long packets;
+  int flows;
+  u_int64_t seed;
+  size_dist_t sizes;
+  crypt_method_t *crypt_method;
+  auth_method_t *auth_method;   // NULL for AEAD algorithms, they have their own ICV
+  char *output;
+  char *conf;
+  bool ipv6;                    // IPv6 outer header
+  unsigned long extra_sas;      // SAs of the configuration file no packet uses
+  int tags;                     // VLAN tags, 802.1ad service tags then a 802.1Q tag
+} global_args;
+
+static u_int64_t prng_state;
+
+/*
+ * xorshift64* generator: captures have to be the same on every platform,
+ * whatever the libc rand() implementation
+ *
+ */
+static u_int64_t prng(void) {
+
+  prng_state ^= prng_state >> 12;
+  prng_state ^= prng_state << 25;
+  prng_state ^= prng_state >> 27;
+  return prng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static void prng_fill(u_char *buf, int len) {
+
+  u_int64_t r = 0;
+  int i;
+
+  for (i = 0; i < len; i++) {
+    if (i % 8 == 0)
+      r = prng();
+    buf[i] = r & 0xff;
+    r >>= 8;
+  }
+}
+
+void usage(void) {
+  printf("Usage: gentraffic -t type -o output.cap [options]\n"
+  "Generate a capture of synthetic tunnel traffic, for benchmarks.\n"
+  "\n"
+  "  -t, --type TYPE         ipip, 6in4, gre (flags combinations in turn), vlan (802.1Q tagged IPIP), esp,\n"
+  "                          gre-esp (GRE tunnel inside ESP) or ipip-gre (IPIP tunnel inside GRE)\n"
+  "  -e, --encryption ALGO   ESP encryption algorithm, as in the ESP configuration file (default: aes128-cbc)\n"
+  "  -o, --output FILE       pcap file to write\n"
+  "  -c, --conf FILE         ESP configuration file to write, for -t esp and gre-esp\n"
+  "  -n, --packets N         number of packets (default: 100000)\n"
+  "  -s, --sizes DIST        inner packets sizes: imix, a size, or size:weight,... (default: imix)\n"
+  "                          6in4 packets are at least %zu bytes\n"
+  "  -f, --flows N           number of tunnels, one SA each for ESP (default: 4)\n"
+  "  -S, --seed N            seed of the generated contents (default: 1)\n"
+  "  -6, --ipv6              IPv6 outer header (4in6, 6in6, GRE and ESP over IPv6), with a\n"
+  "                          destination options extension header every other packet\n"
+  "  -q, --tags N            VLAN tags of -t vlan packets: N-1 802.1ad (QinQ) service tags, then\n"
+  "                          the 802.1Q tag (default: 1, at most %i)\n"
+  "  -x, --extra-sas N       also write N SAs no packet uses to the ESP configuration file,\n"
+  "                          to measure its load time (default: 0)\n"
+  "  -l, --list              list the ESP encryption algorithms\n"
+  "\n"
+  "Non-AEAD ESP algorithms use %s authentication.\n", GEN_MIN_INNER6, GEN_MAX_TAGS, GEN_AUTH_METHOD);
+}
+
+/*
+ * Parse a sizes distribution: imix (7:4:1 mix of 40, 576 and 1500 bytes),
+ * a single size, or a list of size:weight
+ *
+ */
+static void parse_sizes(const char *arg, size_dist_t *dist) {
+
+  char *copy, *token, *saveptr = NULL, *end;
+  long size, weight;
+
+  if (strcmp(arg, "imix") == 0)
+    arg = "40:7,576:4,1500:1";
+
+  memset(dist, 0, sizeof(size_dist_t));
+  if ((copy = strdup(arg)) == NULL)
+    error("Cannot malloc");
+
+  for (token = strtok_r(copy, ",", &saveptr); token != NULL; token = strtok_r(NULL, ",", &saveptr)) {
+
+    if (dist->count == GEN_MAX_SIZES)
+      error("Too many sizes, at most %i\n", GEN_MAX_SIZES);
+
+    errno = 0;
+    size = strtol(token, &end, 10);
+    weight = 1;
+    if (errno == 0 && *end == ':')
+      weight = strtol(end + 1, &end, 10);
+
+    if (errno != 0 || *end != '\0' || weight <= 0 || weight > 1000)
+      error("Invalid sizes distribution: %s\n", arg);
+
+    if (size < (long) GEN_MIN_INNER || size > GEN_MAX_INNER)
+      error("Invalid size %li, must be between %zu and %i\n", size, GEN_MIN_INNER, GEN_MAX_INNER);
+
+    dist->size[dist->count] = size;
+    dist->weight[dist->count] = weight;
+    dist->total += weight;
+    dist->count++;
+  }
+
+  if (dist->count == 0)
+    error("Invalid sizes distribution: %s\n", arg);
+
+  free(copy);
+}
+
+static int pick_size(const size_dist_t *dist) {
+
+  int i, r = prng() % dist->total;
+
+  for (i = 0; r >= dist->weight[i]; i++)
+    r -= dist->weight[i];
+
+  return dist->size[i];
+}
+
+static u_int16_t checksum(const u_char *data, int len) {
+
+  u_int32_t sum = 0;
+  int i;
+
+  for (i = 0; i + 1 < len; i += 2)
+    sum += (data[i] << 8) | data[i+1];
+  if (len & 1)
+    sum += data[len-1] << 8;
+
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+
+  return htons(~sum & 0xffff);
+}
+
+static void write_ipv4_header(u_char *buf, int total_len, int protocol, u_int32_t src, u_int32_t dst, u_int16_t id) {
+
+  struct ip ip_hdr;
+
+  memset(&ip_hdr, 0, sizeof(struct ip));
+  ip_hdr.ip_v = 4;
+  ip_hdr.ip_hl = sizeof(struct ip) / 4;
+  ip_hdr.ip_len = htons(total_len);
+  ip_hdr.ip_id = htons(id);
+  ip_hdr.ip_ttl = 64;
+  ip_hdr.ip_p = protocol;
+  ip_hdr.ip_src.s_addr = htonl(src);
+  ip_hdr.ip_dst.s_addr = htonl(dst);
+  ip_hdr.ip_sum = checksum((u_char *) &ip_hdr, sizeof(struct ip));
+  memcpy(buf, &ip_hdr, sizeof(struct ip));
+}
+
+/*
+ * Write the outer header of a tunnel packet of len bytes, just before it at buf
+ * Returns the header length.
+ *
+ */
+static int write_outer_header(u_char *buf, int len, int protocol, int flow, unsigned long num) {
+
+  struct ip6_hdr ip6_hdr;
+  int hdr_len = sizeof(struct ip6_hdr);
+
+  if (!global_args.ipv6) {
+    // 192.0.2.<flow> -> 198.51.100.<flow>
+    write_ipv4_header(buf - sizeof(struct ip), sizeof(struct ip) + len, protocol,
+      0xc0000200 | (flow + 1), 0xc6336400 | (flow + 1), num);
+    return sizeof(struct ip);
+  }
+
+  // Destination options header with a PadN option, for the extension headers walk
+  if (num % 2 == 1) {
+    hdr_len += 8;
+    memset(buf - 8, 0, 8);
+    buf[-8] = protocol;
+    buf[-6] = 1;
+    buf[-5] = 4;
+    protocol = IPPROTO_DSTOPTS;
+  }
+
+  // 2001:db8:0:1::<flow> -> 2001:db8:0:2::<flow>
+  memset(&ip6_hdr, 0, sizeof(struct ip6_hdr));
+  ip6_hdr.ip6_flow = htonl(6 << 28);
+  ip6_hdr.ip6_plen = htons(hdr_len - sizeof(struct ip6_hdr) + len);
+  ip6_hdr.ip6_nxt = protocol;
+  ip6_hdr.ip6_hlim = 64;
+  ip6_hdr.ip6_src.s6_addr[0] = ip6_hdr.ip6_dst.s6_addr[0] = 0x20;
+  ip6_hdr.ip6_src.s6_addr[1] = ip6_hdr.ip6_dst.s6_addr[1] = 0x01;
+  ip6_hdr.ip6_src.s6_addr[2] = ip6_hdr.ip6_dst.s6_addr[2] = 0x0d;
+  ip6_hdr.ip6_src.s6_addr[3] = ip6_hdr.ip6_dst.s6_addr[3] = 0xb8;
+  ip6_hdr.ip6_src.s6_addr[7] = 1;
+  ip6_hdr.ip6_dst.s6_addr[7] = 2;
+  ip6_hdr.ip6_src.s6_addr[15] = ip6_hdr.ip6_dst.s6_addr[15] = flow + 1;
+  memcpy(buf - hdr_len, &ip6_hdr, sizeof(struct ip6_hdr));
+
+  return hdr_len;
+}
+
+/*
+ * Move a tunnel packet after the IPv4 header of an enclosing tunnel, for nested encapsulations
+ * Returns the length with this header.
+ *
+ */
+static int write_nested_header(u_char *buf, int len, int protocol, int flow, unsigned long num) {
+
+  // 172.16.<flow>.1 -> 172.17.<flow>.1
+  memmove(buf + sizeof(struct ip), buf, len);
+  write_ipv4_header(buf, sizeof(struct ip) + len, protocol, 0xac100001 | (flow + 1) << 8, 0xac110001 | (flow + 1) << 8, num);
+
+  return sizeof(struct ip) + len;
+}
+
+/*
+ * Write the inner packet of a tunnel: UDP datagram over IPv4,
+ * or IPv6 for 6in4, with random contents.
+ * Returns the IP protocol number of the inner packet.
+ *
+ */
+static int write_inner_packet(u_char *buf, int size, int flow, unsigned long num) {
+
+  struct ip6_hdr ip6_hdr;
+  struct udphdr udp_hdr;
+  int hdr_len;
+
+  if (global_args.type == GEN_6IN4) {
+    memset(&ip6_hdr, 0, sizeof(struct ip6_hdr));
+    ip6_hdr.ip6_flow = htonl(6 << 28);
+    ip6_hdr.ip6_plen = htons(size - sizeof(struct ip6_hdr));
+    ip6_hdr.ip6_nxt = IPPROTO_UDP;
+    ip6_hdr.ip6_hlim = 64;
+    // 2001:db8:1:<flow>::1 -> 2001:db8:2:<flow>::1
+    ip6_hdr.ip6_src.s6_addr[0] = ip6_hdr.ip6_dst.s6_addr[0] = 0x20;
+    ip6_hdr.ip6_src.s6_addr[1] = ip6_hdr.ip6_dst.s6_addr[1] = 0x01;
+    ip6_hdr.ip6_src.s6_addr[2] = ip6_hdr.ip6_dst.s6_addr[2] = 0x0d;
+    ip6_hdr.ip6_src.s6_addr[3] = ip6_hdr.ip6_dst.s6_addr[3] = 0xb8;
+    ip6_hdr.ip6_src.s6_addr[5] = 1;
+    ip6_hdr.ip6_dst.s6_addr[5] = 2;
+    ip6_hdr.ip6_src.s6_addr[7] = ip6_hdr.ip6_dst.s6_addr[7] = flow + 1;
+    ip6_hdr.ip6_src.s6_addr[15] = ip6_hdr.ip6_dst.s6_addr[15] = 1;
+    memcpy(buf, &ip6_hdr, sizeof(struct ip6_hdr));
+    hdr_len = sizeof(struct ip6_hdr);
+  } else {
+    // 10.1.<flow>.1 -> 10.2.<flow>.1
+    write_ipv4_header(buf, size, IPPROTO_UDP, 0x0a010001 | (flow + 1) << 8, 0x0a020001 | (flow + 1) << 8, num);
+    hdr_len = sizeof(struct ip);
+  }
+
+  udp_hdr.uh_sport = htons(10000 + flow);
+  udp_hdr.uh_dport = htons(20000 + flow);
+  udp_hdr.uh_ulen = htons(size - hdr_len);
+  udp_hdr.uh_sum = 0;
+  memcpy(buf + hdr_len, &udp_hdr, sizeof(struct udphdr));
+  prng_fill(buf + hdr_len + sizeof(struct udphdr), size - hdr_len - sizeof(struct udphdr));
+
+  return global_args.type == GEN_6IN4 ? IPPROTO_IPV6 : IPPROTO_IPIP;
+}
+
+/*
+ * Write the GRE header with the flags of packet num, then move the inner packet after it
+ * Returns the GRE packet length.
+ *
+ */
+static int write_gre_packet(u_char *buf, int inner_len, unsigned long num, int flow) {
+
+  u_int16_t flags = gre_flags[num % (sizeof(gre_flags) / sizeof(gre_flags[0]))];
+  u_char hdr[GRE_HEADERLEN + 12];
+  u_int16_t value;
+  u_int32_t value32;
+  int hdr_len = GRE_HEADERLEN;
+
+  value = htons(flags);
+  memcpy(hdr, &value, 2);
+  value = htons(ETHERTYPE_IP);
+  memcpy(hdr + 2, &value, 2);
+
+  if (flags & GRE_CHECKSUM) {
+    memset(hdr + hdr_len, 0, 4);  // Computed once the packet is complete
+    hdr_len += 4;
+  }
+  if (flags & GRE_KEY) {
+    value32 = htonl(flow + 1);
+    memcpy(hdr + hdr_len, &value32, 4);
+    hdr_len += 4;
+  }
+  if (flags & GRE_SEQ) {
+    value32 = htonl(num);
+    memcpy(hdr + hdr_len, &value32, 4);
+    hdr_len += 4;
+  }
+
+  memmove(buf + hdr_len, buf, inner_len);
+  memcpy(buf, hdr, hdr_len);
+
+  if (flags & GRE_CHECKSUM) {
+    value = checksum(buf, hdr_len + inner_len);
+    memcpy(buf + GRE_HEADERLEN, &value, 2);
+  }
+
+  return hdr_len + inner_len;
+}
+
+/*
+ * Encrypt the inner packet in place into an ESP packet of the SA: header,
+ * IV, encrypted payload and trailer, then ICV. Padding follows what
+ * process_esp_packet() expects: up to the cipher block size, or 4 bytes.
+ * Returns the ESP packet length.
+ *
+ */
+static int write_esp_packet(u_char *buf, int inner_len, int next_header, gen_sa_t *sa) {
+
+  crypt_method_t *cm = global_args.crypt_method;
+  u_char iv[EVP_MAX_IV_LENGTH], nonce[ESP_AEAD_NONCE_LEN];
+  u_char *payload;
+  u_int32_t value32;
+  unsigned int md_len;
+  int iv_len, block_size, pad_len, payload_len, len, i;
+
+  if (cm->openssl_cipher == NULL) {
+    iv_len = 0;
+    block_size = 4;
+  } else if (cm->icv_len > 0) {
+    iv_len = ESP_AEAD_IV_LEN;
+    block_size = 4;
+  } else {
+    iv_len = EVP_CIPHER_CTX_iv_length(sa->ctx);
+    block_size = EVP_CIPHER_CTX_block_size(sa->ctx);
+  }
+
+  // CTR mode is a stream: block size is 1 and pad_len has to be 0
+  pad_len = (block_size - (inner_len + 2) % block_size) % block_size;
+  payload_len = inner_len + pad_len + 2;
+  payload = buf + ESP_SPI_LEN + iv_len;
+
+  memmove(payload, buf, inner_len);
+  for (i = 0; i < pad_len; i++)
+    payload[inner_len + i] = i + 1;
+  payload[inner_len + pad_len] = pad_len;
+  payload[inner_len + pad_len + 1] = next_header;
+
+  sa->seq++;
+  value32 = htonl(sa->spi);
+  memcpy(buf, &value32, 4);
+  value32 = htonl(sa->seq);
+  memcpy(buf + 4, &value32, 4);
+  prng_fill(iv, iv_len);
+  memcpy(buf + ESP_SPI_LEN, iv, iv_len);
+
+  if (cm->icv_len > 0) {
+    memcpy(nonce, sa->key + sa->key_len - cm->salt_len, cm->salt_len);
+    memcpy(nonce + cm->salt_len, iv, ESP_AEAD_IV_LEN);
+    if (EVP_EncryptInit_ex(sa->ctx, NULL, NULL, NULL, nonce) != 1
+      || EVP_EncryptUpdate(sa->ctx, NULL, &len, buf, ESP_AEAD_AAD_LEN) != 1
+      || EVP_EncryptUpdate(sa->ctx, payload, &len, payload, payload_len) != 1
+      || EVP_EncryptFinal_ex(sa->ctx, payload + len, &len) != 1
+      || EVP_CIPHER_CTX_ctrl(sa->ctx, EVP_CTRL_AEAD_GET_TAG, cm->icv_len, payload + payload_len) != 1)
+      error("Cannot encrypt with %s\n", cm->openssl_cipher);
+    return ESP_SPI_LEN + iv_len + payload_len + cm->icv_len;
+  }
+
+  if (cm->openssl_cipher != NULL
+    && (EVP_EncryptInit_ex(sa->ctx, NULL, NULL, NULL, iv) != 1
+      || EVP_EncryptUpdate(sa->ctx, payload, &len, payload, payload_len) != 1))
+    error("Cannot encrypt with %s\n", cm->openssl_cipher);
+
+  if (global_args.auth_method == NULL)
+    return ESP_SPI_LEN + iv_len + payload_len;
+
+  // Truncated HMAC over the ESP header, IV and encrypted payload
+  if (HMAC(EVP_get_digestbyname(global_args.auth_method->openssl_auth), sa->auth_key, GEN_AUTH_KEY_LEN,
+        buf, ESP_SPI_LEN + iv_len + payload_len, payload + payload_len, &md_len) == NULL)
+    error("Cannot compute %s\n", global_args.auth_method->name);
+
+  return ESP_SPI_LEN + iv_len + payload_len + global_args.auth_method->len;
+}
+
+/*
+ * Write a line of the ESP configuration file, hex digits are formatted by hand
+ * as millions of SAs may be written
+ *
+ */
+static void conf_write_sa(FILE *fp, const char *src, const char *dst, u_int32_t spi,
+                          const u_char *key, int key_len, const u_char *auth_key) {
+
+  static const char hex[] = "0123456789abcdef";
+  char line[INET6_ADDRSTRLEN * 2 + 64 + 4 * (MY_MAX_KEY_LENGTH + GEN_AUTH_KEY_LEN)];
+  char *c = line;
+  int i;
+
+  c += sprintf(c, "%s\t%s\t%s\t%s\t", src, dst, global_args.crypt_method->name,
+    global_args.auth_method != NULL ? global_args.auth_method->name : "null_auth");
+
+  if (key_len == 0)
+    *c++ = '0';
+  else
+    for (*c++ = '0', *c++ = 'x', i = 0; i < key_len; i++) {
+      *c++ = hex[key[i] >> 4];
+      *c++ = hex[key[i] & 0xf];
+    }
+
+  c += sprintf(c, "\t0x%08x", spi);
+
+  if (global_args.auth_method != NULL)
+    for (*c++ = '\t', *c++ = '0', *c++ = 'x', i = 0; i < GEN_AUTH_KEY_LEN; i++) {
+      *c++ = hex[auth_key[i] >> 4];
+      *c++ = hex[auth_key[i] & 0xf];
+    }
+
+  *c++ = '\n';
+  fwrite(line, 1, c - line, fp);
+}
+
+/*
+ * SAs of the ESP configuration file no packet uses: 10.0.0.0/8 -> 172.16.0.0/12 tunnels
+ * (2001:db8:1::/64 -> 2001:db8:2::/64 with -6), the SPIs of the generated flows are below 0x10000000.
+ * Their keys do not change the capture contents.
+ *
+ */
+static void conf_write_extra_sas(FILE *fp) {
+
+  char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+  u_char key[MY_MAX_KEY_LENGTH], auth_key[GEN_AUTH_KEY_LEN];
+  u_int64_t state = prng_state;
+  const EVP_CIPHER *cipher;
+  unsigned long i;
+  int key_len = 0;
+
+  if (global_args.crypt_method->openssl_cipher != NULL
+    && (cipher = EVP_get_cipherbyname(global_args.crypt_method->openssl_cipher)) != NULL)
+    key_len = EVP_CIPHER_key_length(cipher) + global_args.crypt_method->salt_len;
+
+  for (i = 0; i < global_args.extra_sas; i++) {
+
+    if (global_args.ipv6) {
+      sprintf(src, "2001:db8:1::%lx:%lx", i >> 16, i & 0xffff);
+      sprintf(dst, "2001:db8:2::%lx:%lx", i >> 16, i & 0xffff);
+    } else {
+      sprintf(src, "10.%lu.%lu.%lu", (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+      sprintf(dst, "172.%lu.%lu.%lu", 16 + ((i >> 16) & 0xf), (i >> 8) & 0xff, i & 0xff);
+    }
+
+    prng_fill(key, key_len);
+    prng_fill(auth_key, GEN_AUTH_KEY_LEN);
+    conf_write_sa(fp, src, dst, 0x10000000 + i, key, key_len, auth_key);
+  }
+
+  prng_state = state;
+}
+
+/*
+ * Keys and cipher contexts of the SAs, one per flow, and the ESP configuration file
+ *
+ */
+static gen_sa_t * sa_init(void) {
+
+  crypt_method_t *cm = global_args.crypt_method;
+  const EVP_CIPHER *cipher = NULL;
+  gen_sa_t *sa;
+  FILE *fp = NULL;
+  char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+  int flow;
+
+  MALLOC(sa, global_args.flows, gen_sa_t);
+  memset(sa, 0, global_args.flows * sizeof(gen_sa_t));
+
+  if (cm->openssl_cipher != NULL && (cipher = EVP_get_cipherbyname(cm->openssl_cipher)) == NULL)
+    error("Cipher %s is not supported by OpenSSL\n", cm->openssl_cipher);
+
+  if (global_args.conf != NULL && (fp = fopen(global_args.conf, "w")) == NULL)
+    error("Cannot create ESP configuration file %s\n", global_args.conf);
+
+  for (flow = 0; flow < global_args.flows; flow++) {
+
+    sa[flow].spi = 0x1000 + flow;
+    sa[flow].seq = 0;
+    prng_fill(sa[flow].auth_key, GEN_AUTH_KEY_LEN);
+
+    if (cipher != NULL) {
+      sa[flow].key_len = EVP_CIPHER_key_length(cipher) + cm->salt_len;
+      prng_fill(sa[flow].key, sa[flow].key_len);
+
+      if ((sa[flow].ctx = EVP_CIPHER_CTX_new()) == NULL)
+        error("Cannot create cipher context\n");
+      if (EVP_EncryptInit_ex(sa[flow].ctx, cipher, NULL, NULL, NULL) != 1
+        || (cm->icv_len > 0 && EVP_CIPHER_CTX_ctrl(sa[flow].ctx, EVP_CTRL_AEAD_SET_IVLEN, ESP_AEAD_NONCE_LEN, NULL) != 1)
+        || EVP_EncryptInit_ex(sa[flow].ctx, NULL, NULL, sa[flow].key, NULL) != 1)
+        error("Cannot initialize cipher %s\n", cm->openssl_cipher);
+      EVP_CIPHER_CTX_set_padding(sa[flow].ctx, 0);
+    }
+
+    if (fp == NULL)
+      continue;
+
+    if (global_args.ipv6) {
+      sprintf(src, "2001:db8:0:1::%x", flow + 1);
+      sprintf(dst, "2001:db8:0:2::%x", flow + 1);
+    } else {
+      sprintf(src, "192.0.2.%i", flow + 1);
+      sprintf(dst, "198.51.100.%i", flow + 1);
+    }
+
+    conf_write_sa(fp, src, dst, sa[flow].spi, sa[flow].key, sa[flow].key_len, sa[flow].auth_key);
+  }
+
+  if (fp != NULL) {
+    conf_write_extra_sas(fp);
+    fclose(fp);
+  }
+
+  return sa;
+}
+
+static void parse_args(int argc, char **argv) {
+
+  const char *short_opt = "t:e:o:c:n:s:f:S:6q:x:lh";
+  const struct option long_opt[] = {
+    {"type",        required_argument,  NULL, 't'},
+    {"encryption",  required_argument,  NULL, 'e'},
+    {"output",      required_argument,  NULL, 'o'},
+    {"conf",        required_argument,  NULL, 'c'},
+    {"packets",     required_argument,  NULL, 'n'},
+    {"sizes",       required_argument,  NULL, 's'},
+    {"flows",       required_argument,  NULL, 'f'},
+    {"seed",        required_argument,  NULL, 'S'},
+    {"ipv6",        no_argument,        NULL, '6'},
+    {"tags",        required_argument,  NULL, 'q'},
+    {"extra-sas",   required_argument,  NULL, 'x'},
+    {"list",        no_argument,        NULL, 'l'},
+    {"help",        no_argument,        NULL, 'h'},
+    {NULL,          0,                  NULL, 0}
+  };
+  crypt_method_t *cm;
+  auth_method_t *am;
+  char *end;
+  unsigned int i;
+  int opt;
+
+  global_args.type = -1;
+  global_args.packets = 100000;
+  global_args.flows = 4;
+  global_args.seed = 1;
+  global_args.crypt_method = &aes_128_cbc;
+  global_args.output = NULL;
+  global_args.conf = NULL;
+  global_args.ipv6 = false;
+  global_args.tags = 1;
+  global_args.extra_sas = 0;
+  parse_sizes("imix", &global_args.sizes);
+
+  while ((opt = getopt_long(argc, argv, short_opt, long_opt, NULL)) != -1) {
+    switch (opt) {
+
+      case 't':
+        for (i = 0; i < sizeof(type_names) / sizeof(type_names[0]); i++)
+          if (strcmp(optarg, type_names[i]) == 0)
+            global_args.type = i;
+        if ((int) global_args.type == -1)
+          error("Invalid type: %s\n", optarg);
+        break;
+
+      case 'e':
+        for (cm = crypt_method_list; cm != NULL && strcmp(cm->name, optarg) != 0; cm = cm->next)
+          ;
+        if (cm == NULL)
+          error("Unknown encryption algorithm: %s\n", optarg);
+        global_args.crypt_method = cm;
+        break;
+
+      case 'o':
+        global_args.output = optarg;
+        break;
+
+      case 'c':
+        global_args.conf = optarg;
+        break;
+
+      case 'n':
+        errno = 0;
+        global_args.packets = strtoul(optarg, &end, 10);
+        if (errno != 0 || *end != '\0' || *optarg == '-' || global_args.packets == 0)
+          error("Invalid number of packets: %s\n", optarg);
+        break;
+
+      case 's':
+        parse_sizes(optarg, &global_args.sizes);
+        break;
+
+      case 'f':
+        errno = 0;
+        global_args.flows = strtol(optarg, &end, 10);
+        if (errno != 0 || *end != '\0' || global_args.flows < 1 || global_args.flows > GEN_MAX_FLOWS)
+          error("Invalid number of flows: %s, must be between 1 and %i\n", optarg, GEN_MAX_FLOWS);
+        break;
+
+      case 'S':
+        errno = 0;
+        global_args.seed = strtoull(optarg, &end, 10);
+        if (errno != 0 || *end != '\0')
+          error("Invalid seed: %s\n", optarg);
+        break;
+
+      case '6':
+        global_args.ipv6 = true;
+        break;
+
+      case 'q':
+        errno = 0;
+        global_args.tags = strtol(optarg, &end, 10);
+        if (errno != 0 || *end != '\0' || global_args.tags < 1 || global_args.tags > GEN_MAX_TAGS)
+          error("Invalid number of VLAN tags: %s, must be between 1 and %i\n", optarg, GEN_MAX_TAGS);
+        break;
+
+      case 'x':
+        errno = 0;
+        global_args.extra_sas = strtoul(optarg, &end, 10);
+        if (errno != 0 || *end != '\0' || *optarg == '-' || global_args.extra_sas > 0xffffff)
+          error("Invalid number of extra SAs: %s, must be at most %i\n", optarg, 0xffffff);
+        break;
+
+      case 'l':
+        for (cm = crypt_method_list; cm != NULL; cm = cm->next)
+          printf("%s\n", cm->name);
+        exit(EXIT_SUCCESS);
+
+      case 'h':
+        usage();
+        exit(EXIT_SUCCESS);
+
+      default:
+        usage();
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  if ((int) global_args.type == -1 || global_args.output == NULL) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+
+  global_args.auth_method = NULL;
+  if (global_args.crypt_method->icv_len == 0)
+    for (am = auth_method_list; am != NULL && global_args.auth_method == NULL; am = am->next)
+      if (strcmp(am->name, GEN_AUTH_METHOD) == 0)
+        global_args.auth_method = am;
+}
+
+int main(int argc, char **argv) {
+
+  struct pcap_pkthdr pkthdr;
+  pcap_t *pcap;
+  pcap_dumper_t *dumper;
+  gen_sa_t *sa = NULL;
+  u_char *packet, *start, *tunnel;
+  u_char eth[sizeof(struct ether_header) + GEN_MAX_TAGS * 4];
+  unsigned long num, bytes = 0;
+  int flow, inner_len, tunnel_len, protocol, eth_len, outer_len, i;
+  u_int16_t ethertype;
+
+  parse_args(argc, argv);
+
+  // Seed 0 would only give zeros
+  prng_state = global_args.seed * 0x9E3779B97F4A7C15ULL + 1;
+
+  if (global_args.type == GEN_ESP || global_args.type == GEN_GRE_ESP) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    // Same providers as ipdecap, des-cbc is in the legacy one
+    OSSL_PROVIDER_load(NULL, "legacy");
+    if (OSSL_PROVIDER_load(NULL, "default") == NULL)
+      error("Cannot load OpenSSL default provider\n");
+#endif
+    sa = sa_init();
+  }
+
+  MALLOC(packet, MAXIMUM_SNAPLEN, u_char);
+  memset(packet, 0, MAXIMUM_SNAPLEN);
+
+  if ((pcap = pcap_open_dead(DLT_EN10MB, MAXIMUM_SNAPLEN)) == NULL)
+    error("pcap_open_dead() failed\n");
+  if ((dumper = pcap_dump_open(pcap, global_args.output)) == NULL)
+    error("Cannot create file %s: %s\n", global_args.output, pcap_geterr(pcap));
+
+  // Ethernet header: 02:00:00:00:00:01 -> 02:00:00:00:00:02, optional 802.1ad service
+  // tags (VLAN ids 100, 101...) and 802.1Q tag
+  memset(eth, 0, sizeof(eth));
+  eth[5] = 2;
+  eth[0] = eth[6] = 2;
+  eth[11] = 1;
+  eth_len = sizeof(struct ether_header);
+  if (global_args.type == GEN_VLAN) {
+    for (i = 0; i < global_args.tags; i++) {
+      ethertype = htons(i < global_args.tags - 1 ? ETHERTYPE_8021AD : ETHERTYPE_VLAN);
+      memcpy(eth + 12 + i * 4, &ethertype, 2);
+      ethertype = htons(100 + i);
+      memcpy(eth + 14 + i * 4, &ethertype, 2);
+    }
+    eth_len += global_args.tags * 4;
+  }
+  ethertype = htons(global_args.ipv6 ? ETHERTYPE_IPV6 : ETHERTYPE_IP);
+  memcpy(eth + eth_len - 2, &ethertype, 2);
+
+  // Outer headers length varies, they are written backwards from the tunnel packet
+  tunnel = packet + sizeof(eth) + GEN_MAX_OUTER;
+
+  for (num = 0; num < global_args.packets; num++) {
+
+    flow = num % global_args.flows;
+
+    if (global_args.type == GEN_VLAN) {
+      ethertype = htons(flow + 1);  // VLAN id of the 802.1Q tag, priority 0
+      memcpy(eth + eth_len - 4, &ethertype, 2);
+    }
+
+    inner_len = pick_size(&global_args.sizes);
+    if (global_args.type == GEN_6IN4 && inner_len < (int) GEN_MIN_INNER6)
+      inner_len = GEN_MIN_INNER6;
+    protocol = write_inner_packet(tunnel, inner_len, flow, num);
+    tunnel_len = inner_len;
+
+    if (global_args.type == GEN_GRE) {
+      tunnel_len = write_gre_packet(tunnel, inner_len, num, flow);
+      protocol = IPPROTO_GRE;
+    } else if (global_args.type == GEN_ESP) {
+      tunnel_len = write_esp_packet(tunnel, inner_len, protocol, &sa[flow]);
+      protocol = IPPROTO_ESP;
+    } else if (global_args.type == GEN_GRE_ESP) {
+      tunnel_len = write_gre_packet(tunnel, inner_len, num, flow);
+      tunnel_len = write_nested_header(tunnel, tunnel_len, IPPROTO_GRE, flow, num);
+      tunnel_len = write_esp_packet(tunnel, tunnel_len, IPPROTO_IPIP, &sa[flow]);
+      protocol = IPPROTO_ESP;
+    } else if (global_args.type == GEN_IPIP_GRE) {
+      tunnel_len = write_nested_header(tunnel, inner_len, IPPROTO_IPIP, flow, num);
+      tunnel_len = write_gre_packet(tunnel, tunnel_len, num, flow);
+      protocol = IPPROTO_GRE;
+    }
+
+    outer_len = write_outer_header(tunnel, tunnel_len, protocol, flow, num);
+    start = tunnel - outer_len - eth_len;
+    memcpy(start, eth, eth_len);
+
+    // One packet per microsecond
+    pkthdr.ts.tv_sec = 1000000000 + num / 1000000;
+    pkthdr.ts.tv_usec = num % 1000000;
+    pkthdr.caplen = pkthdr.len = eth_len + outer_len + tunnel_len;
+    pcap_dump((u_char *) dumper, &pkthdr, start);
+    bytes += pkthdr.caplen;
+  }
+
+  pcap_dump_close(dumper);
+  pcap_close(pcap);
+  free(packet);
+
+  printf("%s: %lu packets, %lu bytes\n", global_args.output, global_args.packets, bytes);
+
+  return EXIT_SUCCESS;
+}
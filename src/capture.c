@@ -0,0 +1,230 @@
+/*
+  Copyright (c) 2012-2016 Loïc Pefferkorn <loic-ipdecap@loicp.eu>
+  ipdecap [http://loicpefferkorn.net/ipdecap]
+
+  This file is part of ipdecap.
+
+  Ipdecap is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Ipdecap is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ipdecap.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+#include <poll.h>
+#include <pcap/pcap.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <net/if.h>
+
+#include "config.h"
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#endif
+
+#include "ipdecap.h"
+#include "capture.h"
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+
+// The kernel removes the 802.1Q tag, it is put back for decap_packet to strip it as from a file
+static u_char vlan_frame[MAXIMUM_SNAPLEN + 4];
+
+/*
+ * Create the ring and bind it to the interface
+ * Returns -1 and sets errno on failure
+ *
+ */
+int capture_open(capture_t *capture, const char *ifname, int ring_mb) {
+
+  struct tpacket_req3 req;
+  struct sockaddr_ll sll;
+  int version = TPACKET_V3;
+  int ifindex, saved_errno;
+  void *ring = NULL;
+
+  memset(capture, 0, sizeof(capture_t));
+  capture->fd = -1;
+
+  if ((ifindex = if_nametoindex(ifname)) == 0)
+    return -1;
+
+  // No protocol yet: packets of every interface would be received until bind(), and fill the first blocks
+  if ((capture->fd = socket(AF_PACKET, SOCK_RAW, 0)) == -1)
+    return -1;
+
+  if (setsockopt(capture->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1)
+    goto fail;
+
+  capture->block_count = (unsigned int) ring_mb * ((1024 * 1024) / CAPTURE_BLOCK_SIZE);
+
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = CAPTURE_BLOCK_SIZE;
+  req.tp_block_nr = capture->block_count;
+  req.tp_frame_size = CAPTURE_FRAME_SIZE;
+  req.tp_frame_nr = (CAPTURE_BLOCK_SIZE / CAPTURE_FRAME_SIZE) * capture->block_count;
+  req.tp_retire_blk_tov = CAPTURE_BLOCK_TIMEOUT;
+
+  if (setsockopt(capture->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) == -1)
+    goto fail;
+
+  capture->ring_len = (size_t) req.tp_block_size * req.tp_block_nr;
+  ring = mmap(NULL, capture->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED, capture->fd, 0);
+  if (ring == MAP_FAILED)
+    goto fail;
+  capture->ring = ring;
+
+  memset(&sll, 0, sizeof(sll));
+  sll.sll_family = AF_PACKET;
+  sll.sll_protocol = htons(ETH_P_ALL);
+  sll.sll_ifindex = ifindex;
+
+  if (bind(capture->fd, (struct sockaddr *) &sll, sizeof(sll)) == -1)
+    goto fail;
+
+  return 0;
+
+  fail:
+    saved_errno = errno;
+    capture_close(capture);
+    errno = saved_errno;
+    return -1;
+}
+
+/*
+ * Give each packet of a ring block to callback
+ *
+ */
+static int capture_block(struct tpacket_block_desc *block, pcap_handler callback, u_char *user) {
+
+  struct tpacket3_hdr *tp = NULL;
+  struct pcap_pkthdr pkthdr;
+  const u_char *frame = NULL;
+  u_int16_t tpid, tci;
+  u_int32_t i;
+
+  tp = (struct tpacket3_hdr *) ((u_char *) block + block->hdr.bh1.offset_to_first_pkt);
+
+  for (i=0;i<block->hdr.bh1.num_pkts;i++) {
+
+    pkthdr.ts.tv_sec = tp->tp_sec;
+    pkthdr.ts.tv_usec = tp->tp_nsec / 1000;
+    pkthdr.caplen = tp->tp_snaplen;
+    pkthdr.len = tp->tp_len;
+    frame = (u_char *) tp + tp->tp_mac;
+
+    if ((tp->tp_status & TP_STATUS_VLAN_VALID) && tp->tp_snaplen >= 2*ETH_ALEN
+      && tp->tp_snaplen <= MAXIMUM_SNAPLEN) {
+      tpid = htons((tp->tp_status & TP_STATUS_VLAN_TPID_VALID) ? tp->hv1.tp_vlan_tpid : ETH_P_8021Q);
+      tci = htons(tp->hv1.tp_vlan_tci);
+      memcpy(vlan_frame, frame, 2*ETH_ALEN);
+      memcpy(vlan_frame + 2*ETH_ALEN, &tpid, 2);
+      memcpy(vlan_frame + 2*ETH_ALEN + 2, &tci, 2);
+      memcpy(vlan_frame + 2*ETH_ALEN + 4, frame + 2*ETH_ALEN, tp->tp_snaplen - 2*ETH_ALEN);
+      pkthdr.caplen += 4;
+      pkthdr.len += 4;
+      frame = vlan_frame;
+    }
+
+    callback(user, &pkthdr, frame);
+    tp = (struct tpacket3_hdr *) ((u_char *) tp + tp->tp_next_offset);
+  }
+
+  return block->hdr.bh1.num_pkts;
+}
+
+/*
+ * Process all the blocks retired by the kernel, wait up to timeout_ms if there is none
+ * Returns the number of packets processed, -1 on error
+ *
+ */
+int capture_dispatch(capture_t *capture, pcap_handler callback, u_char *user, int timeout_ms) {
+
+  struct tpacket_block_desc *block = NULL;
+  struct pollfd pfd;
+  int count = 0;
+
+  block = (struct tpacket_block_desc *) (capture->ring + (size_t) capture->block_current * CAPTURE_BLOCK_SIZE);
+
+  if ((__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0) {
+    pfd.fd = capture->fd;
+    pfd.events = POLLIN | POLLERR;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, timeout_ms) == -1)
+      return (errno == EINTR) ? 0 : -1;
+  }
+
+  while (__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) {
+
+    count += capture_block(block, callback, user);
+
+    // Give the block back to the kernel
+    __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+
+    capture->block_current = (capture->block_current + 1) % capture->block_count;
+    block = (struct tpacket_block_desc *) (capture->ring + (size_t) capture->block_current * CAPTURE_BLOCK_SIZE);
+  }
+
+  return count;
+}
+
+void capture_stats(capture_t *capture) {
+
+  struct tpacket_stats_v3 stats;
+  socklen_t len = sizeof(stats);
+
+  if (getsockopt(capture->fd, SOL_PACKET, PACKET_STATISTICS, &stats, &len) == 0)
+    verbose("Live capture: %u packets received, %u dropped, %u ring full events\n",
+      stats.tp_packets, stats.tp_drops, stats.tp_freeze_q_cnt);
+}
+
+void capture_close(capture_t *capture) {
+
+  if (capture->ring != NULL)
+    munmap(capture->ring, capture->ring_len);
+  if (capture->fd != -1)
+    close(capture->fd);
+  capture->ring = NULL;
+  capture->fd = -1;
+}
+
+#else
+
+int capture_open(capture_t *capture, const char *ifname, int ring_mb) {
+
+  capture->fd = -1;
+  capture->ring = NULL;
+  errno = ENOSYS;
+  return -1;
+}
+
+int capture_dispatch(capture_t *capture, pcap_handler callback, u_char *user, int timeout_ms) {
+
+  return -1;
+}
+
+void capture_stats(capture_t *capture) {
+}
+
+void capture_close(capture_t *capture) {
+}
+
+#endif
@@ -0,0 +1,45 @@
+/*
+  Copyright (c) 2012-2016 Loïc Pefferkorn <loic-ipdecap@loicp.eu>
+  ipdecap [http://loicpefferkorn.net/ipdecap]
+
+  This file is part of ipdecap.
+
+  Ipdecap is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Ipdecap is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ipdecap.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Live capture on a network interface through a memory mapped AF_PACKET TPACKET_V3
+ * ring. The kernel fills whole blocks of packets, which are given to the callback
+ * without copy then handed back to the kernel.
+ */
+
+#define CAPTURE_BLOCK_SIZE      (1024*1024)   // Multiple of page size
+#define CAPTURE_FRAME_SIZE      2048
+#define CAPTURE_BLOCK_TIMEOUT   50            // ms, a block is retired when it is full or after this delay
+#define CAPTURE_RING_MIN        1             // Ring size, in MB
+#define CAPTURE_RING_MAX        4096
+#define CAPTURE_RING_DEFAULT    64
+
+typedef struct capture_t {
+  int fd;
+  u_char *ring;
+  size_t ring_len;
+  unsigned int block_count;
+  unsigned int block_current;   // Next block to read
+} capture_t;
+
+int capture_open(capture_t *capture, const char *ifname, int ring_mb);
+int capture_dispatch(capture_t *capture, pcap_handler callback, u_char *user, int timeout_ms);
+void capture_stats(capture_t *capture);
+void capture_close(capture_t *capture);
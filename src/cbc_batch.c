@@ -0,0 +1,417 @@
+/*
+  Copyright (c) 2012-2016 Loïc Pefferkorn <loic-ipdecap@loicp.eu>
+  ipdecap [http://loicpefferkorn.net/ipdecap]
+
+  This file is part of ipdecap.
+
+  Ipdecap is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Ipdecap is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ipdecap.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <sys/types.h>
+
+#include "config.h"
+#include "cbc_batch.h"
+
+#if defined(__x86_64__) && defined(__GNUC__) && defined(HAVE_IMMINTRIN_H)
+#define CBC_BATCH_X86
+#include <immintrin.h>
+#endif
+
+#define CBC_SEGMENT_BLOCKS  4   // Blocks of a 512 bits register
+#define CBC_AESNI_MAX_BLOCKS 48 // Larger packets are faster with OpenSSL, which interleaves their own blocks
+
+typedef enum cbc_engine_t {
+  CBC_ENGINE_NONE = 0,
+  CBC_ENGINE_AESNI,             // 8 blocks interleaved, 128 bits registers
+  CBC_ENGINE_VAES,              // 16 blocks interleaved, 4 blocks per 512 bits register
+} cbc_engine_t;
+
+static const char *engine_names[] = { "none", "aesni", "vaes" };
+
+static cbc_engine_t engine = CBC_ENGINE_NONE;
+static cbc_engine_t best_engine = CBC_ENGINE_NONE;
+static bool engine_probed = false;
+
+// Walk over the blocks of the jobs using keys with the same number of rounds
+typedef struct cbc_cursor_t {
+  cbc_job_t *jobs;
+  int count;
+  int rounds;
+  int job;
+  int block;
+} cbc_cursor_t;
+
+// Contiguous blocks of a job, decrypted together
+typedef struct cbc_segment_t {
+  const u_char *in;
+  const u_char *prev;
+  u_char *out;
+  const cbc_key_t *key;
+  int blocks;
+} cbc_segment_t;
+
+static const u_char sbox[256] = {
+  0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+  0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+  0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+  0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+  0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+  0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+  0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+  0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+  0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+  0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+  0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+  0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+  0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+  0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+  0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+  0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+
+/*
+ * Detect the best engine supported by the processor, once
+ *
+ */
+static void cbc_probe(void) {
+
+  if (engine_probed)
+    return;
+
+  engine_probed = true;
+  engine = CBC_ENGINE_NONE;
+
+#ifdef CBC_BATCH_X86
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("aes")) {
+    engine = CBC_ENGINE_AESNI;
+
+    if (__builtin_cpu_supports("vaes") && __builtin_cpu_supports("avx512f"))
+      engine = CBC_ENGINE_VAES;
+  }
+#endif
+
+  best_engine = engine;
+}
+
+/*
+ * True if the processor can run the batch engine
+ *
+ */
+bool cbc_batch_available(void) {
+
+  cbc_probe();
+  return engine != CBC_ENGINE_NONE;
+}
+
+/*
+ * Name of the engine in use
+ *
+ */
+const char * cbc_batch_engine(void) {
+
+  cbc_probe();
+  return engine_names[engine];
+}
+
+/*
+ * Largest packet, in blocks, worth giving to the engine in use
+ *
+ */
+int cbc_batch_max_blocks(void) {
+
+  cbc_probe();
+  return engine == CBC_ENGINE_AESNI ? CBC_AESNI_MAX_BLOCKS : INT_MAX;
+}
+
+/*
+ * Use the given engine, if the processor supports it. Used to compare engines.
+ *
+ */
+bool cbc_batch_use(const char *name) {
+
+  int i;
+
+  cbc_probe();
+
+  for (i = CBC_ENGINE_AESNI; i <= (int) best_engine; i++) {
+    if (strcmp(name, engine_names[i]) == 0) {
+      engine = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+#ifdef CBC_BATCH_X86
+
+/*
+ * FIPS-197 key expansion, into 4 * (rounds + 1) words
+ *
+ */
+static void aes_expand_key(const u_char *key, int key_len, u_char *w) {
+
+  int nk = key_len / 4;
+  int words = 4 * (nk + 6 + 1);
+  u_char t[4], tmp, rcon = 1;
+  int i, j;
+
+  memcpy(w, key, key_len);
+
+  for (i = nk; i < words; i++) {
+    memcpy(t, w + 4 * (i - 1), 4);
+
+    if (i % nk == 0) {
+      tmp = t[0];
+      t[0] = sbox[t[1]] ^ rcon;
+      t[1] = sbox[t[2]];
+      t[2] = sbox[t[3]];
+      t[3] = sbox[tmp];
+      rcon = (u_char) ((rcon << 1) ^ ((rcon & 0x80) ? 0x1b : 0));
+    } else if (nk > 6 && i % nk == 4) {
+      for (j = 0; j < 4; j++)
+        t[j] = sbox[t[j]];
+    }
+
+    for (j = 0; j < 4; j++)
+      w[4 * i + j] = w[4 * (i - nk) + j] ^ t[j];
+  }
+}
+
+/*
+ * Decryption round keys for AESDEC: encryption round keys in reverse order,
+ * with InvMixColumns applied to the middle ones
+ *
+ */
+__attribute__ ((target ("aes")))
+static void aes_decrypt_keys(const u_char *ek, cbc_key_t *k) {
+
+  int r;
+
+  memcpy(k->rk[0], ek + CBC_BLOCK_SIZE * k->rounds, CBC_BLOCK_SIZE);
+
+  for (r = 1; r < k->rounds; r++)
+    _mm_storeu_si128((__m128i *) k->rk[r],
+      _mm_aesimc_si128(_mm_loadu_si128((const __m128i *) (ek + CBC_BLOCK_SIZE * (k->rounds - r)))));
+
+  memcpy(k->rk[k->rounds], ek, CBC_BLOCK_SIZE);
+}
+
+/*
+ * Next run of at most CBC_SEGMENT_BLOCKS contiguous blocks of a job, blocks is 0 when all were given.
+ * prev is the ciphertext block before the first one: the IV, or the previous block.
+ *
+ */
+static inline void cbc_next_segment(cbc_cursor_t *cur, cbc_segment_t *seg) {
+
+  cbc_job_t *job = NULL;
+
+  while (cur->job < cur->count
+    && (cur->jobs[cur->job].key->rounds != cur->rounds
+      || cur->block >= cur->jobs[cur->job].blocks)) {
+    cur->job++;
+    cur->block = 0;
+  }
+
+  if (cur->job == cur->count) {
+    seg->blocks = 0;
+    return;
+  }
+
+  job = &cur->jobs[cur->job];
+  seg->in = job->in + CBC_BLOCK_SIZE * cur->block;
+  seg->prev = cur->block == 0 ? job->iv : seg->in - CBC_BLOCK_SIZE;
+  seg->out = job->out + CBC_BLOCK_SIZE * cur->block;
+  seg->key = job->key;
+  seg->blocks = job->blocks - cur->block < CBC_SEGMENT_BLOCKS ? job->blocks - cur->block : CBC_SEGMENT_BLOCKS;
+  cur->block += seg->blocks;
+}
+
+/*
+ * AES-NI engine: 2 segments per iteration, 8 blocks whose rounds are interleaved
+ *
+ */
+__attribute__ ((target ("aes")))
+static void cbc_decrypt_aesni(cbc_cursor_t *cur) {
+
+  cbc_segment_t seg[2];
+  const __m128i *rk[2];
+  __m128i c[8], x[8], k;
+  int rounds = cur->rounds;
+  int s, i, r;
+
+  for (;;) {
+    cbc_next_segment(cur, &seg[0]);
+    if (seg[0].blocks == 0)
+      break;
+    cbc_next_segment(cur, &seg[1]);
+
+    // Lanes without a block decrypt a zero block with the keys of the first segment
+    for (s = 0; s < 2; s++) {
+      rk[s] = (const __m128i *) (seg[s].blocks > 0 ? seg[s].key->rk : seg[0].key->rk);
+      k = _mm_loadu_si128(&rk[s][0]);
+#pragma GCC unroll 4
+      for (i = 0; i < CBC_SEGMENT_BLOCKS; i++) {
+        c[4 * s + i] = i < seg[s].blocks ? _mm_loadu_si128((const __m128i *) (seg[s].in + CBC_BLOCK_SIZE * i))
+                                         : _mm_setzero_si128();
+        x[4 * s + i] = _mm_xor_si128(c[4 * s + i], k);
+      }
+    }
+
+    for (r = 1; r < rounds; r++) {
+      k = _mm_loadu_si128(&rk[0][r]);
+      x[0] = _mm_aesdec_si128(x[0], k);
+      x[1] = _mm_aesdec_si128(x[1], k);
+      x[2] = _mm_aesdec_si128(x[2], k);
+      x[3] = _mm_aesdec_si128(x[3], k);
+      k = _mm_loadu_si128(&rk[1][r]);
+      x[4] = _mm_aesdec_si128(x[4], k);
+      x[5] = _mm_aesdec_si128(x[5], k);
+      x[6] = _mm_aesdec_si128(x[6], k);
+      x[7] = _mm_aesdec_si128(x[7], k);
+    }
+
+    // A lane without a block has no previous block to read, as with VAES
+    for (s = 0; s < 2; s++) {
+      if (seg[s].blocks == 0)
+        break;
+      k = _mm_loadu_si128(&rk[s][rounds]);
+#pragma GCC unroll 4
+      for (i = 0; i < CBC_SEGMENT_BLOCKS; i++) {
+        x[4 * s + i] = _mm_aesdeclast_si128(x[4 * s + i], k);
+        x[4 * s + i] = _mm_xor_si128(x[4 * s + i],
+          i == 0 ? _mm_loadu_si128((const __m128i *) seg[s].prev) : c[4 * s + i - 1]);
+        if (i < seg[s].blocks)
+          _mm_storeu_si128((__m128i *) (seg[s].out + CBC_BLOCK_SIZE * i), x[4 * s + i]);
+      }
+    }
+  }
+}
+
+/*
+ * VAES engine: 4 segments per iteration, one per 512 bits register of 4 blocks.
+ * Partial segments use masked loads and stores, round keys are broadcast to the 4 blocks.
+ *
+ */
+__attribute__ ((target ("aes,vaes,avx512f")))
+static void cbc_decrypt_vaes(cbc_cursor_t *cur) {
+
+  cbc_segment_t seg[4];
+  const __m128i *rk[4];
+  __m512i x[4], p;
+  __mmask16 mask[4];
+  int rounds = cur->rounds;
+  int v, r;
+
+  for (;;) {
+    cbc_next_segment(cur, &seg[0]);
+    if (seg[0].blocks == 0)
+      break;
+    cbc_next_segment(cur, &seg[1]);
+    cbc_next_segment(cur, &seg[2]);
+    cbc_next_segment(cur, &seg[3]);
+
+    // Registers without a block decrypt a zero block with the keys of the first segment
+    for (v = 0; v < 4; v++) {
+      rk[v] = (const __m128i *) (seg[v].blocks > 0 ? seg[v].key->rk : seg[0].key->rk);
+      mask[v] = (__mmask16) ((1 << (4 * seg[v].blocks)) - 1);
+      x[v] = _mm512_xor_si512(_mm512_maskz_loadu_epi32(mask[v], seg[v].in),
+                              _mm512_broadcast_i32x4(_mm_loadu_si128(&rk[v][0])));
+    }
+
+    for (r = 1; r < rounds; r++) {
+      x[0] = _mm512_aesdec_epi128(x[0], _mm512_broadcast_i32x4(_mm_loadu_si128(&rk[0][r])));
+      x[1] = _mm512_aesdec_epi128(x[1], _mm512_broadcast_i32x4(_mm_loadu_si128(&rk[1][r])));
+      x[2] = _mm512_aesdec_epi128(x[2], _mm512_broadcast_i32x4(_mm_loadu_si128(&rk[2][r])));
+      x[3] = _mm512_aesdec_epi128(x[3], _mm512_broadcast_i32x4(_mm_loadu_si128(&rk[3][r])));
+    }
+
+    for (v = 0; v < 4; v++) {
+      if (seg[v].blocks == 0)
+        break;
+
+      x[v] = _mm512_aesdeclast_epi128(x[v], _mm512_broadcast_i32x4(_mm_loadu_si128(&rk[v][rounds])));
+
+      // Previous ciphertext blocks: the block before the segment, then its blocks
+      p = _mm512_maskz_loadu_epi32(mask[v] & 0xfff0, seg[v].in - CBC_BLOCK_SIZE);
+      p = _mm512_mask_broadcast_i32x4(p, 0x000f, _mm_loadu_si128((const __m128i *) seg[v].prev));
+
+      _mm512_mask_storeu_epi32(seg[v].out, mask[v], _mm512_xor_si512(x[v], p));
+    }
+  }
+}
+
+#endif /* CBC_BATCH_X86 */
+
+/*
+ * Decryption round keys of an AES key (16, 24 or 32 bytes), NULL if the engine is not available
+ *
+ */
+cbc_key_t * cbc_batch_key(const u_char *key, int key_len) {
+
+  cbc_key_t *k = NULL;
+
+  if (!cbc_batch_available() || (key_len != 16 && key_len != 24 && key_len != 32))
+    return NULL;
+
+#ifdef CBC_BATCH_X86
+  u_char ek[(CBC_MAX_ROUNDS + 1) * CBC_BLOCK_SIZE];
+
+  if ((k = malloc(sizeof(cbc_key_t))) == NULL)
+    return NULL;
+
+  k->rounds = key_len / 4 + 6;
+  aes_expand_key(key, key_len, ek);
+  aes_decrypt_keys(ek, k);
+#else
+  (void) key;
+#endif
+
+  return k;
+}
+
+/*
+ * Decrypt the blocks of all jobs, which may use different keys.
+ * Keys of the same length are decrypted together, one pass for each length.
+ *
+ */
+void cbc_batch_decrypt(cbc_job_t *jobs, int count) {
+
+#ifdef CBC_BATCH_X86
+  cbc_cursor_t cur;
+  int rounds;
+
+  for (rounds = 10; rounds <= CBC_MAX_ROUNDS; rounds += 2) {
+    cur.jobs = jobs;
+    cur.count = count;
+    cur.rounds = rounds;
+    cur.job = 0;
+    cur.block = 0;
+
+    if (engine == CBC_ENGINE_VAES)
+      cbc_decrypt_vaes(&cur);
+    else
+      cbc_decrypt_aesni(&cur);
+  }
+#else
+  (void) jobs;
+  (void) count;
+#endif
+}
@@ -0,0 +1,54 @@
+/*
+  Copyright (c) 2012-2016 Loïc Pefferkorn <loic-ipdecap@loicp.eu>
+  ipdecap [http://loicpefferkorn.net/ipdecap]
+
+  This file is part of ipdecap.
+
+  Ipdecap is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Ipdecap is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ipdecap.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Multi-buffer AES-CBC decryption. CBC decryption of a block only needs the
+ * previous ciphertext block, so the blocks of many packets, with their own keys,
+ * are decrypted together: AES rounds of 8 blocks are interleaved with AES-NI,
+ * or 16 blocks with VAES on AVX-512, keeping the AES units busy even for small
+ * packets that OpenSSL decrypts one by one.
+ * Only available on x86-64 processors with AES-NI, callers keep the OpenSSL path.
+ */
+
+#define CBC_BLOCK_SIZE    16
+#define CBC_MAX_ROUNDS    14
+#define CBC_BATCH_JOBS    256   // Packets queued by callers before they are decrypted together
+
+// Decryption round keys (equivalent inverse cipher) of an AES key
+typedef struct cbc_key_t {
+  u_char rk[CBC_MAX_ROUNDS + 1][CBC_BLOCK_SIZE];
+  int rounds;                   // 10, 12 or 14
+} cbc_key_t;
+
+// Ciphertext to decrypt, in and out must not overlap
+typedef struct cbc_job_t {
+  const cbc_key_t *key;
+  const u_char *iv;
+  const u_char *in;
+  u_char *out;
+  int blocks;
+} cbc_job_t;
+
+bool cbc_batch_available(void);
+const char * cbc_batch_engine(void);
+bool cbc_batch_use(const char *name);
+int cbc_batch_max_blocks(void);
+cbc_key_t * cbc_batch_key(const u_char *key, int key_len);
+void cbc_batch_decrypt(cbc_job_t *jobs, int count);
@@ -0,0 +1,295 @@
+/*
+  Copyright (c) 2012-2016 Loïc Pefferkorn <loic-ipdecap@loicp.eu>
+  ipdecap [http://loicpefferkorn.net/ipdecap]
+
+  This file is part of ipdecap.
+
+  Ipdecap is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Ipdecap is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ipdecap.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Benchmark of the multi-buffer AES-CBC engine against OpenSSL decrypting one
+ * packet at a time, as process_esp_packet() does without it. Both outputs are
+ * compared. Built with: make cbc_bench
+ * With --check, only small batches are compared, for make check.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/types.h>
+#include <openssl/evp.h>
+
+#include "config.h"
+#include "cbc_batch.h"
+
+#define BENCH_PACKETS   CBC_BATCH_JOBS
+#define BENCH_MIN_NS    200000000ULL  // Run each measure for at least 0.2s
+#define BENCH_MAX_KEYS  64
+#define CHECK_MAX_JOBS  3
+#define CHECK_MAX_BLOCKS 9            // More than 2 segments of 4 blocks
+
+static const int key_bits[] = { 128, 256 };
+static const int key_counts[] = { 1, BENCH_MAX_KEYS };
+static const int sizes[] = { 48, 128, 512, 1440 };   // Ciphertext bytes, like small to full size packets
+
+#define COUNT(a)  (sizeof(a) / sizeof((a)[0]))
+
+static unsigned long long now_ns(void) {
+
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void fill_random(u_char *buf, size_t len) {
+
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    buf[i] = rand() & 0xff;
+}
+
+/*
+ * Nanoseconds per packet to decrypt BENCH_PACKETS packets of size bytes,
+ * each one with its IV just before it in data, one by one with OpenSSL
+ *
+ */
+static double bench_openssl(EVP_CIPHER_CTX **ctx, const u_char *data, u_char *out, int size) {
+
+  unsigned long long start = now_ns(), elapsed;
+  unsigned long runs = 0;
+  int i, len;
+
+  do {
+    for (i = 0; i < BENCH_PACKETS; i++) {
+      const u_char *pkt = data + i * (CBC_BLOCK_SIZE + size);
+
+      if (EVP_DecryptInit_ex(ctx[i % BENCH_MAX_KEYS], NULL, NULL, NULL, pkt) != 1
+        || EVP_DecryptUpdate(ctx[i % BENCH_MAX_KEYS], out + i * size, &len, pkt + CBC_BLOCK_SIZE, size) != 1) {
+        fprintf(stderr, "EVP_DecryptUpdate() failed\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    runs++;
+  } while ((elapsed = now_ns() - start) < BENCH_MIN_NS);
+
+  return (double) elapsed / (runs * BENCH_PACKETS);
+}
+
+/*
+ * Same packets, given together to the batch engine
+ *
+ */
+static double bench_batch(cbc_job_t *jobs) {
+
+  unsigned long long start = now_ns(), elapsed;
+  unsigned long runs = 0;
+
+  do {
+    cbc_batch_decrypt(jobs, BENCH_PACKETS);
+    runs++;
+  } while ((elapsed = now_ns() - start) < BENCH_MIN_NS);
+
+  return (double) elapsed / (runs * BENCH_PACKETS);
+}
+
+/*
+ * Decrypt batches of 1 to CHECK_MAX_JOBS jobs of 1 to CHECK_MAX_BLOCKS blocks, with
+ * AES-128 and AES-256 keys mixed, with the current engine: the last segments of a
+ * pass leave lanes without blocks. Returns false if an output differs from OpenSSL one.
+ *
+ */
+static bool check_engine(void) {
+
+  EVP_CIPHER_CTX *ctx[CHECK_MAX_JOBS];
+  cbc_key_t *keys[CHECK_MAX_JOBS];
+  cbc_job_t jobs[CHECK_MAX_JOBS];
+  u_char key[32];
+  u_char data[CHECK_MAX_JOBS][CBC_BLOCK_SIZE * (CHECK_MAX_BLOCKS + 1)];
+  u_char out_openssl[CBC_BLOCK_SIZE * CHECK_MAX_BLOCKS];
+  u_char out_batch[CHECK_MAX_JOBS][CBC_BLOCK_SIZE * CHECK_MAX_BLOCKS];
+  bool ok = true;
+  int count, blocks, i, len;
+
+  for (i = 0; i < CHECK_MAX_JOBS; i++) {
+    fill_random(key, sizeof(key));
+    keys[i] = cbc_batch_key(key, i % 2 == 0 ? 16 : 32);
+    ctx[i] = EVP_CIPHER_CTX_new();
+    if (keys[i] == NULL || ctx[i] == NULL
+      || EVP_DecryptInit_ex(ctx[i], i % 2 == 0 ? EVP_aes_128_cbc() : EVP_aes_256_cbc(), NULL, key, NULL) != 1) {
+      fprintf(stderr, "Cannot initialize keys\n");
+      exit(EXIT_FAILURE);
+    }
+    EVP_CIPHER_CTX_set_padding(ctx[i], 0);
+  }
+
+  for (count = 1; count <= CHECK_MAX_JOBS; count++) {
+    for (blocks = 1; blocks <= CHECK_MAX_BLOCKS; blocks++) {
+
+      // Job i has blocks + i blocks, at most CHECK_MAX_BLOCKS
+      fill_random(&data[0][0], sizeof(data));
+      for (i = 0; i < count; i++) {
+        jobs[i].key = keys[i];
+        jobs[i].iv = data[i];
+        jobs[i].in = data[i] + CBC_BLOCK_SIZE;
+        jobs[i].out = out_batch[i];
+        jobs[i].blocks = blocks + i > CHECK_MAX_BLOCKS ? CHECK_MAX_BLOCKS : blocks + i;
+      }
+
+      cbc_batch_decrypt(jobs, count);
+
+      for (i = 0; i < count; i++) {
+        if (EVP_DecryptInit_ex(ctx[i], NULL, NULL, NULL, jobs[i].iv) != 1
+          || EVP_DecryptUpdate(ctx[i], out_openssl, &len, jobs[i].in, jobs[i].blocks * CBC_BLOCK_SIZE) != 1) {
+          fprintf(stderr, "EVP_DecryptUpdate() failed\n");
+          exit(EXIT_FAILURE);
+        }
+        if (memcmp(out_openssl, out_batch[i], jobs[i].blocks * CBC_BLOCK_SIZE) != 0) {
+          fprintf(stderr, "%s: output differs from OpenSSL: %i jobs, job %i of %i blocks\n",
+            cbc_batch_engine(), count, i, jobs[i].blocks);
+          ok = false;
+        }
+      }
+    }
+  }
+
+  for (i = 0; i < CHECK_MAX_JOBS; i++) {
+    EVP_CIPHER_CTX_free(ctx[i]);
+    free(keys[i]);
+  }
+
+  printf("%-6s small batches %s\n", cbc_batch_engine(), ok ? "OK" : "FAILED");
+  return ok;
+}
+
+/*
+ * Run all sizes and key configurations with the current engine.
+ * Returns false if an output differs from OpenSSL one.
+ *
+ */
+static bool bench_engine(void) {
+
+  EVP_CIPHER_CTX *ctx[BENCH_MAX_KEYS];
+  cbc_key_t *keys[BENCH_MAX_KEYS];
+  cbc_job_t jobs[BENCH_PACKETS];
+  u_char key[32];
+  u_char *data = NULL, *out_openssl = NULL, *out_batch = NULL;
+  const EVP_CIPHER *cipher = NULL;
+  double ns_openssl, ns_batch;
+  bool ok = true;
+  unsigned int b, k, s;
+  int i, nkeys, size;
+
+  for (b = 0; b < COUNT(key_bits); b++) {
+    cipher = key_bits[b] == 128 ? EVP_aes_128_cbc() : EVP_aes_256_cbc();
+
+    for (k = 0; k < COUNT(key_counts); k++) {
+      nkeys = key_counts[k];
+
+      // Contexts are keyed once, like ipdecap flows, packet i uses key i % nkeys
+      for (i = 0; i < BENCH_MAX_KEYS; i++) {
+        if (i < nkeys) {
+          fill_random(key, sizeof(key));
+          keys[i] = cbc_batch_key(key, key_bits[b] / 8);
+          ctx[i] = EVP_CIPHER_CTX_new();
+          if (keys[i] == NULL || ctx[i] == NULL
+            || EVP_DecryptInit_ex(ctx[i], cipher, NULL, key, NULL) != 1) {
+            fprintf(stderr, "Cannot initialize keys\n");
+            exit(EXIT_FAILURE);
+          }
+          EVP_CIPHER_CTX_set_padding(ctx[i], 0);
+        } else {
+          keys[i] = keys[i % nkeys];
+          ctx[i] = ctx[i % nkeys];
+        }
+      }
+
+      for (s = 0; s < COUNT(sizes); s++) {
+        size = sizes[s];
+
+        if ((data = malloc(BENCH_PACKETS * (CBC_BLOCK_SIZE + size))) == NULL
+          || (out_openssl = malloc(BENCH_PACKETS * size)) == NULL
+          || (out_batch = malloc(BENCH_PACKETS * size)) == NULL) {
+          fprintf(stderr, "Cannot malloc\n");
+          exit(EXIT_FAILURE);
+        }
+
+        fill_random(data, BENCH_PACKETS * (CBC_BLOCK_SIZE + size));
+
+        for (i = 0; i < BENCH_PACKETS; i++) {
+          jobs[i].key = keys[i % BENCH_MAX_KEYS];
+          jobs[i].iv = data + i * (CBC_BLOCK_SIZE + size);
+          jobs[i].in = jobs[i].iv + CBC_BLOCK_SIZE;
+          jobs[i].out = out_batch + i * size;
+          jobs[i].blocks = size / CBC_BLOCK_SIZE;
+        }
+
+        ns_openssl = bench_openssl(ctx, data, out_openssl, size);
+        ns_batch = bench_batch(jobs);
+
+        if (memcmp(out_openssl, out_batch, BENCH_PACKETS * size) != 0) {
+          fprintf(stderr, "Output differs from OpenSSL: AES-%i, %i keys, %i bytes\n",
+            key_bits[b], nkeys, size);
+          ok = false;
+        }
+
+        printf("%-6s AES-%i-CBC %3i keys %5i bytes  openssl %8.1f ns/pkt %7.1f MB/s  batch %8.1f ns/pkt %7.1f MB/s  x%.2f\n",
+          cbc_batch_engine(), key_bits[b], nkeys, size,
+          ns_openssl, size * 1000.0 / ns_openssl,
+          ns_batch, size * 1000.0 / ns_batch,
+          ns_openssl / ns_batch);
+
+        free(data);
+        free(out_openssl);
+        free(out_batch);
+      }
+
+      for (i = 0; i < nkeys; i++) {
+        EVP_CIPHER_CTX_free(ctx[i]);
+        free(keys[i]);
+      }
+    }
+  }
+
+  return ok;
+}
+
+int main(int argc, char **argv) {
+
+  static const char *engines[] = { "aesni", "vaes" };
+  bool check = (argc > 1 && strcmp(argv[1], "--check") == 0);
+  bool ok = true;
+  unsigned int e;
+
+  if (!cbc_batch_available()) {
+    printf("Multi-buffer AES-CBC engine not supported by this processor\n");
+    return EXIT_SUCCESS;
+  }
+
+  srand(1);
+
+  for (e = 0; e < COUNT(engines); e++) {
+    if (cbc_batch_use(engines[e])) {
+      ok = check_engine() && ok;
+      if (!check)
+        ok = bench_engine() && ok;
+    }
+  }
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
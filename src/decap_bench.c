@@ -0,0 +1,398 @@
+/*
+  Copyright (c) 2012-2016 Loïc Pefferkorn <loic-ipdecap@loicp.eu>
+  ipdecap [http://loicpefferkorn.net/ipdecap]
+
+  This file is part of ipdecap.
+
+  Ipdecap is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Ipdecap is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ipdecap.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Microbenchmark of the per-protocol decapsulation functions: packets of the
+ * given captures are loaded in memory, sorted by the function decap_packet()
+ * would give them to, then each function is run in a loop over its packets.
+ * Reports ns/packet, and cycles, instructions and cache misses per packet if
+ * perf_event_open() is available. Built with: make decap_bench
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#include <pcap/pcap.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <net/ethernet.h>
+#include <openssl/evp.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/provider.h>
+#endif
+
+#include "config.h"
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <linux/perf_event.h>
+#endif
+#include "ipdecap.h"
+
+#define BENCH_MIN_NS      200000000ULL  // Run each function for at least 0.2s
+
+typedef void (*decap_func_t)(const u_char *payload, const int payload_len, pcap_hdr *new_packet_hdr, u_char *new_packet_payload);
+
+// Packets of a capture given to the same function
+typedef struct packet_set_t {
+  const char *name;
+  decap_func_t func;
+  const u_char **payload;
+  int *caplen;
+  int count;
+  int size;
+} packet_set_t;
+
+enum { SET_IPIP, SET_IPV6, SET_GRE, SET_ESP, SET_COUNT };
+
+static packet_set_t sets[SET_COUNT] = {
+  [SET_IPIP] = { .name = "process_ipip_packet",     .func = process_ipip_packet },
+  [SET_IPV6] = { .name = "process_ipv6_packet",     .func = process_ipv6_packet },
+  [SET_GRE]  = { .name = "process_gre_packet",      .func = process_gre_packet },
+  [SET_ESP]  = { .name = "process_esp_packet",      .func = process_esp_packet },
+};
+
+// Hardware counters, read together
+enum { COUNTER_CYCLES, COUNTER_INSTRUCTIONS, COUNTER_CACHE_MISSES, COUNTER_COUNT };
+
+static int perf_fd[COUNTER_COUNT] = { -1, -1, -1 };
+static bool perf_available = false;
+
+static unsigned long long now_ns(void) {
+
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Open the cycles, instructions and cache misses counters of this thread as a
+ * group, so they are scheduled together. Not available outside Linux, or when
+ * restricted by kernel.perf_event_paranoid.
+ *
+ */
+static void perf_open(void) {
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+  static const u_int64_t configs[COUNTER_COUNT] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES
+  };
+  struct perf_event_attr attr;
+  int i;
+
+  for (i = 0; i < COUNTER_COUNT; i++) {
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = configs[i];
+    attr.disabled = (i == 0);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+
+    perf_fd[i] = syscall(__NR_perf_event_open, &attr, 0, -1, i == 0 ? -1 : perf_fd[0], 0);
+    if (perf_fd[i] == -1) {
+      fprintf(stderr, "perf_event_open() failed: %s, hardware counters are not reported\n", strerror(errno));
+      while (--i >= 0)
+        close(perf_fd[i]);
+      return;
+    }
+  }
+
+  perf_available = true;
+#endif
+}
+
+static void perf_start(void) {
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+  if (perf_available) {
+    ioctl(perf_fd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(perf_fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+#endif
+}
+
+/*
+ * Stop the counters and read them in values
+ * Returns false if they are not available
+ *
+ */
+static bool perf_stop(u_int64_t *values) {
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+  u_int64_t data[1 + COUNTER_COUNT];   // Number of counters, then their values
+
+  if (!perf_available)
+    return false;
+
+  ioctl(perf_fd[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  if (read(perf_fd[0], data, sizeof(data)) != sizeof(data))
+    return false;
+
+  memcpy(values, data + 1, COUNTER_COUNT * sizeof(u_int64_t));
+  return true;
+#else
+  return false;
+#endif
+}
+
+static void set_add(packet_set_t *set, const u_char *payload, int caplen) {
+
+  if (set->count == set->size) {
+    set->size = set->size == 0 ? 1024 : set->size * 2;
+    if ((set->payload = realloc(set->payload, set->size * sizeof(u_char *))) == NULL
+      || (set->caplen = realloc(set->caplen, set->size * sizeof(int))) == NULL)
+      error("Cannot malloc");
+  }
+
+  set->payload[set->count] = payload;
+  set->caplen[set->count] = caplen;
+  set->count++;
+}
+
+/*
+ * Load the packets of a capture and sort them by decapsulation function,
+ * as decap_packet() does, with an IPv4 or IPv6 outer header. VLAN tagged
+ * packets are given from their last tag, like untagged ones. Other packets
+ * are not kept.
+ * Returns the packets data, to free once measures are done
+ *
+ */
+static u_char * load_capture(const char *filename, unsigned long *skipped) {
+
+  char errbuf[PCAP_ERRBUF_SIZE];
+  struct pcap_pkthdr *hdr;
+  const u_char *data;
+  ip_outer_t outer;
+  u_char *packets = NULL;
+  size_t used = 0, allocated = 0;
+  pcap_t *pcap;
+  int i, rc, tags_len;
+
+  if ((pcap = pcap_open_offline(filename, errbuf)) == NULL)
+    error("Cannot open input file %s: %s\n", filename, errbuf);
+
+  // Offsets first: the buffer moves while it grows
+  while ((rc = pcap_next_ex(pcap, &hdr, &data)) == 1) {
+
+    if (hdr->caplen > MAXIMUM_SNAPLEN) {
+      (*skipped)++;
+      continue;
+    }
+
+    tags_len = ieee8021q_headers_len(data, hdr->caplen);
+
+    if (hdr->caplen - tags_len < sizeof(struct ether_header))
+      i = -1;
+    else if (!ip_outer_parse(data + tags_len, hdr->caplen - tags_len, &outer))
+      i = -1;
+    else if (outer.protocol == IPPROTO_IPIP)
+      i = SET_IPIP;
+    else if (outer.protocol == IPPROTO_IPV6)
+      i = SET_IPV6;
+    else if (outer.protocol == IPPROTO_GRE)
+      i = SET_GRE;
+    else if (outer.protocol == IPPROTO_ESP)
+      i = SET_ESP;
+    else
+      i = -1;
+
+    if (i == -1) {
+      (*skipped)++;
+      continue;
+    }
+
+    while (used + hdr->caplen > allocated) {
+      allocated = allocated == 0 ? 1 << 20 : allocated * 2;
+      if ((packets = realloc(packets, allocated)) == NULL)
+        error("Cannot malloc");
+    }
+    memcpy(packets + used, data + tags_len, hdr->caplen - tags_len);
+    set_add(&sets[i], (const u_char *) used, hdr->caplen - tags_len);
+    used += hdr->caplen - tags_len;
+  }
+
+  if (rc == -1)
+    error("Cannot read input file %s: %s\n", filename, pcap_geterr(pcap));
+  pcap_close(pcap);
+
+  for (i = 0; i < SET_COUNT; i++) {
+    int j;
+    for (j = 0; j < sets[i].count; j++)
+      sets[i].payload[j] = packets + (size_t) sets[i].payload[j];
+  }
+
+  return packets;
+}
+
+/*
+ * Give each packet of the set to its function, until BENCH_MIN_NS elapsed
+ *
+ */
+static void bench_set(const char *filename, packet_set_t *set, u_char *out_payload) {
+
+  pcap_hdr out_hdr;
+  u_int64_t counters[COUNTER_COUNT];
+  unsigned long long start, elapsed;
+  unsigned long packets = 0;
+  int i;
+
+  memset(&out_hdr, 0, sizeof(out_hdr));
+
+  // Warm up caches and branch predictors
+  for (i = 0; i < set->count; i++) {
+    out_hdr.caplen = set->caplen[i];
+    set->func(set->payload[i], set->caplen[i], &out_hdr, out_payload);
+  }
+
+  perf_start();
+  start = now_ns();
+  do {
+    for (i = 0; i < set->count; i++) {
+      out_hdr.caplen = set->caplen[i];
+      set->func(set->payload[i], set->caplen[i], &out_hdr, out_payload);
+    }
+    packets += set->count;
+  } while ((elapsed = now_ns() - start) < BENCH_MIN_NS);
+
+  printf("%-32s %-24s %8i %9.1f", filename, set->name, set->count, (double) elapsed / packets);
+
+  if (perf_stop(counters))
+    printf(" %9.1f %9.1f %5.2f %9.3f",
+      (double) counters[COUNTER_CYCLES] / packets,
+      (double) counters[COUNTER_INSTRUCTIONS] / packets,
+      counters[COUNTER_CYCLES] ? (double) counters[COUNTER_INSTRUCTIONS] / counters[COUNTER_CYCLES] : 0,
+      (double) counters[COUNTER_CACHE_MISSES] / packets);
+  printf("\n");
+}
+
+static void bench_usage(void) {
+  printf("Usage: decap_bench [-c esp.conf] capture...\n"
+  "Run each decapsulation function over the packets of the captures, loaded in memory.\n"
+  "\n"
+  "  -c, --conf FILE   ESP configuration file for all captures, default: capture.conf\n"
+  "                    next to each capture.cap if it exists\n");
+}
+
+int main(int argc, char **argv) {
+
+  const struct option long_opt[] = {
+    {"conf",  required_argument,  NULL, 'c'},
+    {"help",  no_argument,        NULL, 'h'},
+    {NULL,    0,                  NULL, 0}
+  };
+  char *conf = NULL, *file_conf;
+  u_char *packets, *out_payload;
+  unsigned long skipped;
+  size_t len;
+  int opt, f, i;
+
+  while ((opt = getopt_long(argc, argv, "c:h", long_opt, NULL)) != -1) {
+    switch (opt) {
+      case 'c':
+        conf = optarg;
+        break;
+      case 'h':
+        bench_usage();
+        exit(EXIT_SUCCESS);
+      default:
+        bench_usage();
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  if (optind == argc) {
+    bench_usage();
+    exit(EXIT_FAILURE);
+  }
+
+  OpenSSL_add_all_algorithms();
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  OSSL_PROVIDER_load(NULL, "legacy");
+  if (OSSL_PROVIDER_load(NULL, "default") == NULL)
+    error("Cannot load OpenSSL default provider\n");
+#endif
+
+  MALLOC(out_payload, MAXIMUM_SNAPLEN, u_char);
+  memset(out_payload, 0, MAXIMUM_SNAPLEN);
+
+  perf_open();
+
+  printf("%-32s %-24s %8s %9s", "capture", "function", "packets", "ns/pkt");
+  if (perf_available)
+    printf(" %9s %9s %5s %9s", "cycles", "instr", "IPC", "misses");
+  printf("\n");
+
+  for (f = optind; f < argc; f++) {
+
+    // Flows of the previous capture may use the same addresses and SPI
+    flows_cleanup();
+
+    file_conf = conf;
+    if (conf == NULL) {
+      len = strlen(argv[f]);
+      if (len > 4 && strcmp(argv[f] + len - 4, ".cap") == 0) {
+        MALLOC(file_conf, len + 2, char);
+        sprintf(file_conf, "%.*s.conf", (int) len - 4, argv[f]);
+        if (access(file_conf, R_OK) != 0) {
+          free(file_conf);
+          file_conf = NULL;
+        }
+      }
+    }
+
+    if (file_conf != NULL && parse_esp_conf(file_conf) != 0)
+      error("Cannot read ESP configuration file %s\n", file_conf);
+
+    skipped = 0;
+    packets = load_capture(argv[f], &skipped);
+
+    if (skipped > 0)
+      fprintf(stderr, "%s: %lu packets are not encapsulated, or too short, or too long\n", argv[f], skipped);
+
+    for (i = 0; i < SET_COUNT; i++) {
+      if (sets[i].count > 0)
+        bench_set(argv[f], &sets[i], out_payload);
+      sets[i].count = 0;
+    }
+
+    free(packets);
+    if (file_conf != conf)
+      free(file_conf);
+  }
+
+  for (i = 0; i < SET_COUNT; i++) {
+    free(sets[i].payload);
+    free(sets[i].caplen);
+  }
+  free(out_payload);
+  flows_cleanup();
+
+  return EXIT_SUCCESS;
+}
@@ -19,6 +19,9 @@
 */
 
 #define ESP_SPI_LEN       8
+#define ESP_AEAD_IV_LEN   8     // Explicit IV carried by each packet (rfc 4106, rfc 7634)
+#define ESP_AEAD_NONCE_LEN 12   // Salt + explicit IV
+#define ESP_AEAD_AAD_LEN  8     // SPI + sequence number, extended sequence numbers are not supported
 
 typedef struct esp_packet_t {
   u_int32_t spi;
@@ -32,14 +35,18 @@ typedef struct esp_packet_t {
 typedef struct crypt_method_t {
   char *name;             // Name used in ESP configuration file
   char *openssl_cipher;   // OpenSSL internal name
+  int salt_len;           // AEAD: salt length at the end of the key, 0 for other ciphers
+  int icv_len;            // AEAD: integrity check value length, the authentication method is not used
+  const EVP_CIPHER *cipher; // Resolved once for all the flows using it, NULL until then
   struct crypt_method_t *next;
 } crypt_method_t;
 
 // ESP authentication methods
 typedef struct auth_method_t {
   char *name;             // Name used in ESP configuration file
-  char *openssl_auth;     // OpenSSL internal name,  not yet used (no verification made)
-  int len;                // Digest bytes length
+  char *openssl_auth;     // OpenSSL digest name for HMAC verification, NULL if the ICV cannot be checked
+  int len;                // ICV bytes length, truncated digest
+  const EVP_MD *md;       // Resolved once for all the flows using it, NULL until then
   struct auth_method_t *next;
 } auth_method_t;
 
@@ -47,8 +54,14 @@ typedef struct auth_method_t {
 typedef struct llflow_t {
   address_t addr_src;
   address_t addr_dst;
-  EVP_CIPHER_CTX ctx;
+  const EVP_CIPHER *cipher;   // Resolved once from crypt_method->openssl_cipher
+  EVP_CIPHER_CTX *ctx;        // Keyed once, only the IV is set for each packet
   unsigned char *key;
+  const unsigned char *salt;  // AEAD: after the cipher key, in key
+  cbc_key_t *batch_key;       // AES-CBC round keys for the multi-buffer engine, NULL if not used
+  EVP_MD_CTX *hmac_inner;     // Digest states after the HMAC inner and outer key blocks,
+  EVP_MD_CTX *hmac_outer;     // copied for each packet. NULL without authentication key.
+  int index;                  // Position in the configuration file, indexes per thread contexts
   u_int32_t spi;
   char *crypt_name;
   char *auth_name;
@@ -57,6 +70,79 @@ typedef struct llflow_t {
   struct llflow_t *next;
 } llflow_t;
 
+EVP_CIPHER_CTX * flow_cipher_ctx(struct llflow_t *flow);
+const EVP_CIPHER * crypt_method_cipher(crypt_method_t *cm);
+const EVP_MD * auth_method_md(auth_method_t *am);
+
+// ESP packet queued for the multi-buffer AES-CBC engine, finished once its batch is decrypted
+typedef struct esp_deferred_t {
+  llflow_t *flow;
+  int num;                      // Packet number, for tracepoints
+  const u_char *payload;        // Source packet, copied raw if decryption fails
+  int payload_len;
+  pcap_hdr *new_packet_hdr;
+  u_char *new_packet_payload;
+  int packet_size;              // Decrypted packet size, with the ESP trailer
+} esp_deferred_t;
+
+// Decapsulated packet of a queued ESP packet, its length is known once its batch is done
+typedef struct esp_pending_t {
+  pcap_hdr *hdr;
+  u_char *payload;
+  int len;                      // ESP packet length, the decrypted packet is shorter
+  int num;
+} esp_pending_t;
+
+#define ICV_BATCH_JOBS    256
+
+// ESP packet whose HMAC ICV is checked with the other packets of its batch
+typedef struct icv_job_t {
+  llflow_t *flow;
+  const u_char *data;           // ESP header up to the ICV
+  int len;
+  const u_char *payload;        // Source packet, copied raw if verification fails
+  int payload_len;
+  pcap_hdr *new_packet_hdr;
+  u_char *new_packet_payload;
+} icv_job_t;
+
+// ICV verification counters, each thread adds its own to the total when it ends
+typedef struct icv_stats_t {
+  unsigned long verified;
+  unsigned long failed;         // Packets copied raw
+  unsigned long unchecked;      // No authentication key, algorithm not supported, or truncated packet
+} icv_stats_t;
+
+// Slot of the ESP flows hash table, hash is kept to skip most key comparisons
+typedef struct flow_slot_t {
+  u_int32_t hash;
+  llflow_t *flow;         // NULL if slot is free
+} flow_slot_t;
+
+// Open addressing (linear probing) hash table indexing llflow_t by (src, dst, spi)
+typedef struct flow_table_t {
+  flow_slot_t *slots;
+  u_int32_t size;         // Always a power of 2
+  u_int32_t count;
+} flow_table_t;
+
+#define FLOW_TABLE_MIN_SIZE 64
+
+// Memory block the ESP flows and their keys are carved from, freed all at once by flows_cleanup
+typedef struct flow_arena_t {
+  struct flow_arena_t *next;    // Previous block, full
+  size_t size;
+  size_t used;
+  unsigned char data[] __attribute__ ((aligned (16)));
+} flow_arena_t;
+
+#define FLOW_ARENA_MIN_SIZE (64 * 1024)
+#define FLOW_ARENA_ALIGN(size) (((size) + 15) & ~((size_t) 15))
+#define CONF_COLUMNS        6     // src dst crypt auth key spi
+#define CONF_MAX_COLUMNS    7     // Followed by the optional authentication key
+
+flow_table_t flow_table = { .slots = NULL, .size = 0, .count = 0 };
+
 /* rfc 4835:
         Requirement    Encryption Algorithm (notes)
         -----------    --------------------------
@@ -85,8 +171,11 @@ auth_method_t any160            = { .name = "any160",          .openssl_auth = N
 auth_method_t any128            = { .name = "any128",          .openssl_auth = NULL, .len =  96/8, .next = &any160 };
 auth_method_t any96             = { .name = "any96",           .openssl_auth = NULL, .len =  96/8, .next = &any128 };
 auth_method_t aes_xcbc_mac_96   = { .name = "aes_xcbc_mac-96", .openssl_auth = NULL, .len =  96/8, .next = &any96 };
-auth_method_t hmac_md5_96       = { .name = "hmac_md5-96",     .openssl_auth = NULL, .len =  96/8, .next = &aes_xcbc_mac_96 };
-auth_method_t hmac_sha_1_96     = { .name = "hmac_sha1-96",    .openssl_auth = NULL, .len =  96/8, .next = &hmac_md5_96 };
+auth_method_t hmac_sha512_256   = { .name = "hmac_sha512-256", .openssl_auth = "sha512", .len = 256/8, .next = &aes_xcbc_mac_96 };
+auth_method_t hmac_sha384_192   = { .name = "hmac_sha384-192", .openssl_auth = "sha384", .len = 192/8, .next = &hmac_sha512_256 };
+auth_method_t hmac_sha256_128   = { .name = "hmac_sha256-128", .openssl_auth = "sha256", .len = 128/8, .next = &hmac_sha384_192 };
+auth_method_t hmac_md5_96       = { .name = "hmac_md5-96",     .openssl_auth = "md5",  .len =  96/8, .next = &hmac_sha256_128 };
+auth_method_t hmac_sha_1_96     = { .name = "hmac_sha1-96",    .openssl_auth = "sha1", .len =  96/8, .next = &hmac_md5_96 };
 auth_method_t null_auth         = { .name = "null_auth",       .openssl_auth = NULL, .len =   8/8, .next = &hmac_sha_1_96 };
 
 // Linked list, point to first element
@@ -95,7 +184,15 @@ auth_method_t *auth_method_list = &null_auth;
 /* Encryption algorithms */
 
 crypt_method_t null_enc       = { .name = "null_enc",   .openssl_cipher = NULL,           .next = NULL};
-crypt_method_t aes_256_cbc    = { .name = "aes256-cbc", .openssl_cipher = "aes-256-cbc",  .next = &null_enc};
+crypt_method_t chacha20_poly1305 = { .name = "chacha20-poly1305", .openssl_cipher = "chacha20-poly1305",
+                                     .salt_len = 4, .icv_len = 16, .next = &null_enc};
+crypt_method_t aes_256_gcm16  = { .name = "aes256-gcm16", .openssl_cipher = "aes-256-gcm",
+                                  .salt_len = 4, .icv_len = 16, .next = &chacha20_poly1305};
+crypt_method_t aes_192_gcm16  = { .name = "aes192-gcm16", .openssl_cipher = "aes-192-gcm",
+                                  .salt_len = 4, .icv_len = 16, .next = &aes_256_gcm16};
+crypt_method_t aes_128_gcm16  = { .name = "aes128-gcm16", .openssl_cipher = "aes-128-gcm",
+                                  .salt_len = 4, .icv_len = 16, .next = &aes_192_gcm16};
+crypt_method_t aes_256_cbc    = { .name = "aes256-cbc", .openssl_cipher = "aes-256-cbc",  .next = &aes_128_gcm16};
 crypt_method_t aes_192_cbc    = { .name = "aes192-cbc", .openssl_cipher = "aes-192-cbc",  .next = &aes_256_cbc};
 crypt_method_t aes_128_cbc    = { .name = "aes128-cbc", .openssl_cipher = "aes-128-cbc",  .next = &aes_192_cbc};
 crypt_method_t aes_128_ctr    = { .name = "aes128-ctr", .openssl_cipher = "aes-128-ctr",  .next = &aes_128_cbc};
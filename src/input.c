@@ -0,0 +1,291 @@
+/*
+  Copyright (c) 2012-2016 Loïc Pefferkorn <loic-ipdecap@loicp.eu>
+  ipdecap [http://loicpefferkorn.net/ipdecap]
+
+  This file is part of ipdecap.
+
+  Ipdecap is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Ipdecap is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ipdecap.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+#include <signal.h>
+#include <pthread.h>
+#include <pcap/pcap.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "config.h"
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+#include "ipdecap.h"
+#include "input.h"
+
+/*
+ * Put back the first bytes read from a stream: rewind it, or push them back if it is a pipe
+ * (glibc allows several bytes to be pushed back)
+ *
+ */
+void input_unread(FILE *in, const u_char *data, size_t len, const char *filename) {
+
+  int i;
+
+  if (fseeko(in, 0, SEEK_SET) == 0)
+    return;
+
+  for (i=len-1;i>=0;i--) {
+    if (ungetc(data[i], in) == EOF)
+      error("Cannot detect format of %s: %s\n", filename, "stream cannot be pushed back");
+  }
+}
+
+static void write_all(int fd, const u_char *data, size_t len) {
+
+  ssize_t rc;
+
+  while (len > 0) {
+    rc = write(fd, data, len);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    // Reader is gone (stopped on a truncated packet...), nothing more is needed
+    if (rc < 0 && errno == EPIPE)
+      pthread_exit(NULL);
+    if (rc < 0)
+      error("Cannot write decompressed data: %s\n", strerror(errno));
+    data += rc;
+    len -= rc;
+  }
+}
+
+/*
+ * Next chunk of compressed data, starting with the bytes read to detect the format
+ *
+ */
+static size_t inflate_read(input_inflate_t *inf, u_char *buf) {
+
+  size_t len = 0;
+
+  if (inf->prefix_len > 0) {
+    memcpy(buf, inf->prefix, inf->prefix_len);
+    len = inf->prefix_len;
+    inf->prefix_len = 0;
+  }
+
+  len += fread(buf + len, 1, INPUT_CHUNK_SIZE - len, inf->in);
+  if (ferror(inf->in))
+    error("Cannot read input file %s: %s\n", inf->filename, strerror(errno));
+
+  return len;
+}
+
+#ifdef HAVE_LIBZ
+static void inflate_gzip(input_inflate_t *inf, u_char *in_buf, u_char *out_buf) {
+
+  z_stream zs;
+  int rc = Z_OK;
+
+  memset(&zs, 0, sizeof(zs));
+  // 32: gzip or zlib header detection
+  if (inflateInit2(&zs, 15 + 32) != Z_OK)
+    error("inflateInit2() failed\n");
+
+  while ((zs.avail_in = inflate_read(inf, in_buf)) > 0) {
+    zs.next_in = in_buf;
+    do {
+      // Concatenated gzip members (pigz, cat a.gz b.gz)
+      if (rc == Z_STREAM_END) {
+        if (zs.avail_in == 0)
+          break;
+        if (inflateReset(&zs) != Z_OK)
+          error("inflateReset() failed\n");
+      }
+      zs.next_out = out_buf;
+      zs.avail_out = INPUT_CHUNK_SIZE;
+      rc = inflate(&zs, Z_NO_FLUSH);
+      if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR)
+        error("Cannot decompress %s: %s\n", inf->filename, zs.msg != NULL ? zs.msg : "invalid data");
+      write_all(inf->fd, out_buf, INPUT_CHUNK_SIZE - zs.avail_out);
+    } while (zs.avail_in > 0 || zs.avail_out == 0);
+  }
+
+  if (rc != Z_STREAM_END)
+    warnx("%s: truncated gzip stream\n", inf->filename);
+
+  inflateEnd(&zs);
+}
+#endif
+
+#ifdef HAVE_LIBZSTD
+static void inflate_zstd(input_inflate_t *inf, u_char *in_buf, u_char *out_buf) {
+
+  ZSTD_DCtx *dctx = NULL;
+  ZSTD_inBuffer zin;
+  ZSTD_outBuffer zout;
+  size_t rc = 0;
+
+  if ((dctx = ZSTD_createDCtx()) == NULL)
+    error("ZSTD_createDCtx() failed\n");
+
+  while ((zin.size = inflate_read(inf, in_buf)) > 0) {
+    zin.src = in_buf;
+    zin.pos = 0;
+    // A full output buffer means the decoder may hold more data
+    do {
+      zout.dst = out_buf;
+      zout.size = INPUT_CHUNK_SIZE;
+      zout.pos = 0;
+      rc = ZSTD_decompressStream(dctx, &zout, &zin);
+      if (ZSTD_isError(rc))
+        error("Cannot decompress %s: %s\n", inf->filename, ZSTD_getErrorName(rc));
+      write_all(inf->fd, out_buf, zout.pos);
+    } while (zin.pos < zin.size || zout.pos == zout.size);
+  }
+
+  // 0: last frame is complete
+  if (rc != 0)
+    warnx("%s: truncated zstd stream\n", inf->filename);
+
+  ZSTD_freeDCtx(dctx);
+}
+#endif
+
+/*
+ * Decompression thread: decompress the whole input into the pipe, then close it
+ *
+ */
+static void * inflate_thread(void *arg) {
+
+  input_inflate_t *inf = arg;
+  u_char *in_buf = NULL;
+  u_char *out_buf = NULL;
+  sigset_t set;
+
+  // A closed pipe makes write() fail with EPIPE in this thread instead of killing the process
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  MALLOC(in_buf, INPUT_CHUNK_SIZE, u_char);
+  MALLOC(out_buf, INPUT_CHUNK_SIZE, u_char);
+
+  switch (inf->codec) {
+#ifdef HAVE_LIBZ
+    case INPUT_GZIP:
+      inflate_gzip(inf, in_buf, out_buf);
+      break;
+#endif
+#ifdef HAVE_LIBZSTD
+    case INPUT_ZSTD:
+      inflate_zstd(inf, in_buf, out_buf);
+      break;
+#endif
+    default:
+      break;
+  }
+
+  close(inf->fd);
+  if (inf->in != stdin)
+    fclose(inf->in);
+  free(in_buf);
+  free(out_buf);
+  free(inf);
+
+  return NULL;
+}
+
+/*
+ * Open filename ("-" for standard input) for reading. A gzip or zstd compressed file
+ * is given as the read end of a pipe, fed by a decompression thread.
+ * Returns NULL and sets errno if the file cannot be opened
+ *
+ */
+FILE * input_open(const char *filename) {
+
+  input_inflate_t *inf = NULL;
+  input_codec_t codec = INPUT_PLAIN;
+  pthread_t thread;
+  FILE *in = NULL;
+  FILE *out = NULL;
+  u_char magic[4];
+  size_t len;
+  int fds[2];
+  int rc;
+
+  if (is_stdio(filename))
+    in = stdin;
+  else if ((in = fopen(filename, "rb")) == NULL)
+    return NULL;
+
+  len = fread(magic, 1, sizeof(magic), in);
+
+  if (len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+    codec = INPUT_GZIP;
+  else if (len == 4 && memcmp(magic, "\x28\xb5\x2f\xfd", 4) == 0)
+    codec = INPUT_ZSTD;
+
+  if (codec == INPUT_PLAIN) {
+    input_unread(in, magic, len, filename);
+    return in;
+  }
+
+#ifndef HAVE_LIBZ
+  if (codec == INPUT_GZIP)
+    error("%s is gzip compressed, but ipdecap is built without zlib\n", filename);
+#endif
+#ifndef HAVE_LIBZSTD
+  if (codec == INPUT_ZSTD)
+    error("%s is zstd compressed, but ipdecap is built without libzstd\n", filename);
+#endif
+
+  verbose("Decompressing %s (%s) with a dedicated thread\n", filename,
+    codec == INPUT_GZIP ? "gzip" : "zstd");
+
+  if (pipe(fds) == -1)
+    error("Cannot create pipe: %s\n", strerror(errno));
+
+#ifdef F_SETPIPE_SZ
+  // Default pipe size is 64KB, failure is harmless
+  fcntl(fds[1], F_SETPIPE_SZ, INPUT_PIPE_SIZE);
+#endif
+
+  MALLOC(inf, 1, input_inflate_t);
+  inf->in = in;
+  inf->fd = fds[1];
+  inf->codec = codec;
+  memcpy(inf->prefix, magic, len);
+  inf->prefix_len = len;
+  inf->filename = filename;
+
+  if ((rc = pthread_create(&thread, NULL, inflate_thread, inf)) != 0)
+    error("Cannot create decompression thread: %s\n", strerror(rc));
+  pthread_detach(thread);
+
+  if ((out = fdopen(fds[0], "rb")) == NULL)
+    error("fdopen() failed: %s\n", strerror(errno));
+
+  return out;
+}
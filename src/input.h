@@ -0,0 +1,46 @@
+/*
+  Copyright (c) 2012-2016 Loïc Pefferkorn <loic-ipdecap@loicp.eu>
+  ipdecap [http://loicpefferkorn.net/ipdecap]
+
+  This file is part of ipdecap.
+
+  Ipdecap is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Ipdecap is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ipdecap.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Input file opening: gzip and zstd compressed files are decompressed on the fly
+ * by a dedicated thread, writing into a pipe read by the packet loop. The pipe is
+ * a bounded buffer: decompression overlaps with decapsulation, nothing goes to disk.
+ */
+
+#define INPUT_CHUNK_SIZE    (128*1024)
+#define INPUT_PIPE_SIZE     (1024*1024)   // Bytes decompressed ahead of the packet loop
+
+typedef enum input_codec_t {
+  INPUT_PLAIN,
+  INPUT_GZIP,
+  INPUT_ZSTD
+} input_codec_t;
+
+typedef struct input_inflate_t {
+  FILE *in;                     // Compressed stream, its first bytes are in prefix
+  int fd;                       // Pipe write end
+  input_codec_t codec;
+  u_char prefix[4];
+  size_t prefix_len;
+  const char *filename;
+} input_inflate_t;
+
+FILE * input_open(const char *filename);
+void input_unread(FILE *in, const u_char *data, size_t len, const char *filename);
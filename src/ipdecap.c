@@ -26,32 +26,69 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
 #include <net/ethernet.h>
 #include <netinet/in_systm.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/ip6.h>
 #include <openssl/evp.h>
+#include <openssl/crypto.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/provider.h>
+#endif
 #include <errno.h>
 #include <limits.h>
 #include <getopt.h>
 #include <stdbool.h>
 #include <inttypes.h>
 #include <err.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <time.h>
 
 #include "config.h"
 #include "ipdecap.h"
 #include "gre.h"
+#include "cbc_batch.h"
 #include "esp.h"
+#include "pipeline.h"
+#include "split.h"
+#include "mmap_reader.h"
+#include "writer.h"
+#include "capture.h"
+#include "pcapng.h"
+#include "input.h"
+#include "stats.h"
+#include "profile.h"
+#include "probes.h"
 
 // Command line parameters
-static const char *args_str = "vi:o:c:f:Vl";
+static const char *args_str = "vi:o:c:f:t:s:maI:r:F:nz:Z:LASJ:Pd:Vl";
 
 struct global_args_t {
   char *input_file;       // --input option
+  char *interface;        // --interface option
+  int ring_size;          // --ring-size option, in MB
   char *output_file;      // --output option
   char *esp_config_file;  // --config option
   char *bpf_filter;       // --filter option
+  int threads;            // --threads option
+  int split;              // --split option
+  bool mmap;              // --mmap option
+  bool async_write;       // --async-write option
+  bool pcapng;            // --pcapng option
+  bool compress;          // --zstd option
+  writer_zstd_t zstd;     // --zstd, --zstd-threads and --zstd-long options
+  int flush_packets;      // --flush option: flush output every N packets, 0 if not set
+  int flush_ms;           // --flush option: flush output every T milliseconds, 0 if not set
+  bool verify_icv;        // --verify-icv option
+  bool stats;             // --stats option
+  char *stats_json;       // --stats-json option
+  bool profile;           // --profile option
+  int max_depth;          // --depth option: encapsulation layers removed from a packet
   bool verbose;           // --verbose option
   bool list_algo;         // --list option
 } global_args;
@@ -59,8 +96,24 @@ struct global_args_t {
 static const struct option args_long[] = {
   { "input",      required_argument,  NULL, 'i'},
   { "output",     required_argument,  NULL, 'o'},
+  { "interface",  required_argument,  NULL, 'I'},
+  { "ring-size",  required_argument,  NULL, 'r'},
   { "esp_config", required_argument,  NULL, 'c'},
   { "filter",     required_argument,  NULL, 'f'},
+  { "threads",    required_argument,  NULL, 't'},
+  { "split",      required_argument,  NULL, 's'},
+  { "mmap",       no_argument,        NULL, 'm'},
+  { "async-write", no_argument,       NULL, 'a'},
+  { "flush",      required_argument,  NULL, 'F'},
+  { "pcapng",     no_argument,        NULL, 'n'},
+  { "zstd",       required_argument,  NULL, 'z'},
+  { "zstd-threads", required_argument, NULL, 'Z'},
+  { "zstd-long",  no_argument,        NULL, 'L'},
+  { "verify-icv", no_argument,        NULL, 'A'},
+  { "stats",      no_argument,        NULL, 'S'},
+  { "stats-json", required_argument,  NULL, 'J'},
+  { "profile",    no_argument,        NULL, 'P'},
+  { "depth",      required_argument,  NULL, 'd'},
   { "list",       no_argument,        NULL, 'l'},
   { "verbose",    no_argument,        NULL, 'v'},
   { "version",    no_argument,        NULL, 'V'},
@@ -71,18 +124,85 @@ static const struct option args_long[] = {
 // Global variables
 pcap_dumper_t *pcap_dumper;
 int ignore_esp;
+out_packet_t out_packet;
+struct llflow_t *flow_head = NULL;
+struct llflow_t *flow_tail = NULL;     // Last flow of the list, to append in constant time
+int flow_count = 0;
+flow_arena_t *flow_arena = NULL;
+
+// Each decapsulation thread has its own copy of the flows cipher contexts, indexed by llflow_t.index
+__thread EVP_CIPHER_CTX **thread_flow_ctx = NULL;
+
+// AES-CBC packets waiting for the multi-buffer engine, only decapsulation threads have queues
+static __thread cbc_job_t *esp_jobs = NULL;
+static __thread esp_deferred_t *esp_deferred = NULL;
+static __thread int esp_deferred_count = 0;
+
+// HMAC checked packets waiting for the end of their batch, only decapsulation threads have queues
+static __thread icv_job_t *icv_jobs = NULL;
+static __thread int icv_job_count = 0;
+static __thread EVP_MD_CTX *icv_ctx = NULL;   // Copy of a flow HMAC state, for a packet
+
+// ESP packets queued by this thread, and their decapsulated packets: their length is
+// only known once esp_batch_flush() is done
+static __thread unsigned long esp_queued = 0;
+static __thread esp_pending_t *esp_pending = NULL;
+static __thread int esp_pending_count = 0;
+
+// ICV verification counters of each thread, and of all threads that ended
+static __thread icv_stats_t icv_stats;
+static icv_stats_t icv_total;
+static pthread_mutex_t icv_total_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// pcapng input is written back as pcapng, block by block
+static pcapng_t pcapng;
+static bool pcapng_mode = false;
+
+// stderr if packets are written to standard output
+static FILE *verbose_stream = NULL;
+
+// Stops the output flush thread, for a time based flush policy
+static atomic_bool flush_stop = false;
+
+// Set by SIGINT/SIGTERM to stop a live capture
+static volatile sig_atomic_t capture_stop = 0;
+
+// Copy of a decapsulated packet, whose inner encapsulation is removed back into its buffer
+static __thread u_char nested_payload[MAXIMUM_SNAPLEN];
+
+// Set by decap_packet() while the inner packet may be left in the source packet, NULL to copy it
+static __thread out_slice_t *decap_slice = NULL;
+
+// Number of the packet decapsulated by this thread, for the tracepoints of the process_xx_packet functions
+static __thread int current_packet = 0;
 
 void usage(void) {
   printf("Ipdecap %s, decapsulate ESP, GRE, IPIP packets - Loic Pefferkorn\n", PACKAGE_VERSION);
   printf(
   "Usage\n"
-  "    ipdecap [-v] [-l] [-V] -i input.cap -o output.cap [-c esp.conf] [-f <bpf filter>] \n"
+  "    ipdecap [-v] [-l] [-V] {-i input.cap | -I interface [-r MB]} -o output.cap [-c esp.conf] [-f <bpf filter>] [-t threads | -s parts] [-m] [-a] [-F N | -F Tms] [-n] [-z level [-Z threads] [-L]] [-A] [-S] [-J stats.json] [-P] [-d depth]\n"
   "Options:\n"
   "  -c, --conf     configuration file for ESP parameters (IP addresses, algorithms, ... (see man ipdecap)\n"
   "  -h, --help     this help message\n"
-  "  -i, --input    pcap file to process\n"
-  "  -o, --output   pcap file with decapsulated data\n"
+  "  -i, --input    pcap file to process, - for standard input\n"
+  "  -I, --interface  network interface to capture packets from, until interrupted\n"
+  "  -r, --ring-size  capture ring size in MB (default 64)\n"
+  "  -o, --output   pcap file with decapsulated data, - for standard output\n"
   "  -f, --filter   only process packets matching the bpf filter\n"
+  "  -t, --threads  number of decapsulation threads (default 0: decapsulate while reading)\n"
+  "  -s, --split    split the input pcap file in parts decapsulated in parallel, then merged\n"
+  "  -m, --mmap     read the input pcap file through a memory mapping, without copy\n"
+  "  -a, --async-write  write the output file by large buffers, overlapping writes with processing\n"
+  "  -F, --flush    flush output every N packets (1: each packet), or every T milliseconds with Tms\n"
+  "  -n, --pcapng   write a pcapng input file as pcapng, keeping its other blocks\n"
+  "  -z, --zstd     write a zstd compressed output file with this level (1 to 19)\n"
+  "  -Z, --zstd-threads  number of zstd compression threads (default 1)\n"
+  "  -L, --zstd-long     zstd long distance matching, better ratio for a 128MB memory window\n"
+  "  -A, --verify-icv  verify the integrity check value of ESP packets (HMAC with an authentication key, AEAD), copy them raw on failure\n"
+  "  -S, --stats    print packets and bytes counters per encapsulation type and ESP SA at exit\n"
+  "  -J, --stats-json  write the same counters as JSON to this file, - for standard output\n"
+  "  -P, --profile  print the time spent in each processing stage, with latency histograms, at exit\n"
+  "  -d, --depth    remove up to this number of nested encapsulations from each packet (default 1)\n"
   "  -l, --list     list availables ESP encryption and authentication algorithms\n"
   "  -V, --version  print version\n"
   "  -v, --verbose  verbose\n"
@@ -93,12 +213,21 @@ void print_version() {
   printf("Ipdecap %s\n", PACKAGE_VERSION);
 }
 
+/*
+ * True if filename is "-", standard input or output
+ *
+ */
+bool is_stdio(const char *filename) {
+
+  return filename != NULL && strcmp(filename, "-") == 0;
+}
+
 void verbose(const char *format, ...) {
 
   if (global_args.verbose == true) {
     va_list argp;
     va_start (argp, format);
-    vfprintf(stdout, format, argp);
+    vfprintf(verbose_stream, format, argp);
     va_end(argp);
   }
 }
@@ -110,12 +239,32 @@ void parse_options(int argc, char **argv) {
 
   int opt = 0;
   int opt_index = 0;
+  char *endptr = NULL;  // for strtol
+  long value;
 
   // Init parameters to default values
   global_args.esp_config_file = NULL;
   global_args.input_file = NULL;
+  global_args.interface = NULL;
+  global_args.ring_size = CAPTURE_RING_DEFAULT;
   global_args.output_file = NULL;
   global_args.bpf_filter = NULL;
+  global_args.threads = 0;
+  global_args.split = 0;
+  global_args.mmap = false;
+  global_args.async_write = false;
+  global_args.pcapng = false;
+  global_args.compress = false;
+  global_args.zstd.level = 3;
+  global_args.zstd.workers = 1;
+  global_args.zstd.long_window = false;
+  global_args.flush_packets = 0;
+  global_args.flush_ms = 0;
+  global_args.verify_icv = false;
+  global_args.stats = false;
+  global_args.stats_json = NULL;
+  global_args.profile = false;
+  global_args.max_depth = 1;
   global_args.verbose = false;
   global_args.list_algo = false;
 
@@ -128,12 +277,94 @@ void parse_options(int argc, char **argv) {
       case 'o':
         global_args.output_file = optarg;
         break;
+      case 'I':
+        global_args.interface = optarg;
+        break;
+      case 'r':
+        errno = 0;
+        global_args.ring_size = strtol(optarg, &endptr, 10);
+        if (errno != 0 || endptr == optarg || *endptr != '\0'
+          || global_args.ring_size < CAPTURE_RING_MIN || global_args.ring_size > CAPTURE_RING_MAX)
+          error("Invalid ring size: %s (%i to %i MB)\n", optarg, CAPTURE_RING_MIN, CAPTURE_RING_MAX);
+        break;
       case 'c':
         global_args.esp_config_file = optarg;
         break;
       case 'f':
         global_args.bpf_filter = optarg;
         break;
+      case 't':
+        errno = 0;
+        global_args.threads = strtol(optarg, &endptr, 10);
+        if (errno != 0 || endptr == optarg || *endptr != '\0'
+          || global_args.threads < 0 || global_args.threads > PIPELINE_MAX_WORKERS)
+          error("Invalid number of threads: %s (0 to %i)\n", optarg, PIPELINE_MAX_WORKERS);
+        break;
+      case 's':
+        errno = 0;
+        global_args.split = strtol(optarg, &endptr, 10);
+        if (errno != 0 || endptr == optarg || *endptr != '\0'
+          || global_args.split < 1 || global_args.split > SPLIT_MAX_PARTS)
+          error("Invalid number of parts: %s (1 to %i)\n", optarg, SPLIT_MAX_PARTS);
+        break;
+      case 'm':
+        global_args.mmap = true;
+        break;
+      case 'a':
+        global_args.async_write = true;
+        break;
+      case 'F':
+        errno = 0;
+        value = strtol(optarg, &endptr, 10);
+        if (errno != 0 || endptr == optarg || value < 1 || value > INT_MAX)
+          error("Invalid flush policy: %s (N packets or Tms)\n", optarg);
+        if (*endptr == '\0')
+          global_args.flush_packets = value;
+        else if (strcmp(endptr, "ms") == 0)
+          global_args.flush_ms = value;
+        else
+          error("Invalid flush policy: %s (N packets or Tms)\n", optarg);
+        break;
+      case 'n':
+        global_args.pcapng = true;
+        break;
+      case 'z':
+        errno = 0;
+        global_args.zstd.level = strtol(optarg, &endptr, 10);
+        if (errno != 0 || endptr == optarg || *endptr != '\0'
+          || global_args.zstd.level < WRITER_ZSTD_MIN_LEVEL || global_args.zstd.level > WRITER_ZSTD_MAX_LEVEL)
+          error("Invalid zstd level: %s (%i to %i)\n", optarg, WRITER_ZSTD_MIN_LEVEL, WRITER_ZSTD_MAX_LEVEL);
+        global_args.compress = true;
+        break;
+      case 'Z':
+        errno = 0;
+        global_args.zstd.workers = strtol(optarg, &endptr, 10);
+        if (errno != 0 || endptr == optarg || *endptr != '\0'
+          || global_args.zstd.workers < 0 || global_args.zstd.workers > WRITER_ZSTD_MAX_WORKERS)
+          error("Invalid number of zstd threads: %s (0 to %i)\n", optarg, WRITER_ZSTD_MAX_WORKERS);
+        break;
+      case 'L':
+        global_args.zstd.long_window = true;
+        break;
+      case 'A':
+        global_args.verify_icv = true;
+        break;
+      case 'S':
+        global_args.stats = true;
+        break;
+      case 'J':
+        global_args.stats_json = optarg;
+        break;
+      case 'P':
+        global_args.profile = true;
+        break;
+      case 'd':
+        errno = 0;
+        global_args.max_depth = strtol(optarg, &endptr, 10);
+        if (errno != 0 || endptr == optarg || *endptr != '\0'
+          || global_args.max_depth < 1 || global_args.max_depth > DECAP_MAX_DEPTH)
+          error("Invalid depth: %s (1 to %i)\n", optarg, DECAP_MAX_DEPTH);
+        break;
       case 'l':
         global_args.list_algo = true;
         break;
@@ -159,6 +390,41 @@ void parse_options(int argc, char **argv) {
     }
     opt = getopt_long(argc, argv, args_str, args_long, &opt_index);
   }
+
+  if (global_args.threads > 0 && global_args.split > 0)
+    error("--threads and --split options cannot be used together\n");
+
+  if (global_args.input_file != NULL && global_args.interface != NULL)
+    error("--input and --interface options cannot be used together\n");
+
+  if (global_args.interface != NULL && (global_args.split > 0 || global_args.mmap || global_args.pcapng))
+    error("--split, --mmap and --pcapng options need an input file\n");
+
+  if (global_args.split > 0 && (is_stdio(global_args.input_file) || is_stdio(global_args.output_file)))
+    error("--split option needs named input and output files\n");
+
+  if (global_args.mmap && is_stdio(global_args.input_file))
+    error("--mmap option needs a named input file\n");
+
+  if (is_stdio(global_args.stats_json) && is_stdio(global_args.output_file))
+    error("--stats-json and --output options cannot both write to standard output\n");
+
+  if (global_args.split > 1 && (global_args.async_write || global_args.mmap
+      || global_args.flush_packets > 0 || global_args.flush_ms > 0))
+    warnx("--async-write, --mmap and --flush options are not used with --split\n");
+
+  // Compressed output is written by the asynchronous writer
+  if (global_args.compress)
+    global_args.async_write = true;
+
+  if (global_args.compress && global_args.split > 0)
+    error("--zstd and --split options cannot be used together\n");
+
+  if (global_args.flush_ms > 0 && global_args.async_write)
+    error("--async-write and --zstd options cannot be used with a time based flush\n");
+
+  // Keep standard output for packets
+  verbose_stream = is_stdio(global_args.output_file) ? stderr : stdout;
 }
 
 void print_algorithms() {
@@ -171,12 +437,15 @@ void print_algorithms() {
     "\t\t3des-cbc                           (rfc2451)\n"
     "\t\taes128-cbc aes192-cbc aes256-cbc   (rfc3602)\n"
     "\t\taes128-ctr                         (rfc3686)\n"
+    "\t\taes128-gcm16 aes192-gcm16 aes256-gcm16 (rfc4106)\n"
+    "\t\tchacha20-poly1305                  (rfc7634)\n"
     "\t\tnull_enc                           (rfc2410)\n"
     "\n"
-    "\tAuthentication (not yet checked):\n"
+    "\tAuthentication (ICV checked with --verify-icv for HMAC, ignored with AEAD encryption):\n"
     "\n"
     "\t\thmac_md5-96                        (rfc2403)\n"
     "\t\thmac_sha1-96                       (rfc2404)\n"
+    "\t\thmac_sha256-128 hmac_sha384-192 hmac_sha512-256 (rfc4868)\n"
     "\t\taes_xcbc_mac-96                    (rfc3566)\n"
     "\t\tnull_auth                          (rfc2410)\n"
     "\t\tany96 any128 any160 any192 any256 any384 any512\n"
@@ -207,19 +476,20 @@ void dumpmem(char *prefix, const unsigned char *ptr, int size, int space) {
   printf("\n");
 }
 
-void *str2dec(const char *in, int maxsize) {
+/*
+ * Convert the hex string in to at most maxsize bytes in out.
+ * Return the number of bytes written, or -1 if in is too long or not hexadecimal.
+ *
+ */
+int hex_decode(const char *in, unsigned char *out, int maxsize) {
 
   int i, len;
   unsigned char c;
-  unsigned char *out = NULL;
-
-  MALLOC(out, maxsize, unsigned char);
 
   len = strlen(in);
   if (len > maxsize*2) {
     printf("str too long\n");
-    free(out);
-    return NULL;
+    return -1;
   }
   for(i=0;i<len;i++) {
     c = in[i];
@@ -232,8 +502,7 @@ void *str2dec(const char *in, int maxsize) {
       c = c-'a'+10;
     else {
       printf("non hex digit: %c\n", c);
-      free(out);
-      return NULL;
+      return -1;
     }
 
     if (i % 2 == 0)
@@ -241,43 +510,359 @@ void *str2dec(const char *in, int maxsize) {
     else
       out[i/2] = out[i/2] | c;
   }
-  return out;
+  return (len + 1) / 2;
+}
+
+/*
+ * Allocate size bytes for the ESP flows from the current arena block, zeroed and 16 bytes aligned.
+ * Nothing is freed individually, flows_cleanup frees all blocks.
+ *
+ */
+void * flow_arena_alloc(size_t size) {
+
+  void *ptr;
+
+  size = FLOW_ARENA_ALIGN(size);
+  flow_arena_reserve(size);
+
+  ptr = flow_arena->data + flow_arena->used;
+  flow_arena->used += size;
+  return ptr;
+}
+
+/*
+ * Make sure the current arena block has size bytes left, so that the flows of a whole
+ * configuration file can be allocated from a single block
+ *
+ */
+void flow_arena_reserve(size_t size) {
+
+  flow_arena_t *block;
+
+  if (flow_arena != NULL && flow_arena->size - flow_arena->used >= size)
+    return;
+
+  if (size < FLOW_ARENA_MIN_SIZE)
+    size = FLOW_ARENA_MIN_SIZE;
+
+  // Pages of large blocks are only zeroed when first touched
+  if ((block = calloc(1, sizeof(flow_arena_t) + size)) == NULL)
+    error("Cannot malloc");
+
+  block->size = size;
+  block->used = 0;
+  block->next = flow_arena;
+  flow_arena = block;
 }
 
 // Cleanup allocated flow during configuration file parsing (makes valgrind happy)
 void flows_cleanup() {
 
-  llflow_t *f, *tmp;
-  f = flow_head;
+  llflow_t *f;
+  flow_arena_t *block;
+  crypt_method_t *cm;
+  auth_method_t *am;
+
+  // Flows and keys are in the arena, only OpenSSL contexts and AES-CBC round keys are not
+  for (f = flow_head; f != NULL; f = f->next) {
+    free(f->batch_key);
+    EVP_MD_CTX_free(f->hmac_inner);
+    EVP_MD_CTX_free(f->hmac_outer);
+    EVP_CIPHER_CTX_free(f->ctx);
+  }
+
+  while (flow_arena != NULL) {
+    block = flow_arena;
+    flow_arena = block->next;
+    free(block);
+  }
+
+  free(flow_table.slots);
+
+  // Fetched algorithms are reference counted
+  for (cm = crypt_method_list; cm != NULL; cm = cm->next) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    EVP_CIPHER_free((EVP_CIPHER *) cm->cipher);
+#endif
+    cm->cipher = NULL;
+  }
+  for (am = auth_method_list; am != NULL; am = am->next) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    EVP_MD_free((EVP_MD *) am->md);
+#endif
+    am->md = NULL;
+  }
+
+  // Another configuration file can be read afterwards
+  flow_head = NULL;
+  flow_tail = NULL;
+  flow_count = 0;
+  memset(&flow_table, 0, sizeof(flow_table_t));
+}
+
+/*
+ * Give the calling decapsulation thread its own copy of each flow cipher context,
+ * OpenSSL contexts cannot be shared between threads. Keys are not scheduled again.
+ *
+ */
+void flows_thread_init() {
+
+  llflow_t *f = NULL;
+
+  stats_thread_init(flow_count);
+
+  if (flow_count == 0)
+    return;
+
+  MALLOC(thread_flow_ctx, flow_count, EVP_CIPHER_CTX *);
+  memset(thread_flow_ctx, 0, flow_count * sizeof(EVP_CIPHER_CTX *));
+
+  for (f = flow_head; f != NULL; f = f->next) {
+    if (f->ctx == NULL)
+      continue;
+
+    if ((thread_flow_ctx[f->index] = EVP_CIPHER_CTX_new()) == NULL)
+      error("Cannot allocate cipher context - EVP_CIPHER_CTX_new() err\n");
+
+    if (EVP_CIPHER_CTX_copy(thread_flow_ctx[f->index], f->ctx) != 1)
+      error("Cannot copy cipher context - EVP_CIPHER_CTX_copy() err\n");
+  }
+}
+
+void flows_thread_cleanup() {
+
+  int i;
+
+  icv_stats_merge();
+  stats_thread_merge();
+  EVP_MD_CTX_free(icv_ctx);
+  icv_ctx = NULL;
+
+  if (thread_flow_ctx == NULL)
+    return;
+
+  for (i=0;i<flow_count;i++)
+    EVP_CIPHER_CTX_free(thread_flow_ctx[i]);
+
+  free(thread_flow_ctx);
+  thread_flow_ctx = NULL;
+}
+
+/*
+ * Give the calling decapsulation thread its cipher contexts, and if the processor
+ * supports it, its queue of packets for the multi-buffer AES-CBC engine
+ *
+ */
+void decap_thread_init() {
+
+  flows_thread_init();
+
+  if (global_args.verify_icv) {
+    MALLOC(icv_jobs, ICV_BATCH_JOBS, icv_job_t);
+    icv_job_count = 0;
+  }
+
+  // A queued packet is in one queue at least
+  MALLOC(esp_pending, CBC_BATCH_JOBS + ICV_BATCH_JOBS, esp_pending_t);
+  esp_pending_count = 0;
+
+  if (!cbc_batch_available())
+    return;
+
+  MALLOC(esp_jobs, CBC_BATCH_JOBS, cbc_job_t);
+  MALLOC(esp_deferred, CBC_BATCH_JOBS, esp_deferred_t);
+  esp_deferred_count = 0;
+}
+
+void decap_thread_cleanup() {
+
+  free(esp_jobs);
+  free(esp_deferred);
+  free(icv_jobs);
+  free(esp_pending);
+  esp_jobs = NULL;
+  esp_deferred = NULL;
+  icv_jobs = NULL;
+  esp_pending = NULL;
+
+  flows_thread_cleanup();
+}
+
+/*
+ * Add the ICV verification counters of the calling thread to the total
+ *
+ */
+void icv_stats_merge() {
+
+  pthread_mutex_lock(&icv_total_lock);
+  icv_total.verified += icv_stats.verified;
+  icv_total.failed += icv_stats.failed;
+  icv_total.unchecked += icv_stats.unchecked;
+  pthread_mutex_unlock(&icv_total_lock);
+
+  memset(&icv_stats, 0, sizeof(icv_stats_t));
+}
+
+/*
+ * Print ICV verification counters of all threads
+ *
+ */
+void icv_stats_print() {
+
+  icv_stats_merge();
 
-  while (f != NULL) {
-    tmp = f;
-    f = f->next;
-    free(tmp->crypt_name);
-    free(tmp->auth_name);
-    free(tmp->key);
+  fprintf(verbose_stream, "ICV verification: %lu verified, %lu failed (copied raw), %lu not verified\n",
+    icv_total.verified, icv_total.failed, icv_total.unchecked);
+}
+
+/*
+ * Print the processing counters of all threads with --stats, write them with --stats-json.
+ * Security associations are described from the flows.
+ *
+ */
+void stats_report() {
+
+  sa_info_t *sa_info = NULL;
+  llflow_t *f = NULL;
+  int len;
+
+  MALLOC(sa_info, flow_count + 1, sa_info_t);
+
+  for (f = flow_head; f != NULL; f = f->next) {
+    if (inet_ntop(f->addr_src.sa.sa_family, address_bytes(&f->addr_src, &len), sa_info[f->index].src, INET6_ADDRSTRLEN) == NULL
+      || inet_ntop(f->addr_dst.sa.sa_family, address_bytes(&f->addr_dst, &len), sa_info[f->index].dst, INET6_ADDRSTRLEN) == NULL)
+      error("Cannot convert ip address of flow\n");
+    sa_info[f->index].spi = f->spi;
+    sa_info[f->index].crypt_name = f->crypt_name;
+    sa_info[f->index].auth_name = f->auth_name;
+  }
+
+  if (global_args.stats)
+    stats_print(verbose_stream, sa_info);
+
+  if (global_args.stats_json != NULL && stats_write_json(global_args.stats_json, sa_info) != 0)
+    warnx("Cannot write statistics to %s: %s\n", global_args.stats_json, strerror(errno));
+
+  free(sa_info);
+}
+
+/*
+ * Cipher context to use for this flow in the calling thread
+ *
+ */
+EVP_CIPHER_CTX * flow_cipher_ctx(struct llflow_t *flow) {
+
+  return thread_flow_ctx != NULL ? thread_flow_ctx[flow->index] : flow->ctx;
+}
+
+/*
+ * Precompute the HMAC states of a flow from its authentication key: digests of the key
+ * xored with the inner and outer pads, so the key is not hashed again for each packet
+ *
+ */
+void flow_hmac_init(struct llflow_t *flow, char *auth_key) {
+
+  const EVP_MD *md = NULL;
+  unsigned char dec_key[MY_MAX_KEY_LENGTH > EVP_MAX_MD_SIZE ? MY_MAX_KEY_LENGTH : EVP_MAX_MD_SIZE];
+  unsigned char pad[EVP_MAX_MD_SIZE > 128 ? EVP_MAX_MD_SIZE : 128];
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_len;
+  int key_len, block_size, i;
 
-    free(tmp);
+  if ((md = auth_method_md(flow->auth_method)) == NULL)
+    error("%s: Cannot find digest %s\n", global_args.esp_config_file, flow->auth_method->openssl_auth);
+
+  if (auth_key[0] != '0' || (auth_key[1] != 'x' && auth_key[1] != 'X' ))
+    error("%s: Only hex authentication keys are supported and must begin with 0x\n", global_args.esp_config_file);
+  auth_key += 2;
+
+  if (strlen(auth_key) > 2 * MY_MAX_KEY_LENGTH || strlen(auth_key) % 2 != 0)
+    error("%s: Invalid authentication key length: %s\n", global_args.esp_config_file, auth_key);
+
+  if (hex_decode(auth_key, dec_key, MY_MAX_KEY_LENGTH) < 0)
+    err(1, "Cannot convert authentication key to decimal format: %s\n", auth_key);
+
+  key_len = strlen(auth_key) / 2;
+  block_size = EVP_MD_block_size(md);
+
+  // Keys longer than the digest block are hashed first (rfc 2104)
+  if (key_len > block_size) {
+    if (EVP_Digest(dec_key, key_len, digest, &digest_len, md, NULL) != 1)
+      error("%s: Cannot hash authentication key\n", global_args.esp_config_file);
+    memcpy(dec_key, digest, digest_len);
+    key_len = digest_len;
   }
+
+  if ((flow->hmac_inner = EVP_MD_CTX_new()) == NULL || (flow->hmac_outer = EVP_MD_CTX_new()) == NULL)
+    error("Cannot allocate digest context - EVP_MD_CTX_new() err\n");
+
+  memset(pad, 0x36, block_size);
+  for (i=0;i<key_len;i++)
+    pad[i] ^= dec_key[i];
+
+  if (EVP_DigestInit_ex(flow->hmac_inner, md, NULL) != 1
+    || EVP_DigestUpdate(flow->hmac_inner, pad, block_size) != 1)
+    error("%s: Cannot initialize digest %s\n", global_args.esp_config_file, flow->auth_method->openssl_auth);
+
+  memset(pad, 0x5c, block_size);
+  for (i=0;i<key_len;i++)
+    pad[i] ^= dec_key[i];
+
+  if (EVP_DigestInit_ex(flow->hmac_outer, md, NULL) != 1
+    || EVP_DigestUpdate(flow->hmac_outer, pad, block_size) != 1)
+    error("%s: Cannot initialize digest %s\n", global_args.esp_config_file, flow->auth_method->openssl_auth);
+}
+
+/*
+ * Resolve the OpenSSL cipher of an encryption method, once for all its flows.
+ * Since OpenSSL 3.0 it is fetched from the providers: a cipher found by name would
+ * be fetched again by each context initialization, which dominates large configurations.
+ *
+ */
+const EVP_CIPHER * crypt_method_cipher(crypt_method_t *cm) {
+
+  if (cm->cipher == NULL)
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    cm->cipher = EVP_CIPHER_fetch(NULL, cm->openssl_cipher, NULL);
+#else
+    cm->cipher = EVP_get_cipherbyname(cm->openssl_cipher);
+#endif
+
+  return cm->cipher;
+}
+
+/*
+ * Resolve the OpenSSL digest of an authentication method, once for all its flows
+ *
+ */
+const EVP_MD * auth_method_md(auth_method_t *am) {
+
+  if (am->md == NULL)
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    am->md = EVP_MD_fetch(NULL, am->openssl_auth, NULL);
+#else
+    am->md = EVP_get_digestbyname(am->openssl_auth);
+#endif
+
+  return am->md;
 }
 
 /*
- * Add to the linked list flow_head this ESP flow, read from configuration file by parse_esp_conf
+ * Add to the linked list flow_head this ESP flow, read from configuration file by parse_esp_conf.
+ * auth_key is NULL if the configuration line has no authentication key.
  *
  */
-int add_flow(char *ip_src, char *ip_dst, char *crypt_name, char *auth_name, char *key, char *spi) {
+int add_flow(char *ip_src, char *ip_dst, char *crypt_name, char *auth_name, char *key, char *spi, char *auth_key) {
 
   unsigned char *dec_key = NULL;
-  unsigned char *dec_spi = NULL;
+  unsigned char dec_spi[ESP_SPI_LEN];
   llflow_t *flow = NULL;
-  llflow_t *ptr = NULL;
   crypt_method_t *cm = NULL;
   auth_method_t *am = NULL;
   char *endptr = NULL;  // for strtol
 
-  MALLOC(flow, 1, llflow_t);
-
-  flow->next = NULL;
+  // Zeroed, with the other flows of the configuration file
+  flow = flow_arena_alloc(sizeof(llflow_t));
 
   debug_print("\tadd_flow() src:%s dst:%s crypt:%s auth:%s spi:%s\n",
     ip_src, ip_dst, crypt_name, auth_name, spi);
@@ -304,18 +889,19 @@ int add_flow(char *ip_src, char *ip_dst, char *crypt_name, char *auth_name, char
     else
       key += 2; // shift over 0x
 
-    // Check key length
-    if (strlen(key) > MY_MAX_KEY_LENGTH) {
+    // Check key length, 2 hex digits per byte: an AES-256-GCM key and its salt is 36 bytes
+    if (strlen(key) > 2 * MY_MAX_KEY_LENGTH) {
       error("%s: Key is too long : %lu > %i -  %s\n",
         global_args.esp_config_file,
         strlen(key),
-        MY_MAX_KEY_LENGTH,
+        2 * MY_MAX_KEY_LENGTH,
         key
         );
     }
 
     // Convert key to decimal format
-    if ((dec_key = str2dec(key, MY_MAX_KEY_LENGTH)) == NULL)
+    dec_key = flow_arena_alloc(MY_MAX_KEY_LENGTH);
+    if (hex_decode(key, dec_key, MY_MAX_KEY_LENGTH) < 0)
       err(1, "Cannot convert key to decimal format: %s\n", key);
 
   } else {
@@ -328,12 +914,27 @@ int add_flow(char *ip_src, char *ip_dst, char *crypt_name, char *auth_name, char
   else
     spi += 2; // shift over 0x
 
-  if ((dec_spi = str2dec(spi, ESP_SPI_LEN)) == NULL)
+  if (hex_decode(spi, dec_spi, ESP_SPI_LEN) < 0)
     err(1, "%s: Cannot convert spi to decimal format\n", global_args.esp_config_file);
 
-  if (inet_pton(AF_INET, ip_src, &(flow->addr_src)) != 1
-    || inet_pton(AF_INET, ip_dst, &(flow->addr_dst)) != 1) {
-    error("%s: Cannot convert ip address\n", global_args.esp_config_file);
+  // IPv6 SA: both addresses are IPv6
+  if (strchr(ip_src, ':') != NULL || strchr(ip_dst, ':') != NULL) {
+    flow->addr_src.sa_in6.sin6_family = AF_INET6;
+    flow->addr_dst.sa_in6.sin6_family = AF_INET6;
+
+    if (inet_pton(AF_INET6, ip_src, &(flow->addr_src.sa_in6.sin6_addr)) != 1
+      || inet_pton(AF_INET6, ip_dst, &(flow->addr_dst.sa_in6.sin6_addr)) != 1) {
+      error("%s: Cannot convert ip address, source and destination must be both IPv4 or IPv6\n",
+        global_args.esp_config_file);
+    }
+  } else {
+    flow->addr_src.sa_in.sin_family = AF_INET;
+    flow->addr_dst.sa_in.sin_family = AF_INET;
+
+    if (inet_pton(AF_INET, ip_src, &(flow->addr_src.sa_in.sin_addr)) != 1
+      || inet_pton(AF_INET, ip_dst, &(flow->addr_dst.sa_in.sin_addr)) != 1) {
+      error("%s: Cannot convert ip address\n", global_args.esp_config_file);
+    }
   }
 
   errno = 0;
@@ -352,93 +953,192 @@ int add_flow(char *ip_src, char *ip_dst, char *crypt_name, char *auth_name, char
           strerror(errno));
   }
 
-  flow->crypt_name = strdup(crypt_name);
-  flow->auth_name = strdup(auth_name);
+  // Same strings as the configuration file ones, found by name
+  flow->crypt_name = cm->name;
+  flow->auth_name = am->name;
   flow->key = dec_key;
+  flow->index = flow_count++;
 
-  EVP_CIPHER_CTX ctx;
-  EVP_CIPHER_CTX_init(&ctx);
-  flow->ctx = ctx;
+  // Resolve cipher and run key schedule once, packets will only set their IV
+  if (cm->openssl_cipher != NULL) {
 
-  // Adding to linked list
-  if (flow_head == NULL) {
-    flow_head = flow;
-    flow_head->next = NULL;
-  } else {
-    ptr = flow_head;
-    while(ptr->next != NULL)
-      ptr = ptr->next;
-    ptr->next = flow;
+    if ((flow->cipher = crypt_method_cipher(cm)) == NULL)
+      error("Cannot find cipher %s - EVP_get_cipherbyname() err\n", cm->openssl_cipher);
+
+    if ((flow->ctx = EVP_CIPHER_CTX_new()) == NULL)
+      error("Cannot allocate cipher context - EVP_CIPHER_CTX_new() err\n");
+
+    // AEAD keys end with the salt, which is the implicit part of the nonce
+    if (cm->salt_len > 0) {
+      if (strlen(key) != 2 * (size_t) (EVP_CIPHER_key_length(flow->cipher) + cm->salt_len))
+        error("%s: %s key must be %i bytes long: %i bytes key followed by %i bytes salt\n",
+          global_args.esp_config_file, crypt_name,
+          EVP_CIPHER_key_length(flow->cipher) + cm->salt_len,
+          EVP_CIPHER_key_length(flow->cipher), cm->salt_len);
+
+      flow->salt = flow->key + EVP_CIPHER_key_length(flow->cipher);
+
+      if (EVP_DecryptInit_ex(flow->ctx, flow->cipher, NULL, NULL, NULL) != 1
+        || EVP_CIPHER_CTX_ctrl(flow->ctx, EVP_CTRL_AEAD_SET_IVLEN, ESP_AEAD_NONCE_LEN, NULL) != 1)
+        error("%s: Cannot initialize cipher %s\n", global_args.esp_config_file, cm->openssl_cipher);
+    }
+
+    if (EVP_DecryptInit_ex(flow->ctx, flow->salt != NULL ? NULL : flow->cipher, NULL, flow->key, NULL) != 1)
+      error("%s: Cannot initialize cipher %s with the given key\n",
+        global_args.esp_config_file, cm->openssl_cipher);
+
+    // ESP has its own padding (rfc 4303), which is removed after decryption
+    EVP_CIPHER_CTX_set_padding(flow->ctx, 0);
+
+    // AES-CBC packets can also be decrypted by batches, NULL if the processor cannot
+    switch (EVP_CIPHER_nid(flow->cipher)) {
+      case NID_aes_128_cbc:
+      case NID_aes_192_cbc:
+      case NID_aes_256_cbc:
+        flow->batch_key = cbc_batch_key(flow->key, EVP_CIPHER_key_length(flow->cipher));
+        break;
+    }
   }
 
-  free(dec_spi);
+  // The ICV can only be checked with the authentication key, AEAD algorithms have their own
+  if (auth_key != NULL && am->openssl_auth != NULL && cm->icv_len == 0)
+    flow_hmac_init(flow, auth_key);
+
+  // Adding to linked list, in configuration file order
+  if (flow_tail == NULL)
+    flow_head = flow;
+  else
+    flow_tail->next = flow;
+  flow_tail = flow;
+
+  // Index it for packet lookups
+  flow_table_insert(flow);
+
   return 0;
 }
 
 /*
- * Parse the ipdecap ESP configuration file
+ * Read the whole ESP configuration file in a buffer, followed by an extra NUL byte.
+ * Return NULL if the file cannot be opened.
  *
  */
-int parse_esp_conf(char *filename) {
+static char * conf_read(const char *filename, size_t *len) {
 
-  const char delimiters[] = " \t";
-  char buffer[CONF_BUFFER_SIZE];
-  char *copy = NULL;
-  char *src = NULL;
-  char *dst = NULL;
-  char *crypt = NULL;
-  char *auth = NULL;
-  char *spi = NULL;
-  char *key = NULL;
-  int line = 0;
+  struct stat st;
+  size_t size, n;
+  char *buffer = NULL;
   FILE *conf;
 
-  conf = fopen(filename, "r");
-  if (conf == NULL )
-    return -1;
+  if ((conf = fopen(filename, "r")) == NULL)
+    return NULL;
 
-  while (fgets(buffer, CONF_BUFFER_SIZE, conf) != NULL) {
+  // Pipes and other special files have no size, the buffer grows as needed
+  size = (fstat(fileno(conf), &st) == 0 && S_ISREG(st.st_mode)) ? (size_t) st.st_size + 1 : CONF_BUFFER_SIZE;
+  MALLOC(buffer, size, char);
+
+  *len = 0;
+  while ((n = fread(buffer + *len, 1, size - *len, conf)) > 0) {
+    *len += n;
+    if (*len == size) {
+      size *= 2;
+      if ((buffer = realloc(buffer, size)) == NULL)
+        error("Cannot malloc");
+    }
+  }
 
-    line++;
-    copy = strdup(buffer);
+  if (ferror(conf))
+    error("Cannot read %s: %s\n", filename, strerror(errno));
 
-    // Empty line
-    if (strlen(copy) == 1)
-     continue;
+  buffer[*len] = '\0';
+  fclose(conf);
+  return buffer;
+}
 
-    // Commented line
-    if (copy[0] == '#')
-      continue;
+/*
+ * Find the columns of a configuration file line, separated by spaces or tabs, and return
+ * how many there are, at most CONF_MAX_COLUMNS. Columns are only NUL terminated if
+ * there are at least min of them, so that an invalid line can still be printed whole.
+ *
+ */
+static int conf_columns(char *line, char **columns, int min) {
+
+  char *ends[CONF_MAX_COLUMNS];
+  char *c = line;
+  int i, n = 0;
+
+  while (n < CONF_MAX_COLUMNS) {
+    c += strspn(c, " \t");
+    if (*c == '\0')
+      break;
+    columns[n] = c;
+    c += strcspn(c, " \t");
+    ends[n++] = c;
+  }
+
+  if (n >= min)
+    for (i=0;i<n;i++)
+      *ends[i] = '\0';
+
+  return n;
+}
+
+/*
+ * Parse the ipdecap ESP configuration file. It is read at once and parsed in place,
+ * flows are allocated from a single arena block and the hash table is sized once,
+ * so large files of hundreds of thousands SAs load in linear time.
+ *
+ */
+int parse_esp_conf(char *filename) {
+
+  char *columns[CONF_MAX_COLUMNS];
+  char *conf = NULL;
+  char *line = NULL;
+  char *end = NULL;
+  char *next = NULL;
+  int line_num = 0;
+  int count;
+  size_t len, lines;
 
-    // Remove new line character
-    copy[strcspn(copy, "\n")] = '\0';
+  if ((conf = conf_read(filename, &len)) == NULL)
+    return -1;
+  end = conf + len;
+
+  // Upper bound of the number of flows, comments and empty lines included
+  lines = 1;
+  for (line = conf; (line = memchr(line, '\n', end - line)) != NULL; line++)
+    lines++;
 
-    if ((src = strtok(copy, delimiters)) == NULL)
-      error("Cannot parse line %i in %s, missing column ?\n\t--> %s\n", line, filename, buffer);
+  flow_arena_reserve(lines * (FLOW_ARENA_ALIGN(sizeof(llflow_t)) + FLOW_ARENA_ALIGN(MY_MAX_KEY_LENGTH)));
+  flow_table_reserve(flow_table.count + (u_int32_t) lines);
 
-    if ((dst = strtok(NULL, delimiters)) == NULL)
-      error("Cannot parse line %i in %s, missing column ?\n\t--> %s\n", line, filename, buffer);
+  for (line = conf; line < end; line = next + 1) {
 
-    if ((crypt = strtok(NULL, delimiters)) == NULL)
-      error("Cannot parse line %i in %s, missing column ?\n\t--> %s\n", line, filename, buffer);
+    line_num++;
 
-    if ((auth = strtok(NULL, delimiters)) == NULL)
-      error("Cannot parse line %i in %s, missing column ?\n\t--> %s\n", line, filename, buffer);
+    // Remove new line character, the last line may have none
+    if ((next = memchr(line, '\n', end - line)) == NULL)
+      next = end;
+    *next = '\0';
+
+    // Empty or commented line
+    if (line[0] == '\0' || line[0] == '#')
+      continue;
 
-    if ((key = strtok(NULL, delimiters)) == NULL)
-      error("Cannot parse line %i in %s, missing column ?\n\t--> %s\n", line, filename, buffer);
+    if ((count = conf_columns(line, columns, CONF_COLUMNS)) < CONF_COLUMNS)
+      error("Cannot parse line %i in %s, missing column ?\n\t--> %s\n", line_num, filename, line);
 
-    if ((spi = strtok(NULL, delimiters)) == NULL)
-      error("Cannot parse line %i in %s, missing column ?\n\t--> %s\n", line, filename, buffer);
+    // Optional authentication key, to check ICVs
+    if (count == CONF_COLUMNS)
+      columns[CONF_COLUMNS] = NULL;
 
-    debug_print("parse_esp_conf() src:%s dst:%s crypt:%s auth:%s key:%s spi:%s\n",
-      src, dst, crypt, auth, key, spi);
+    debug_print("parse_esp_conf() src:%s dst:%s crypt:%s auth:%s key:%s spi:%s auth key:%s\n",
+      columns[0], columns[1], columns[2], columns[3], columns[4], columns[5],
+      columns[6] != NULL ? columns[6] : "none");
 
-    add_flow(src, dst, crypt, auth, key, spi);
-    free(copy);
+    add_flow(columns[0], columns[1], columns[2], columns[3], columns[4], columns[5], columns[6]);
   }
 
-  fclose(conf);
+  free(conf);
   return 0;
 }
 
@@ -485,98 +1185,306 @@ struct auth_method_t * find_auth_method(char *auth_name) {
 }
 
 /*
- * Try to find an ESP configuration to decrypt the flow between ip_src and ip_dst
+ * Return a pointer to the raw IP address stored in addr, and its length
  *
  */
-struct llflow_t * find_flow(char *ip_src, char *ip_dst, u_int32_t spi) {
+const void * address_bytes(const address_t *addr, int *len) {
 
-  struct llflow_t *f = NULL;
-  char src_txt[INET_ADDRSTRLEN];
-  char dst_txt[INET_ADDRSTRLEN];
+  if (addr->sa.sa_family == AF_INET6) {
+    *len = sizeof(struct in6_addr);
+    return &(addr->sa_in6.sin6_addr);
+  }
 
-  debug_print("find_flow() need:: ip_src:%s ip_dst:%s spi:%02x\n", ip_src, ip_dst, spi);
+  *len = sizeof(struct in_addr);
+  return &(addr->sa_in.sin_addr);
+}
 
-  f = flow_head;
+/*
+ * Hash an ESP flow key: raw source and destination addresses, and SPI (host byte order)
+ *
+ */
+u_int32_t flow_hash(int family, const void *ip_src, const void *ip_dst, u_int32_t spi) {
 
-  while(f != NULL) {
+  int i, len;
+  const u_char *src = ip_src;
+  const u_char *dst = ip_dst;
+  u_int32_t h = 2166136261U; // FNV-1a offset basis
 
-    if (inet_ntop(AF_INET, &(f->addr_src),
-                  src_txt, INET_ADDRSTRLEN) == NULL)
-      error("Cannot convert source IP adddress - inet_ntop() err");
+  len = (family == AF_INET6) ? sizeof(struct in6_addr) : sizeof(struct in_addr);
 
-    if (inet_ntop(AF_INET, &(f->addr_dst),
-                  dst_txt, INET_ADDRSTRLEN) == NULL)
-      error("inet_ntop() err");
+  for(i=0;i<len;i++)
+    h = (h ^ src[i]) * 16777619U;
+  for(i=0;i<len;i++)
+    h = (h ^ dst[i]) * 16777619U;
 
-    if (strcmp(ip_src, src_txt) == 0) {
-      if (strcmp(ip_dst, dst_txt) == 0) {
-        if (f->spi == ntohl(spi)) {
-          debug_print("find_flow() found match:: src:%s dst:%s spi:%x\n", src_txt, dst_txt, ntohl(f->spi));
-          return f;
-        }
-      }
-    }
-    f = f->next;
-  }
-  return NULL;
+  // SPIs are often sequential, mix them well
+  h ^= spi * 2654435761U;
+  h ^= h >> 16;
+  return h;
 }
 
 /*
- * Print known ESP flows, read from the ESP confguration file
+ * (Re)allocate the ESP flows hash table with size slots, and index again all known flows
  *
  */
-void dump_flows() {
+void flow_table_resize(u_int32_t size) {
 
-  char src[INET_ADDRSTRLEN];
-  char dst[INET_ADDRSTRLEN];
-  struct llflow_t *e = NULL;
-
-  e = flow_head;
-
-  while(e != NULL) {
-    if (inet_ntop(AF_INET, &(e->addr_src), src, INET_ADDRSTRLEN) == NULL
-      || inet_ntop(AF_INET, &(e->addr_dst), dst, INET_ADDRSTRLEN) == NULL) {
-      free(e);
-      error("Cannot convert ip");
-    }
+  u_int32_t i, j, mask;
+  flow_slot_t *old_slots = flow_table.slots;
+  u_int32_t old_size = flow_table.size;
 
-    printf("dump_flows: src:%s dst:%s crypt:%s auth:%s spi:%lx\n",
-      src, dst, e->crypt_name, e->auth_name, (long unsigned int) e->spi);
+  MALLOC(flow_table.slots, size, flow_slot_t);
+  memset(flow_table.slots, 0, size * sizeof(flow_slot_t));
+  flow_table.size = size;
+  mask = size - 1;
 
-      dumpmem("key", e->key, EVP_CIPHER_CTX_key_length(&e->ctx), 0);
-      printf("\n");
+  for(i=0;i<old_size;i++) {
+    if (old_slots[i].flow == NULL)
+      continue;
 
-    e = e->next;
+    j = old_slots[i].hash & mask;
+    while (flow_table.slots[j].flow != NULL)
+      j = (j + 1) & mask;
+    flow_table.slots[j] = old_slots[i];
   }
+
+  free(old_slots);
 }
 
 /*
- * Remove IEEE 802.1Q header (virtual lan)
+ * Grow the ESP flows hash table once for count flows, instead of doubling it while they are inserted
  *
  */
-void remove_ieee8021q_header(const u_char *in_payload, const int in_payload_len, pcap_hdr *out_pkthdr, u_char *out_payload) {
+void flow_table_reserve(u_int32_t count) {
 
-  u_char *payload_dst = NULL;
-  u_char *payload_src = NULL;
-
-  // Pointer used to shift through source packet bytes
-  payload_src = (u_char *) in_payload;
-  payload_dst = out_payload;
-
-  // Copy ethernet src and dst
-  memcpy(payload_dst, payload_src, 2*sizeof(struct ether_addr));
-  payload_src += 2*sizeof(struct ether_addr);
-  payload_dst += 2*sizeof(struct ether_addr);
-
-  // Skip ieee 802.1q bytes
-  payload_src += VLAN_TAG_LEN;
-  memcpy(payload_dst, payload_src, in_payload_len
-                                  - 2*sizeof(struct ether_addr)
-                                  - VLAN_TAG_LEN);
-
-  // Should I check for minimum frame size, even if most drivers don't supply FCS (4 bytes) ?
-  out_pkthdr->len = in_payload_len - VLAN_TAG_LEN;
-  out_pkthdr->caplen = in_payload_len - VLAN_TAG_LEN;
+  u_int32_t size = flow_table.size == 0 ? FLOW_TABLE_MIN_SIZE : flow_table.size;
+
+  while (count * 2 > size)
+    size *= 2;
+
+  if (size != flow_table.size)
+    flow_table_resize(size);
+}
+
+/*
+ * Index an ESP flow in the hash table. If the same (src, dst, spi) is already known,
+ * the first one read from the configuration file is kept, like with the former linear search.
+ *
+ */
+void flow_table_insert(llflow_t *flow) {
+
+  u_int32_t h, i, mask;
+  int len, flen;
+  const void *src, *dst;
+  llflow_t *f;
+
+  // Keep load factor under 1/2 to have short probe sequences
+  if ((flow_table.count + 1) * 2 > flow_table.size)
+    flow_table_resize(flow_table.size == 0 ? FLOW_TABLE_MIN_SIZE : flow_table.size * 2);
+
+  src = address_bytes(&flow->addr_src, &len);
+  dst = address_bytes(&flow->addr_dst, &len);
+  h = flow_hash(flow->addr_src.sa.sa_family, src, dst, flow->spi);
+  mask = flow_table.size - 1;
+
+  for (i = h & mask; (f = flow_table.slots[i].flow) != NULL; i = (i + 1) & mask) {
+    if (flow_table.slots[i].hash == h
+      && f->spi == flow->spi
+      && f->addr_src.sa.sa_family == flow->addr_src.sa.sa_family
+      && memcmp(address_bytes(&f->addr_src, &flen), src, len) == 0
+      && memcmp(address_bytes(&f->addr_dst, &flen), dst, len) == 0) {
+      debug_print("flow_table_insert() duplicate flow spi:%x, ignored\n", flow->spi);
+      return;
+    }
+  }
+
+  flow_table.slots[i].hash = h;
+  flow_table.slots[i].flow = flow;
+  flow_table.count++;
+}
+
+/*
+ * Try to find an ESP configuration to decrypt the flow between ip_src and ip_dst
+ * ip_src and ip_dst are raw addresses (struct in_addr or struct in6_addr), spi is in host byte order
+ *
+ */
+struct llflow_t * find_flow(int family, const void *ip_src, const void *ip_dst, u_int32_t spi) {
+
+  u_int32_t h, i, mask;
+  int len, flen;
+  struct llflow_t *f = NULL;
+
+  if (flow_table.count == 0)
+    return NULL;
+
+  len = (family == AF_INET6) ? sizeof(struct in6_addr) : sizeof(struct in_addr);
+  h = flow_hash(family, ip_src, ip_dst, spi);
+  mask = flow_table.size - 1;
+
+  for (i = h & mask; (f = flow_table.slots[i].flow) != NULL; i = (i + 1) & mask) {
+    if (flow_table.slots[i].hash == h
+      && f->spi == spi
+      && f->addr_src.sa.sa_family == family
+      && memcmp(address_bytes(&f->addr_src, &flen), ip_src, len) == 0
+      && memcmp(address_bytes(&f->addr_dst, &flen), ip_dst, len) == 0) {
+      debug_print("find_flow() found match:: spi:%x\n", spi);
+      return f;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Print known ESP flows, read from the ESP confguration file
+ *
+ */
+void dump_flows() {
+
+  char src[INET6_ADDRSTRLEN];
+  char dst[INET6_ADDRSTRLEN];
+  struct llflow_t *e = NULL;
+  int len;
+
+  e = flow_head;
+
+  while(e != NULL) {
+    if (inet_ntop(e->addr_src.sa.sa_family, address_bytes(&e->addr_src, &len), src, INET6_ADDRSTRLEN) == NULL
+      || inet_ntop(e->addr_dst.sa.sa_family, address_bytes(&e->addr_dst, &len), dst, INET6_ADDRSTRLEN) == NULL) {
+      error("Cannot convert ip");
+    }
+
+    printf("dump_flows: src:%s dst:%s crypt:%s auth:%s spi:%lx\n",
+      src, dst, e->crypt_name, e->auth_name, (long unsigned int) e->spi);
+
+      dumpmem("key", e->key, e->ctx != NULL ? EVP_CIPHER_CTX_key_length(e->ctx) : 0, 0);
+      printf("\n");
+
+    e = e->next;
+  }
+}
+
+/*
+ * Length of the IEEE 802.1Q and 802.1ad (QinQ) tags following the ethernet addresses of a
+ * packet, any number of them. Nothing is copied: the packet is processed from this offset,
+ * where the type field of the last tag is the ethertype of the untagged packet.
+ *
+ */
+int ieee8021q_headers_len(const u_char *packet, int packet_len) {
+
+  u_int16_t ethertype;
+  int len = 0;
+
+  while (len + (int) sizeof(struct ether_header) + VLAN_TAG_LEN <= packet_len) {
+    memcpy(&ethertype, packet + 2*sizeof(struct ether_addr) + len, sizeof(ethertype));
+    ethertype = ntohs(ethertype);
+
+    if (ethertype != ETHERTYPE_VLAN && ethertype != ETHERTYPE_8021AD && ethertype != ETHERTYPE_QINQ)
+      break;
+
+    len += VLAN_TAG_LEN;
+  }
+
+  return len;
+}
+
+/*
+ * Parse the outer IP header of an ethernet packet of packet_len bytes: IPv4, or IPv6 whose
+ * extension headers are skipped to find the upper layer protocol. A fragment, other than
+ * the first one of an unfragmented packet, cannot be decapsulated.
+ * Returns false if the packet is not IP, or its headers are truncated.
+ *
+ */
+bool ip_outer_parse(const u_char *packet, int packet_len, ip_outer_t *outer) {
+
+  const struct ether_header *eth_hdr = (const struct ether_header *) packet;
+  const u_char *ip = packet + sizeof(struct ether_header);
+  const struct ip *ip_hdr = NULL;
+  const struct ip6_hdr *ip6_hdr = NULL;
+  const struct ip6_frag *frag = NULL;
+  int len = packet_len - sizeof(struct ether_header);
+  int i, next;
+
+  if (ntohs(eth_hdr->ether_type) == ETHERTYPE_IP) {
+
+    ip_hdr = (const struct ip *) ip;
+    if (len < (int) sizeof(struct ip) || ip_hdr->ip_hl * 4 < (int) sizeof(struct ip))
+      return false;
+
+    outer->family = AF_INET;
+    outer->src = &ip_hdr->ip_src;
+    outer->dst = &ip_hdr->ip_dst;
+    outer->hdr_len = ip_hdr->ip_hl * 4;
+    outer->len = ntohs(ip_hdr->ip_len);
+    outer->protocol = ip_hdr->ip_p;
+    return true;
+  }
+
+  if (ntohs(eth_hdr->ether_type) != ETHERTYPE_IPV6 || len < (int) sizeof(struct ip6_hdr))
+    return false;
+
+  ip6_hdr = (const struct ip6_hdr *) ip;
+  outer->family = AF_INET6;
+  outer->src = &ip6_hdr->ip6_src;
+  outer->dst = &ip6_hdr->ip6_dst;
+  outer->hdr_len = sizeof(struct ip6_hdr);
+  outer->len = sizeof(struct ip6_hdr) + ntohs(ip6_hdr->ip6_plen);
+  next = ip6_hdr->ip6_nxt;
+
+  // Most packets have no extension header: the loop ends at once
+  for (i = 0; i < IP6_MAX_EXTENSIONS; i++) {
+
+    if (next != IPPROTO_HOPOPTS && next != IPPROTO_ROUTING && next != IPPROTO_DSTOPTS
+      && next != IPPROTO_FRAGMENT && next != IPPROTO_AH) {
+      outer->protocol = next;
+      return true;
+    }
+
+    // Next header and length fields of the extension header
+    if (outer->hdr_len + 2 > len)
+      return false;
+
+    if (next == IPPROTO_FRAGMENT) {
+      if (outer->hdr_len + (int) sizeof(struct ip6_frag) > len)
+        return false;
+      frag = (const struct ip6_frag *) (ip + outer->hdr_len);
+      if ((frag->ip6f_offlg & (IP6F_OFF_MASK | IP6F_MORE_FRAG)) != 0) {
+        outer->protocol = IPPROTO_NONE;
+        return true;
+      }
+      next = frag->ip6f_nxt;
+      outer->hdr_len += sizeof(struct ip6_frag);
+    } else if (next == IPPROTO_AH) {
+      next = ip[outer->hdr_len];
+      outer->hdr_len += (ip[outer->hdr_len + 1] + 2) * 4;
+    } else {
+      next = ip[outer->hdr_len];
+      outer->hdr_len += (ip[outer->hdr_len + 1] + 1) * 8;
+    }
+
+    if (outer->hdr_len > len)
+      return false;
+  }
+
+  outer->protocol = IPPROTO_NONE;
+  return true;
+}
+
+/*
+ * Set the ethernet type of a decapsulated packet from the protocol of the IP packet it carries
+ *
+ */
+void set_ethertype(u_char *packet, int protocol) {
+
+  u_int16_t ethertype;
+
+  if (protocol == IPPROTO_IPIP)
+    ethertype = htons(ETHERTYPE_IP);
+  else if (protocol == IPPROTO_IPV6)
+    ethertype = htons(ETHERTYPE_IPV6);
+  else
+    return;
+
+  memcpy(packet + 2*sizeof(struct ether_addr), &ethertype, member_size(struct ether_header, ether_type));
 }
 
 /*
@@ -585,12 +1493,41 @@ void remove_ieee8021q_header(const u_char *in_payload, const int in_payload_len,
  */
 void process_nonip_packet(const u_char *payload, const int payload_len, pcap_hdr *new_packet_hdr, u_char *new_packet_payload) {
 
-  // Copy full packet
-  memcpy(new_packet_payload, payload, payload_len);
+  // Copy full packet, but the ethernet addresses already written by decap_packet()
+  if (payload_len > (int) (2*sizeof(struct ether_addr)))
+    memcpy(new_packet_payload + 2*sizeof(struct ether_addr), payload + 2*sizeof(struct ether_addr),
+           payload_len - 2*sizeof(struct ether_addr));
   new_packet_hdr->len = payload_len;
 }
 
-/* Decapsulate an IPIP packet
+/*
+ * Length of the inner packet of len bytes at data that was captured in the source packet
+ * of payload_len bytes: its headers may announce more bytes than there are.
+ *
+ */
+static int decap_captured_len(const u_char *payload, int payload_len, const u_char *data, int len) {
+
+  int captured = payload_len - (data - payload);
+
+  if (len > captured)
+    len = captured;
+
+  return len < 0 ? 0 : len;
+}
+
+/*
+ * Leave the inner packet of len bytes at data in the source packet of payload_len bytes,
+ * instead of copying it after the ethernet header: it is written from there. The slice
+ * is cut to the captured bytes.
+ *
+ */
+static void decap_slice_set(const u_char *payload, int payload_len, const u_char *data, int len) {
+
+  decap_slice->data = data;
+  decap_slice->len = decap_captured_len(payload, payload_len, data, len);
+}
+
+/* Decapsulate an IPIP packet, over IPv4 or IPv6 (4in6)
  *
  */
 void process_ipip_packet(const u_char *payload, const int payload_len, pcap_hdr *new_packet_hdr, u_char *new_packet_payload) {
@@ -599,36 +1536,43 @@ void process_ipip_packet(const u_char *payload, const int payload_len, pcap_hdr
   const u_char *payload_src = NULL;
   u_char *payload_dst = NULL;
   const struct ip *ip_hdr = NULL;
+  ip_outer_t outer;
+
+  if (!ip_outer_parse(payload, payload_len, &outer)
+    || outer.hdr_len + (int) sizeof(struct ip) > payload_len - (int) sizeof(struct ether_header)) {
+    process_nonip_packet(payload, payload_len, new_packet_hdr, new_packet_payload);
+    return;
+  }
 
   payload_src = payload;
   payload_dst = new_packet_payload;
 
-  // Copy ethernet header
-  memcpy(payload_dst, payload_src, sizeof(struct ether_header));
+  // Ethernet addresses are already written by decap_packet()
+  set_ethertype(payload_dst, IPPROTO_IPIP);
   payload_src += sizeof(struct ether_header);
   payload_dst += sizeof(struct ether_header);
   packet_size = sizeof(struct ether_header);
 
-  // Read encapsulating IP header to find offset to encapsulted IP packet
-  ip_hdr = (const struct ip *) payload_src;
-
   debug_print("\tIPIP: outer IP - hlen:%i iplen:%02i protocol:%02x\n",
-      (ip_hdr->ip_hl *4), ntohs(ip_hdr->ip_len), ip_hdr->ip_p);
+      outer.hdr_len, outer.len, outer.protocol);
 
   // Shift to encapsulated IP header, read total length
-  payload_src += ip_hdr->ip_hl *4;
+  payload_src += outer.hdr_len;
   ip_hdr = (const struct ip *) payload_src;
 
   debug_print("\tIPIP: inner IP - hlen:%i iplen:%02i protocol:%02x\n",
       (ip_hdr->ip_hl *4), ntohs(ip_hdr->ip_len), ip_hdr->ip_p);
 
-  memcpy(payload_dst, payload_src, ntohs(ip_hdr->ip_len));
+  if (decap_slice != NULL)
+    decap_slice_set(payload, payload_len, payload_src, ntohs(ip_hdr->ip_len));
+  else
+    memcpy(payload_dst, payload_src, decap_captured_len(payload, payload_len, payload_src, ntohs(ip_hdr->ip_len)));
   packet_size += ntohs(ip_hdr->ip_len);
 
   new_packet_hdr->len = packet_size;
 }
 
-/* Decapsulate an IPv6 packet
+/* Decapsulate an IPv6 packet, over IPv4 (6in4) or IPv6 (6in6)
  *
  */
 void process_ipv6_packet(const u_char *payload, const int payload_len, pcap_hdr *new_packet_hdr, u_char *new_packet_payload) {
@@ -636,40 +1580,41 @@ void process_ipv6_packet(const u_char *payload, const int payload_len, pcap_hdr
   int packet_size = 0;
   const u_char *payload_src = NULL;
   u_char *payload_dst = NULL;
-  const struct ip *ip_hdr = NULL;
-  uint16_t ethertype;
+  ip_outer_t outer;
+
+  if (!ip_outer_parse(payload, payload_len, &outer)
+    || outer.hdr_len > payload_len - (int) sizeof(struct ether_header)) {
+    process_nonip_packet(payload, payload_len, new_packet_hdr, new_packet_payload);
+    return;
+  }
 
   payload_src = payload;
   payload_dst = new_packet_payload;
 
-  // Copy src and dst ether addr
-  memcpy(payload_dst, payload_src, 2*sizeof(struct ether_addr));
-  payload_src += 2*sizeof(struct ether_addr);
-  payload_dst += 2*sizeof(struct ether_addr);
-
-  // Set ethernet type to IPv6
-  ethertype = htons(ETHERTYPE_IPV6);
-  memcpy(payload_dst, &ethertype, member_size(struct ether_header, ether_type));
-  payload_src += member_size(struct ether_header, ether_type);
-  payload_dst += member_size(struct ether_header, ether_type);
-
-  // Read encapsulating IPv4 header to find header lenght and offset to encapsulated IPv6 packet
-  ip_hdr = (const struct ip *) payload_src;
+  // Ethernet addresses are already written by decap_packet(), set ethernet type to IPv6
+  set_ethertype(payload_dst, IPPROTO_IPV6);
+  payload_src += sizeof(struct ether_header);
+  payload_dst += sizeof(struct ether_header);
 
-  packet_size = payload_len - (ip_hdr->ip_hl *4);
+  // Encapsulating header length gives the offset to encapsulated IPv6 packet
+  packet_size = payload_len - outer.hdr_len;
 
   debug_print("\tIPv6: outer IP - hlen:%i iplen:%02i protocol:%02x\n",
-      (ip_hdr->ip_hl *4), ntohs(ip_hdr->ip_len), ip_hdr->ip_p);
+      outer.hdr_len, outer.len, outer.protocol);
 
-  // Shift to encapsulated IPv6 packet, then copy
-  payload_src += ip_hdr->ip_hl *4;
+  // Shift to encapsulated IPv6 packet, then copy (ethernet header is already written)
+  payload_src += outer.hdr_len;
 
-  memcpy(payload_dst, payload_src, packet_size);
+  if (decap_slice != NULL)
+    decap_slice_set(payload, payload_len, payload_src, packet_size - sizeof(struct ether_header));
+  else
+    memcpy(payload_dst, payload_src,
+           decap_captured_len(payload, payload_len, payload_src, packet_size - sizeof(struct ether_header)));
   new_packet_hdr->len = packet_size;
 }
 
 /*
- * Decapsulate a GRE packet
+ * Decapsulate a GRE packet, over IPv4 or IPv6
  *
  */
 void process_gre_packet(const u_char *payload, const int payload_len, pcap_hdr *new_packet_hdr, u_char *new_packet_payload) {
@@ -679,31 +1624,43 @@ void process_gre_packet(const u_char *payload, const int payload_len, pcap_hdr *
   u_int16_t flags;
   const u_char *payload_src = NULL;
   u_char *payload_dst = NULL;
-  const struct ip *ip_hdr = NULL;
   const struct grehdr *gre_hdr = NULL;
+  ip_outer_t outer;
+
+  if (!ip_outer_parse(payload, payload_len, &outer)
+    || outer.hdr_len + (int) sizeof(struct grehdr) > payload_len - (int) sizeof(struct ether_header)) {
+    process_nonip_packet(payload, payload_len, new_packet_hdr, new_packet_payload);
+    return;
+  }
 
   payload_src = payload;
   payload_dst = new_packet_payload;
 
-  // Copy ethernet header
-  memcpy(payload_dst, payload_src, sizeof(struct ether_header));
+  // Ethernet addresses are already written by decap_packet(), copy ethernet type
+  memcpy(payload_dst + 2*sizeof(struct ether_addr), payload_src + 2*sizeof(struct ether_addr),
+         member_size(struct ether_header, ether_type));
   payload_src += sizeof(struct ether_header);
   payload_dst += sizeof(struct ether_header);
   packet_size = sizeof(struct ether_header);
 
-  // Read encapsulating IP header to find offset to GRE header
-  ip_hdr = (const struct ip *) payload_src;
-  payload_src += (ip_hdr->ip_hl *4);
+  // Encapsulating IP header length gives the offset to GRE header
+  payload_src += outer.hdr_len;
 
   debug_print("\tGRE: outer IP - hlen:%i iplen:%02i protocol:%02x\n",
-    (ip_hdr->ip_hl *4), ntohs(ip_hdr->ip_len), ip_hdr->ip_p);
+    outer.hdr_len, outer.len, outer.protocol);
 
-  packet_size += ntohs(ip_hdr->ip_len) - ip_hdr->ip_hl*4;
+  packet_size += outer.len - outer.hdr_len;
 
   // Read GRE header to find offset to encapsulated IP packet
   gre_hdr = (const struct grehdr *) payload_src;
   debug_print("\tGRE - GRE header: flags:%u protocol:%u\n", gre_hdr->flags, gre_hdr->next_protocol);
 
+  // GRE protocol type is an ethernet type
+  if (ntohs(gre_hdr->next_protocol) == ETHERTYPE_IP)
+    set_ethertype(new_packet_payload, IPPROTO_IPIP);
+  else if (ntohs(gre_hdr->next_protocol) == ETHERTYPE_IPV6)
+    set_ethertype(new_packet_payload, IPPROTO_IPV6);
+
   packet_size -= sizeof(struct grehdr);
   payload_src += sizeof(struct grehdr);
   flags = ntohs(gre_hdr->flags);
@@ -723,11 +1680,195 @@ void process_gre_packet(const u_char *payload, const int payload_len, pcap_hdr *
     packet_size -= 4;
   }
 
-  memcpy(payload_dst, payload_src, packet_size);
+  // Ethernet header is already written
+  if (decap_slice != NULL)
+    decap_slice_set(payload, payload_len, payload_src, packet_size - sizeof(struct ether_header));
+  else
+    memcpy(payload_dst, payload_src,
+           decap_captured_len(payload, payload_len, payload_src, packet_size - sizeof(struct ether_header)));
   new_packet_hdr->len = packet_size;
 
 }
 
+/*
+ * Count a packet of the flow copied raw: it cannot be decrypted, or its ICV is wrong
+ *
+ */
+static void flow_failed(struct llflow_t *flow) {
+
+  if (stats.sa != NULL)
+    stats.sa[flow->index].failed++;
+}
+
+/*
+ * Remove the trailer of a CBC decrypted ESP packet of packet_size bytes: padding, pad length
+ * and next header fields. The raw packet is copied if the pad length cannot be right.
+ *
+ */
+void esp_remove_trailer(struct llflow_t *flow, const u_char *payload, const int payload_len, pcap_hdr *new_packet_hdr,
+                        u_char *new_packet_payload, int packet_size, int block_size) {
+
+  u_char *pad_len = (new_packet_payload + packet_size -2);
+
+  // Detect obviously badly decrypted packet
+  if (*pad_len >= block_size) {
+    stats.esp_bad_pad++;
+    flow_failed(flow);
+    verbose("Warning: invalid pad_len field, wrong encryption key ? copying raw packet...\n");
+    process_nonip_packet(payload, payload_len, new_packet_hdr, new_packet_payload);
+    return;
+  }
+
+  // Inner packet may be IPv4 or IPv6, whatever the outer header
+  set_ethertype(new_packet_payload, new_packet_payload[packet_size - 1]);
+
+  // Remove next protocol, pad len fields and padding
+  packet_size = packet_size
+    - member_size(esp_packet_t, pad_len)
+    - member_size(esp_packet_t, next_header)
+    - *pad_len;
+
+  new_packet_hdr->len = packet_size;
+}
+
+/*
+ * HMAC of len bytes of data with the precomputed states of the flow, compared to the ICV following data.
+ * Counts the result.
+ *
+ */
+bool esp_check_icv(struct llflow_t *flow, const u_char *data, int len) {
+
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_len;
+  profile_mark_t mark = { 0, 0 };
+
+  PROFILE_BEGIN(mark);
+
+  if (icv_ctx == NULL && (icv_ctx = EVP_MD_CTX_new()) == NULL)
+    error("Cannot allocate digest context - EVP_MD_CTX_new() err\n");
+
+  if (EVP_MD_CTX_copy_ex(icv_ctx, flow->hmac_inner) != 1
+    || EVP_DigestUpdate(icv_ctx, data, len) != 1
+    || EVP_DigestFinal_ex(icv_ctx, digest, &digest_len) != 1
+    || EVP_MD_CTX_copy_ex(icv_ctx, flow->hmac_outer) != 1
+    || EVP_DigestUpdate(icv_ctx, digest, digest_len) != 1
+    || EVP_DigestFinal_ex(icv_ctx, digest, &digest_len) != 1)
+    error("Cannot compute HMAC %s\n", flow->auth_method->openssl_auth);
+
+  PROFILE_END(mark, PROFILE_ESP_ICV);
+
+  if (CRYPTO_memcmp(digest, data + len, flow->auth_method->len) != 0) {
+    icv_stats.failed++;
+    flow_failed(flow);
+    return false;
+  }
+
+  icv_stats.verified++;
+  return true;
+}
+
+/*
+ * Verify the HMAC ICV of an ESP packet of esp_len bytes, before it is decrypted. Decapsulation
+ * threads queue it, to check all ICVs of their batch in esp_batch_flush().
+ * Returns false if the ICV is wrong: the raw packet was copied.
+ *
+ */
+bool esp_verify_hmac(struct llflow_t *flow, const u_char *payload, const int payload_len, const u_char *esp_hdr,
+                     int esp_len, pcap_hdr *new_packet_hdr, u_char *new_packet_payload) {
+
+  icv_job_t *job = NULL;
+  int len = esp_len - flow->auth_method->len;
+
+  if (flow->hmac_inner == NULL || len <= (int) (member_size(esp_packet_t, spi) + member_size(esp_packet_t, seq))
+    || (esp_hdr - payload) + esp_len > payload_len) {
+    icv_stats.unchecked++;
+    return true;
+  }
+
+  // nested_payload is reused by the next packet
+  if (icv_jobs != NULL && payload != nested_payload) {
+    // The AES-CBC job of this packet is queued next: a full queue is flushed now, else its
+    // failed ICV would be checked, and the raw packet copied, before it is decrypted over it
+    if (icv_job_count == ICV_BATCH_JOBS || esp_deferred_count == CBC_BATCH_JOBS)
+      esp_batch_flush();
+
+    esp_queued++;
+    job = &icv_jobs[icv_job_count++];
+    job->flow = flow;
+    job->data = esp_hdr;
+    job->len = len;
+    job->payload = payload;
+    job->payload_len = payload_len;
+    job->new_packet_hdr = new_packet_hdr;
+    job->new_packet_payload = new_packet_payload;
+    return true;
+  }
+
+  if (esp_check_icv(flow, esp_hdr, len))
+    return true;
+
+  verbose("Warning: ICV verification failed, copying raw packet...\n");
+  process_nonip_packet(payload, payload_len, new_packet_hdr, new_packet_payload);
+  return false;
+}
+
+/*
+ * Decrypt the queued AES-CBC packets of the calling thread with the multi-buffer engine and
+ * finish them, then check the queued ICVs. Called when a queue is full, and by the pipeline
+ * once a batch is decapsulated.
+ *
+ */
+void esp_batch_flush() {
+
+  esp_deferred_t *d = NULL;
+  icv_job_t *job = NULL;
+  profile_mark_t mark = { 0, 0 };
+  int i;
+
+  if (esp_deferred_count > 0) {
+    // A single measure for the whole batch, its packets are decrypted together
+    for (i=0;i<esp_deferred_count;i++)
+      PROBE_DECRYPT_START(esp_deferred[i].num, esp_deferred[i].flow->spi, esp_jobs[i].blocks * CBC_BLOCK_SIZE);
+
+    PROFILE_BEGIN(mark);
+    cbc_batch_decrypt(esp_jobs, esp_deferred_count);
+    PROFILE_END(mark, PROFILE_ESP_DECRYPT);
+
+    for (i=0;i<esp_deferred_count;i++) {
+      d = &esp_deferred[i];
+      PROBE_DECRYPT_DONE(d->num, d->flow->spi, esp_jobs[i].blocks * CBC_BLOCK_SIZE, 1);
+      esp_remove_trailer(d->flow, d->payload, d->payload_len, d->new_packet_hdr, d->new_packet_payload,
+                         d->packet_size, CBC_BLOCK_SIZE);
+    }
+
+    esp_deferred_count = 0;
+  }
+
+  // Packets failing verification replace their decrypted version
+  for (i=0;i<icv_job_count;i++) {
+    job = &icv_jobs[i];
+    if (!esp_check_icv(job->flow, job->data, job->len)) {
+      verbose("Warning: ICV verification failed, copying raw packet...\n");
+      process_nonip_packet(job->payload, job->payload_len, job->new_packet_hdr, job->new_packet_payload);
+    }
+  }
+
+  icv_job_count = 0;
+
+  // Queued packets are now complete, their inner encapsulations can be removed
+  for (i=0;i<esp_pending_count;i++) {
+    stats.proto[STATS_ESP].bytes_out += esp_pending[i].hdr->len;
+
+    if (global_args.max_depth > 1) {
+      PROFILE_BEGIN(mark);
+      decap_nested(esp_pending[i].hdr, esp_pending[i].payload, esp_pending[i].len, esp_pending[i].num);
+      PROFILE_END(mark, PROFILE_DECAP);
+    }
+  }
+
+  esp_pending_count = 0;
+}
+
 /*
  * Decapsulate an ESP packet:
  * -try to find an ESP configuration entry (ip, spi, algorithms)
@@ -738,29 +1879,39 @@ void process_esp_packet(u_char const *payload, const int payload_len, pcap_hdr *
 
   const u_char *payload_src = NULL;
   u_char *payload_dst = NULL;
-  const struct ip *ip_hdr = NULL;
+  const u_char *esp_hdr = NULL;
+  ip_outer_t outer;
   esp_packet_t esp_packet;
-  char ip_src[INET_ADDRSTRLEN+1];
-  char ip_dst[INET_ADDRSTRLEN+1];
+  u_char nonce[ESP_AEAD_NONCE_LEN];
+  char ip_src[INET6_ADDRSTRLEN+1];
+  char ip_dst[INET6_ADDRSTRLEN+1];
   llflow_t *flow = NULL;
-  EVP_CIPHER_CTX ctx;
-  const EVP_CIPHER *cipher = NULL;
+  EVP_CIPHER_CTX *ctx = NULL;
   int packet_size, rc, len, remaining;
-  int ivlen;
+  int ivlen, block_size, partial;
+  profile_mark_t mark = { 0, 0 };
+
+  if (!ip_outer_parse(payload, payload_len, &outer)
+    || outer.hdr_len + ESP_SPI_LEN > payload_len - (int) sizeof(struct ether_header)) {
+    process_nonip_packet(payload, payload_len, new_packet_hdr, new_packet_payload);
+    return;
+  }
 
   // TODO: memset sur new_packet_payload
   payload_src = payload;
   payload_dst = new_packet_payload;
 
-  // Copy ethernet header
-  memcpy(payload_dst, payload_src, sizeof(struct ether_header));
+  // Ethernet addresses are already written by decap_packet(), copy ethernet type,
+  // replaced from the next header field once decrypted
+  memcpy(payload_dst + 2*sizeof(struct ether_addr), payload_src + 2*sizeof(struct ether_addr),
+         member_size(struct ether_header, ether_type));
   payload_src += sizeof(struct ether_header);
   payload_dst += sizeof(struct ether_header);
   packet_size = sizeof(struct ether_header);
 
   // Read encapsulating IP header to find offset to ESP header
-  ip_hdr = (const struct ip *) payload_src;
-  payload_src += (ip_hdr->ip_hl *4);
+  payload_src += outer.hdr_len;
+  esp_hdr = payload_src;
 
   // Read ESP fields
   memcpy(&esp_packet.spi, payload_src, member_size(esp_packet_t, spi));
@@ -768,43 +1919,55 @@ void process_esp_packet(u_char const *payload, const int payload_len, pcap_hdr *
   memcpy(&esp_packet.seq, payload_src, member_size(esp_packet_t, seq));
   payload_src += member_size(esp_packet_t, seq);
 
-  // Extract dst/src IP
-  if (inet_ntop(AF_INET, &(ip_hdr->ip_src),
-                ip_src, INET_ADDRSTRLEN) == NULL)
-    error("Cannot convert source ip address for ESP packet\n");
-
-  if (inet_ntop(AF_INET, &(ip_hdr->ip_dst),
-                ip_dst, INET_ADDRSTRLEN) == NULL)
-    error("Cannot convert destination ip address for ESP packet\n");
-
-  // Find encryption configuration used
-  flow = find_flow(ip_src, ip_dst, esp_packet.spi);
+  // Find encryption configuration used, directly from the binary addresses
+  PROFILE_BEGIN(mark);
+  flow = find_flow(outer.family, outer.src, outer.dst, ntohl(esp_packet.spi));
+  PROFILE_END(mark, PROFILE_ESP_LOOKUP);
+  PROBE_SA_LOOKUP(current_packet, ntohl(esp_packet.spi), flow != NULL);
 
   if (flow == NULL) {
-    verbose("No suitable flow configuration found for src:%s dst:%s spi: %lx copying raw packet\n",
-      ip_src, ip_dst, esp_packet.spi);
-      process_nonip_packet(payload, payload_len, new_packet_hdr, new_packet_payload);
-      return;
+    // Addresses are converted to text only when they are printed
+    if (global_args.verbose == true) {
+      if (inet_ntop(outer.family, outer.src, ip_src, INET6_ADDRSTRLEN) == NULL
+        || inet_ntop(outer.family, outer.dst, ip_dst, INET6_ADDRSTRLEN) == NULL)
+        error("Cannot convert ip address for ESP packet\n");
+
+      verbose("No suitable flow configuration found for src:%s dst:%s spi: %lx copying raw packet\n",
+        ip_src, ip_dst, (long unsigned) ntohl(esp_packet.spi));
+    }
+    stats.esp_no_sa++;
+    process_nonip_packet(payload, payload_len, new_packet_hdr, new_packet_payload);
+    return;
 
   } else {
-    debug_print("Found flow configuration src:%s dst:%s crypt:%s auth:%s spi: %lx\n",
-      ip_src, ip_dst, flow->crypt_name, flow->auth_name, (long unsigned) flow->spi);
+    debug_print("Found flow configuration crypt:%s auth:%s spi: %lx\n",
+      flow->crypt_name, flow->auth_name, (long unsigned) flow->spi);
+  }
+
+  if (stats.sa != NULL) {
+    stats.sa[flow->index].packets++;
+    stats.sa[flow->index].bytes += payload_len;
   }
 
+  // AEAD algorithms check their own ICV while decrypting
+  if (global_args.verify_icv && flow->crypt_method->icv_len == 0 && flow->auth_method->openssl_auth != NULL
+    && !esp_verify_hmac(flow, payload, payload_len, esp_hdr, outer.len - outer.hdr_len,
+                        new_packet_hdr, new_packet_payload))
+    return;
+
   // Differences between (null) encryption algorithms and others algorithms start here
   if (flow->crypt_method->openssl_cipher == NULL) {
 
-    remaining = ntohs(ip_hdr->ip_len)
-    - ip_hdr->ip_hl*4
+    remaining = outer.len
+    - outer.hdr_len
     - member_size(esp_packet_t, spi)
     - member_size(esp_packet_t, seq);
 
-    // If non null authentication, discard authentication data
-    if (flow->auth_method->openssl_auth == NULL) {
-      remaining -= flow->auth_method->len;
-    }
+    // Discard authentication data
+    remaining -= flow->auth_method->len;
 
     u_char *pad_len = ((u_char *)payload_src + remaining -2);
+    set_ethertype(new_packet_payload, pad_len[1]);
 
     remaining = remaining
       - member_size(esp_packet_t, pad_len)
@@ -816,62 +1979,80 @@ void process_esp_packet(u_char const *payload, const int payload_len, pcap_hdr *
     memcpy(payload_dst, payload_src, remaining);
     new_packet_hdr->len = packet_size;
 
-  } else {
-
-    if ((cipher = EVP_get_cipherbyname(flow->crypt_method->openssl_cipher)) == NULL)
-      error("Cannot find cipher %s - EVP_get_cipherbyname() err", flow->crypt_method->openssl_cipher);
+  } else if (flow->crypt_method->icv_len > 0) {
 
-    EVP_CIPHER_CTX_init(&ctx);
+    ctx = flow_cipher_ctx(flow);
 
-    // Copy initialization vector
-    ivlen = EVP_CIPHER_iv_length(cipher);
-    memset(&esp_packet.iv, 0, EVP_MAX_IV_LENGTH);
-    memcpy(&esp_packet.iv, payload_src, ivlen);
-    payload_src += ivlen;
+    // Nonce: salt from the key, then explicit IV of the packet
+    memcpy(nonce, flow->salt, flow->crypt_method->salt_len);
+    memcpy(nonce + flow->crypt_method->salt_len, payload_src, ESP_AEAD_IV_LEN);
+    payload_src += ESP_AEAD_IV_LEN;
 
-    rc = EVP_DecryptInit_ex(&ctx, cipher,NULL, flow->key, esp_packet.iv);
-    if (rc != 1) {
-      error("Error during the initialization of crypto system. Please report this bug with your .pcap file");
-    }
-
-    // ESP payload length to decrypt
-    remaining =  ntohs(ip_hdr->ip_len)
-    - ip_hdr->ip_hl*4
+    // ESP payload length to decrypt, the ICV follows it
+    remaining =  outer.len
+    - outer.hdr_len
     - member_size(esp_packet_t, spi)
     - member_size(esp_packet_t, seq)
-    - ivlen;
-
-    // If non null authentication, discard authentication data
-    if (flow->auth_method->openssl_auth == NULL) {
-      remaining -= flow->auth_method->len;
+    - ESP_AEAD_IV_LEN
+    - flow->crypt_method->icv_len;
+
+    if (remaining < (int) (member_size(esp_packet_t, pad_len) + member_size(esp_packet_t, next_header))
+      || (payload_src - payload) + remaining + flow->crypt_method->icv_len > payload_len) {
+      stats.esp_failed++;
+      flow_failed(flow);
+      verbose("Warning: truncated ESP packet, copying raw packet...\n");
+      process_nonip_packet(payload, payload_len, new_packet_hdr, new_packet_payload);
+      return;
     }
 
-    // Do the decryption work
-    rc = EVP_DecryptUpdate(&ctx, payload_dst, &len, payload_src, remaining);
-    packet_size += len;
-
-    if (rc != 1) {
+    // Key schedule was done by add_flow(), only set the nonce, then the
+    // additional authenticated data (SPI and sequence number)
+    PROBE_DECRYPT_START(current_packet, flow->spi, remaining);
+    PROFILE_BEGIN(mark);
+    if (EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, nonce) != 1
+      || EVP_DecryptUpdate(ctx, NULL, &len, esp_hdr, ESP_AEAD_AAD_LEN) != 1
+      || EVP_DecryptUpdate(ctx, payload_dst, &len, payload_src, remaining) != 1) {
+      PROFILE_END(mark, PROFILE_ESP_DECRYPT);
+      PROBE_DECRYPT_DONE(current_packet, flow->spi, 0, 0);
+      stats.esp_failed++;
+      flow_failed(flow);
       verbose("Warning: cannot decrypt packet with EVP_DecryptUpdate(). Corrupted ? Cipher is %s, copying raw packet...\n",
         flow->crypt_method->openssl_cipher);
       process_nonip_packet(payload, payload_len, new_packet_hdr, new_packet_payload);
-        return;
+      return;
     }
-
-    EVP_DecryptFinal_ex(&ctx, payload_dst+len, &len);
     packet_size += len;
 
-    // http://www.mail-archive.com/openssl-users@openssl.org/msg23434.html
-    packet_size +=EVP_CIPHER_CTX_block_size(&ctx);
+    if (global_args.verify_icv) {
+      if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, flow->crypt_method->icv_len,
+            (void *) (payload_src + remaining)) != 1
+        || EVP_DecryptFinal_ex(ctx, payload_dst + len, &len) != 1) {
+        PROFILE_END(mark, PROFILE_ESP_DECRYPT);
+        PROBE_DECRYPT_DONE(current_packet, flow->spi, len, 0);
+        icv_stats.failed++;
+        flow_failed(flow);
+        verbose("Warning: ICV verification failed, copying raw packet...\n");
+        process_nonip_packet(payload, payload_len, new_packet_hdr, new_packet_payload);
+        return;
+      }
+      icv_stats.verified++;
+    }
+    PROFILE_END(mark, PROFILE_ESP_DECRYPT);
+    PROBE_DECRYPT_DONE(current_packet, flow->spi, len, 1);
 
     u_char *pad_len = (new_packet_payload + packet_size -2);
 
     // Detect obviously badly decrypted packet
-    if (*pad_len >=  EVP_CIPHER_CTX_block_size(&ctx)) {
+    if ((int) (*pad_len + member_size(esp_packet_t, pad_len) + member_size(esp_packet_t, next_header)) > remaining) {
+      stats.esp_bad_pad++;
+      flow_failed(flow);
       verbose("Warning: invalid pad_len field, wrong encryption key ? copying raw packet...\n");
       process_nonip_packet(payload, payload_len, new_packet_hdr, new_packet_payload);
       return;
     }
 
+    set_ethertype(new_packet_payload, pad_len[1]);
+
     // Remove next protocol, pad len fields and padding
     packet_size = packet_size
       - member_size(esp_packet_t, pad_len)
@@ -880,7 +2061,97 @@ void process_esp_packet(u_char const *payload, const int payload_len, pcap_hdr *
 
     new_packet_hdr->len = packet_size;
 
-    EVP_CIPHER_CTX_cleanup(&ctx);
+  } else {
+
+    ctx = flow_cipher_ctx(flow);
+
+    ivlen = EVP_CIPHER_CTX_iv_length(ctx);
+    block_size = EVP_CIPHER_CTX_block_size(ctx);
+    payload_src += ivlen;
+
+    // ESP payload length to decrypt
+    remaining =  outer.len
+    - outer.hdr_len
+    - member_size(esp_packet_t, spi)
+    - member_size(esp_packet_t, seq)
+    - ivlen;
+
+    // Discard authentication data
+    remaining -= flow->auth_method->len;
+
+    if (remaining < 0 || (payload_src - payload) + remaining > payload_len) {
+      stats.esp_failed++;
+      flow_failed(flow);
+      verbose("Warning: truncated ESP packet, copying raw packet...\n");
+      process_nonip_packet(payload, payload_len, new_packet_hdr, new_packet_payload);
+      return;
+    }
+
+    // Copy initialization vector
+    memset(&esp_packet.iv, 0, EVP_MAX_IV_LENGTH);
+    memcpy(&esp_packet.iv, payload_src - ivlen, ivlen);
+
+    // A payload not ending on a block boundary is truncated: its last
+    // partial block cannot be decrypted, it is left zeroed.
+    partial = remaining % block_size;
+
+    // Decapsulation threads queue whole AES-CBC payloads for the multi-buffer engine, the
+    // packet is finished by esp_batch_flush(). nested_payload is reused by the next packet.
+    if (esp_jobs != NULL && flow->batch_key != NULL
+      && partial == 0 && remaining >= block_size
+      && remaining / block_size <= cbc_batch_max_blocks()
+      && payload != nested_payload) {
+
+      if (esp_deferred_count == CBC_BATCH_JOBS)
+        esp_batch_flush();
+
+      esp_queued++;
+      esp_jobs[esp_deferred_count].key = flow->batch_key;
+      esp_jobs[esp_deferred_count].iv = payload_src - ivlen;
+      esp_jobs[esp_deferred_count].in = payload_src;
+      esp_jobs[esp_deferred_count].out = payload_dst;
+      esp_jobs[esp_deferred_count].blocks = remaining / block_size;
+
+      esp_deferred[esp_deferred_count].flow = flow;
+      esp_deferred[esp_deferred_count].num = current_packet;
+      esp_deferred[esp_deferred_count].payload = payload;
+      esp_deferred[esp_deferred_count].payload_len = payload_len;
+      esp_deferred[esp_deferred_count].new_packet_hdr = new_packet_hdr;
+      esp_deferred[esp_deferred_count].new_packet_payload = new_packet_payload;
+      esp_deferred[esp_deferred_count].packet_size = packet_size + remaining;
+      esp_deferred_count++;
+      return;
+    }
+
+    // Key schedule was done by add_flow(), only reset the IV
+    PROBE_DECRYPT_START(current_packet, flow->spi, remaining - partial);
+    PROFILE_BEGIN(mark);
+    rc = EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, esp_packet.iv);
+    if (rc != 1) {
+      error("Error during the initialization of crypto system. Please report this bug with your .pcap file");
+    }
+
+    // Do the decryption work
+    rc = EVP_DecryptUpdate(ctx, payload_dst, &len, payload_src, remaining - partial);
+    packet_size += len;
+    PROFILE_END(mark, PROFILE_ESP_DECRYPT);
+    PROBE_DECRYPT_DONE(current_packet, flow->spi, len, rc == 1);
+
+    if (rc != 1) {
+      stats.esp_failed++;
+      flow_failed(flow);
+      verbose("Warning: cannot decrypt packet with EVP_DecryptUpdate(). Corrupted ? Cipher is %s, copying raw packet...\n",
+        flow->crypt_method->openssl_cipher);
+      process_nonip_packet(payload, payload_len, new_packet_hdr, new_packet_payload);
+        return;
+    }
+
+    if (partial != 0) {
+      memset(payload_dst + len, 0, block_size);
+      packet_size += block_size;
+    }
+
+    esp_remove_trailer(flow, payload, payload_len, new_packet_hdr, new_packet_payload, packet_size, block_size);
 
     } /*  flow->crypt_method->openssl_cipher == NULL */
 
@@ -888,134 +2159,435 @@ void process_esp_packet(u_char const *payload, const int payload_len, pcap_hdr *
 
 
 /*
- * For each packet, identify its encapsulation protocol and give it to the corresponding process_xx_packet function
+ * Encapsulation of a decapsulated packet, STATS_NONE if it has no further layer to remove
  *
  */
-void handle_packets(u_char *bpf_filter, const struct pcap_pkthdr *pkthdr, const u_char *bytes) {
+static stats_proto_t nested_encapsulation(const u_char *payload, int len, ip_outer_t *outer) {
+
+  const u_char *ip = payload + sizeof(struct ether_header);
+
+  // A wrongly decrypted packet may look like one
+  if (!ip_outer_parse(payload, len, outer)
+    || (ip[0] >> 4) != (outer->family == AF_INET ? 4 : 6)
+    || outer->len < outer->hdr_len
+    || outer->len > len - (int) sizeof(struct ether_header))
+    return STATS_NONE;
+
+  switch (outer->protocol) {
+    case IPPROTO_IPIP:
+      return STATS_IPIP;
+    case IPPROTO_IPV6:
+      return STATS_IPV6;
+    case IPPROTO_GRE:
+      return STATS_GRE;
+    case IPPROTO_ESP:
+      return ignore_esp == 1 ? STATS_NONE : STATS_ESP;
+    default:
+      return STATS_NONE;
+  }
+}
 
-  static int packet_num = 0;
-  const struct ether_header *eth_hdr = NULL;
-  const struct ip *ip_hdr = NULL;
-  struct bpf_program *bpf = NULL;
-  struct pcap_pkthdr *in_pkthdr = NULL;
-  struct pcap_pkthdr *out_pkthdr = NULL;
-  u_char *in_payload = NULL;
-  u_char *out_payload = NULL;
+/*
+ * Remove the encapsulations left in a decapsulated packet of pkthdr->len bytes, until
+ * none is known or the maximum depth is reached. layer_len is the length of the packet
+ * it was decapsulated from: a packet copied raw (unknown protocol, no ESP SA, failed
+ * decryption) keeps it, and is not processed again.
+ *
+ */
+void decap_nested(pcap_hdr *pkthdr, u_char *payload, int layer_len, int packet_num) {
 
-  verbose("Processing packet %i\n", packet_num);
+  stats_proto_t proto;
+  ip_outer_t outer;
+  int depth, len;
+  int previous_packet = current_packet;   // Called by esp_batch_flush() while another packet is processed
 
-  // Check if packet match bpf filter, if given
-  if (bpf_filter != NULL) {
-    bpf = (struct bpf_program *) bpf_filter;
-    if (pcap_offline_filter(bpf, pkthdr, bytes)  == 0) {
-      verbose("Packet %i does not match bpf filter\n", packet_num);
-      goto exit;
+  current_packet = packet_num;
+
+  for (depth = 1; depth < global_args.max_depth; depth++) {
+
+    len = pkthdr->len;
+    if (len >= layer_len || (proto = nested_encapsulation(payload, len, &outer)) == STATS_NONE)
+      break;
+
+    // Decapsulated from a copy, back into the packet buffer, cleared like by decap_packet()
+    // but its ethernet addresses: an ESP trailer may follow the packet
+    memcpy(nested_payload, payload, len);
+    memset(payload + 2*sizeof(struct ether_addr), 0, pkthdr->caplen - 2*sizeof(struct ether_addr));
+
+    PROBE_PACKET_ENCAP(packet_num, outer.family == AF_INET ? ETHERTYPE_IP : ETHERTYPE_IPV6, outer.protocol);
+    debug_print("\tNested encapsulation, depth %i\n", depth + 1);
+
+    switch (proto) {
+      case STATS_IPIP:
+        process_ipip_packet(nested_payload, len, pkthdr, payload);
+        break;
+      case STATS_IPV6:
+        process_ipv6_packet(nested_payload, len, pkthdr, payload);
+        break;
+      case STATS_GRE:
+        process_gre_packet(nested_payload, len, pkthdr, payload);
+        break;
+      default:
+        process_esp_packet(nested_payload, len, pkthdr, payload);
     }
+
+    stats.proto[proto].packets++;
+    stats.proto[proto].bytes_in += len;
+    stats.proto[proto].bytes_out += pkthdr->len;
+
+    layer_len = len;
   }
 
-  MALLOC(out_pkthdr, 1, struct pcap_pkthdr);
-  MALLOC(out_payload, 65535, u_char);
-  memset(out_pkthdr, 0, sizeof(struct pcap_pkthdr));
-  memset(out_payload, 0, 65535);
+  current_packet = previous_packet;
+}
 
-  // Pointer used to shift through source packet bytes
-  // updated when vlan header is removed
-  // TODO: don't modify source packet
+/*
+ * Identify the encapsulation protocol of a packet and give it to the corresponding process_xx_packet function
+ * Returns 1 if the decapsulated packet (out_pkthdr, out_payload) has to be written, 0 otherwise.
+ * Source packet is only read, it may be in a read-only mapping.
+ * The ethernet addresses of the decapsulated packet are written here, process_xx_packet functions
+ * write from its ethernet type: their payload starts within the VLAN tags of a tagged packet.
+ *
+ */
+int decap_packet(const pcap_hdr *in_pkthdr, const u_char *in_payload, pcap_hdr *out_pkthdr, u_char *out_payload,
+                 out_slice_t *out_slice, int packet_num) {
+
+  ip_outer_t outer;
+  bool is_ip;
+  int in_caplen = in_pkthdr->caplen;
+  int tags_len;
+  stats_proto_t proto = STATS_NONE;
+  unsigned long queued = esp_queued;
+  profile_mark_t mark = { 0, 0 };
+
+  PROFILE_BEGIN(mark);
+  PROBE_PACKET_START(packet_num, in_pkthdr->caplen, in_pkthdr->len);
+  current_packet = packet_num;
+
+  if (in_pkthdr->caplen > MAXIMUM_SNAPLEN) {
+    PROFILE_END(mark, PROFILE_DECAP);
+    PROBE_PACKET_DONE(packet_num, 0, 0);
+    stats.ignored++;
+    verbose("Ignoring packet %i: captured length %u is greater than %i\n",
+      packet_num, in_pkthdr->caplen, MAXIMUM_SNAPLEN);
+    return 0;
+  }
 
-  in_pkthdr = (struct pcap_pkthdr *) pkthdr;
-  in_payload = (u_char *) bytes;
+  memset(out_pkthdr, 0, sizeof(struct pcap_pkthdr));
 
   // Copy source pcap metadata
   out_pkthdr->ts.tv_sec = in_pkthdr->ts.tv_sec;
   out_pkthdr->ts.tv_usec = in_pkthdr->ts.tv_usec;
   out_pkthdr->caplen = in_pkthdr->caplen;
 
-  eth_hdr = (const struct ether_header *) in_payload;
+  // If IEEE 802.1Q or 802.1ad headers, skip them: the packet is processed from the last tag
+  tags_len = ieee8021q_headers_len(in_payload, in_caplen);
+  if (tags_len > 0) {
+    debug_print("\tIEEE 802.1Q headers: %i\n", tags_len / VLAN_TAG_LEN);
+    stats.vlan += tags_len / VLAN_TAG_LEN;
 
-  // If IEEE 802.1Q header, remove it before further processing
-  if (ntohs(eth_hdr->ether_type) == ETHERTYPE_VLAN) {
-      debug_print("%s\n", "\tIEEE 801.1Q header\n");
-      remove_ieee8021q_header(in_payload, in_pkthdr->caplen, out_pkthdr, out_payload);
+    in_payload += tags_len;
+    in_caplen -= tags_len;
+    out_pkthdr->caplen = in_caplen;
+  }
 
-      // Update source packet with the new one without 802.1q header
-      memcpy(in_payload, out_payload, out_pkthdr->caplen);
-      in_pkthdr->caplen = out_pkthdr->caplen;
-      in_pkthdr->len = out_pkthdr->len;
+  is_ip = ip_outer_parse(in_payload, in_caplen, &outer);
 
-      // Re-read new ethernet type
-      eth_hdr = (const struct ether_header *) in_payload;
+  // Decapsulations only stripping headers leave the inner packet in the source packet, when
+  // the caller can write it from there and no nested encapsulation has to be removed from it
+  if (out_slice != NULL) {
+    out_slice->data = NULL;
+    if (is_ip && global_args.max_depth == 1
+      && (outer.protocol == IPPROTO_IPIP || outer.protocol == IPPROTO_IPV6 || outer.protocol == IPPROTO_GRE))
+      decap_slice = out_slice;
   }
-  // ethertype = *(pkt_in_ptr + 12) << 8 | *(pkt_in_ptr+13);
 
-  if (ntohs(eth_hdr->ether_type) != ETHERTYPE_IP) {
+  // caplen bytes are dumped, even when the decapsulated packet is shorter:
+  // only this part of the buffer has to be cleared. A slice is padded when written.
+  if (decap_slice == NULL)
+    memset(out_payload, 0, in_pkthdr->caplen);
+
+  // Ethernet addresses are written once, whatever the encapsulation
+  memcpy(out_payload, in_payload - tags_len,
+         in_pkthdr->caplen < 2*sizeof(struct ether_addr) ? in_pkthdr->caplen : 2*sizeof(struct ether_addr));
+
+  if (!is_ip) {
+
+    PROBE_PACKET_ENCAP(packet_num, ntohs(((const struct ether_header *) in_payload)->ether_type), 0);
 
     // Non IP packet ? Just copy
-    process_nonip_packet(in_payload, in_pkthdr->caplen, out_pkthdr, out_payload);
-    pcap_dump((u_char *)pcap_dumper, out_pkthdr, out_payload);
+    process_nonip_packet(in_payload, in_caplen, out_pkthdr, out_payload);
 
   } else {
 
-    // Find encapsulation type
-    ip_hdr = (const struct ip *) (in_payload + sizeof(struct ether_header));
+    // Find encapsulation type, after the IPv6 extension headers
+    PROBE_PACKET_ENCAP(packet_num, outer.family == AF_INET ? ETHERTYPE_IP : ETHERTYPE_IPV6, outer.protocol);
 
     //debug_print("\tIP hlen:%i iplen:%02x protocol:%02x payload_len:%i\n",
-      //(ip_hdr->ip_hl *4), ntohs(ip_hdr->ip_len), ip_hdr->ip_p, payload_len);
+      //outer.hdr_len, outer.len, outer.protocol, payload_len);
 
-    switch (ip_hdr->ip_p) {
+    switch (outer.protocol) {
 
       case IPPROTO_IPIP:
         debug_print("%s\n", "\tIPPROTO_IPIP");
-        process_ipip_packet(in_payload, in_pkthdr->caplen, out_pkthdr, out_payload);
-        pcap_dump((u_char *)pcap_dumper, out_pkthdr, out_payload);
+        proto = STATS_IPIP;
+        process_ipip_packet(in_payload, in_caplen, out_pkthdr, out_payload);
         break;
 
       case IPPROTO_IPV6:
         debug_print("%s\n", "\tIPPROTO_IPV6");
-        process_ipv6_packet(in_payload, in_pkthdr->caplen, out_pkthdr, out_payload);
-        pcap_dump((u_char *)pcap_dumper, out_pkthdr, out_payload);
+        proto = STATS_IPV6;
+        process_ipv6_packet(in_payload, in_caplen, out_pkthdr, out_payload);
         break;
 
       case IPPROTO_GRE:
         debug_print("%s\n", "\tIPPROTO_GRE\n");
-        process_gre_packet(in_payload, in_pkthdr->caplen, out_pkthdr, out_payload);
-        pcap_dump((u_char *)pcap_dumper, out_pkthdr, out_payload);
+        proto = STATS_GRE;
+        process_gre_packet(in_payload, in_caplen, out_pkthdr, out_payload);
         break;
 
       case IPPROTO_ESP:
         debug_print("%s\n", "\tIPPROTO_ESP\n");
 
         if (ignore_esp == 1) {
+          PROFILE_END(mark, PROFILE_DECAP);
+          PROBE_PACKET_DONE(packet_num, 0, 0);
+          stats.ignored++;
           verbose("Ignoring ESP packet %i\n", packet_num);
-          free(out_pkthdr);
-          free(out_payload);
-          return;
+          return 0;
         }
 
-        process_esp_packet(in_payload, in_pkthdr->caplen, out_pkthdr, out_payload);
-        pcap_dump((u_char *)pcap_dumper, out_pkthdr, out_payload);
+        proto = STATS_ESP;
+        process_esp_packet(in_payload, in_caplen, out_pkthdr, out_payload);
         break;
 
       default:
         // Copy not encapsulated/unknown encpsulation protocol packets, like non_ip packets
-        process_nonip_packet(in_payload, in_pkthdr->caplen, out_pkthdr, out_payload);
-        pcap_dump((u_char *)pcap_dumper, out_pkthdr, out_payload);
+        process_nonip_packet(in_payload, in_caplen, out_pkthdr, out_payload);
         verbose("Copying packet %i: not encapsulated/unknown encapsulation protocol\n", packet_num);
 
     }
-  } // if (ntohs(eth_hdr->ether_type) != ETHERTYPE_IP)
+  } // if (!is_ip)
+
+  decap_slice = NULL;
+
+  stats.proto[proto].packets++;
+  stats.proto[proto].bytes_in += in_pkthdr->caplen;
+
+  // A queued ESP packet is counted, and its inner encapsulations removed, by esp_batch_flush()
+  if (esp_queued != queued) {
+    esp_pending[esp_pending_count].hdr = out_pkthdr;
+    esp_pending[esp_pending_count].payload = out_payload;
+    esp_pending[esp_pending_count].len = in_caplen;
+    esp_pending[esp_pending_count].num = packet_num;
+    esp_pending_count++;
+  } else {
+    stats.proto[proto].bytes_out += out_pkthdr->len;
+    if (global_args.max_depth > 1)
+      decap_nested(out_pkthdr, out_payload, in_caplen, packet_num);
+  }
+
+  PROFILE_END(mark, PROFILE_DECAP);
+  PROBE_PACKET_DONE(packet_num, 1, out_pkthdr->len);
+  return 1;
+}
+
+/*
+ * Scatter/gather vector of the caplen bytes of a decapsulated packet: its output buffer, or
+ * the ethernet header of its output buffer, its slice of the source packet and zero padding.
+ * Returns the number of iovec filled, at most OUT_IOV_MAX
+ *
+ */
+int out_packet_iov(const pcap_hdr *pkthdr, const u_char *payload, const out_slice_t *slice, struct iovec *iov) {
 
-  free(out_pkthdr);
-  free(out_payload);
+  static const u_char zeros[MAXIMUM_SNAPLEN];
+  int count = 0, pad;
+
+  if (slice == NULL || slice->data == NULL) {
+    iov[0].iov_base = (void *) payload;
+    iov[0].iov_len = pkthdr->caplen;
+    return 1;
+  }
+
+  iov[count].iov_base = (void *) payload;
+  iov[count].iov_len = sizeof(struct ether_header);
+  count++;
+
+  if (slice->len > 0) {
+    iov[count].iov_base = (void *) slice->data;
+    iov[count].iov_len = slice->len;
+    count++;
+  }
+
+  pad = pkthdr->caplen - sizeof(struct ether_header) - slice->len;
+  if (pad > 0) {
+    iov[count].iov_base = (void *) zeros;
+    iov[count].iov_len = pad;
+    count++;
+  }
+
+  return count;
+}
+
+/*
+ * Make packets written so far readable from the output file, called by the thread writing packets
+ *
+ */
+void output_flush(void) {
+
+  if (pcapng_mode)
+    fflush(pcapng.out);
+  else if (global_args.async_write)
+    async_writer_flush();
+  else
+    pcap_dump_flush(pcap_dumper);
+}
+
+/*
+ * Write a decapsulated packet to the output file, from its output buffer and its slice of the source packet if any
+ *
+ */
+void write_packet(const pcap_hdr *pkthdr, const u_char *payload, const out_slice_t *slice) {
+
+  static int unflushed = 0;
+  struct iovec iov[OUT_IOV_MAX];
+  int iovcnt;
+  profile_mark_t mark = { 0, 0 };
+
+  PROFILE_BEGIN(mark);
+
+  iovcnt = out_packet_iov(pkthdr, payload, slice, iov);
+
+  if (pcapng_mode)
+    pcapng_write_packet(&pcapng, pkthdr, iov, iovcnt);
+  else if (global_args.async_write)
+    async_writer_write(pkthdr, iov, iovcnt);
+  else
+    writer_pcap_dump(pcap_dumper, pkthdr, iov, iovcnt);
+
+  // Decapsulation threads: the reader counts packets, the output is flushed with their batch
+  if (global_args.flush_packets > 0 && global_args.threads == 0 && ++unflushed >= global_args.flush_packets) {
+    output_flush();
+    unflushed = 0;
+  }
+
+  PROFILE_END(mark, PROFILE_WRITE);
+}
+
+/*
+ * Time based flush policy: flush output every flush_ms milliseconds, even if no packet comes.
+ * stdio serializes this fflush() with pcap_dump() writes of the other threads.
+ *
+ */
+void * flush_output(void *arg) {
+
+  struct timespec delay;
+
+  (void) arg;
+
+  delay.tv_sec = global_args.flush_ms / 1000;
+  delay.tv_nsec = (global_args.flush_ms % 1000) * 1000000L;
+
+  while (!atomic_load(&flush_stop)) {
+    nanosleep(&delay, NULL);
+
+    // Packets waiting in a partial batch are decapsulated, then flushed by the writer thread
+    if (global_args.threads > 0)
+      pipeline_flush(true);
+
+    if (pcapng_mode)
+      fflush(pcapng.out);
+    else
+      pcap_dump_flush(pcap_dumper);
+  }
+
+  return NULL;
+}
+
+/*
+ * SIGINT/SIGTERM handler: stop live capture after the current block
+ *
+ */
+void capture_signal(int signum) {
+
+  (void) signum;
+
+  capture_stop = 1;
+}
+
+/*
+ * pcap_dispatch callback: filter each packet, then decapsulate it directly or through the decapsulation threads
+ *
+ */
+void handle_packets(u_char *bpf_filter, const struct pcap_pkthdr *pkthdr, const u_char *bytes) {
+
+  static int packet_num = 0;
+  static int unflushed = 0;
+  static profile_mark_t read_mark = { .start = 0 };
+  profile_mark_t mark = { 0, 0 };
+  struct bpf_program *bpf = NULL;
+  out_slice_t slice;
+  int rc;
+
+  // Time since the previous packet was handled: reading of this one
+  if (profile_enabled && read_mark.start != 0)
+    profile_end(&read_mark, PROFILE_READ);
+
+  verbose("Processing packet %i\n", packet_num);
+
+  // Check if packet match bpf filter, if given
+  if (bpf_filter != NULL) {
+    bpf = (struct bpf_program *) bpf_filter;
+    PROFILE_BEGIN(mark);
+    rc = pcap_offline_filter(bpf, pkthdr, bytes);
+    PROFILE_END(mark, PROFILE_FILTER);
+    if (rc == 0) {
+      stats.filtered++;
+      verbose("Packet %i does not match bpf filter\n", packet_num);
+      goto exit;
+    }
+  }
+
+  if (global_args.threads > 0) {
+    // Packet is copied, decapsulation threads will work on their copy
+    PROFILE_BEGIN(mark);
+    pipeline_submit(pkthdr, bytes, packet_num);
+
+    // Packet count flush policy, its batch is flushed once written
+    if (global_args.flush_packets > 0 && ++unflushed >= global_args.flush_packets) {
+      pipeline_flush(true);
+      unflushed = 0;
+    }
+    PROFILE_END(mark, PROFILE_SUBMIT);
+    goto exit;
+  }
+
+  // Output buffers are allocated once by main() and reused for each packet, the source
+  // packet is still there when the decapsulated one is written
+  if (decap_packet(pkthdr, bytes, &out_packet.hdr, out_packet.payload, &slice, packet_num) == 1) {
+    PROBE_PACKET_WRITE(packet_num, out_packet.hdr.caplen, out_packet.hdr.len);
+    write_packet(&out_packet.hdr, out_packet.payload, &slice);
+  }
 
   exit: // Avoid several 'return' in middle of code
     packet_num++;
+    PROFILE_BEGIN(read_mark);
 }
 
 
+#ifndef IPDECAP_NO_MAIN
 int main(int argc, char **argv) {
 
   char errbuf[PCAP_ERRBUF_SIZE];
   pcap_t *pcap_reader = NULL;
+  FILE *in_file = NULL;
+  FILE *out_file = NULL;
+  bool pcapng_input = false;
+  mmap_reader_t mmap_reader;
+  capture_t capture;
+  struct sigaction sa;
+  pthread_t flush_thread;
+  bool use_mmap = false;
   pcap_dumper = NULL;
   pcap_t *p = NULL;
   struct bpf_program *bpf = NULL;
@@ -1035,17 +2607,34 @@ int main(int argc, char **argv) {
     global_args.esp_config_file,
     global_args.bpf_filter);
 
-  if (global_args.input_file == NULL || global_args.output_file == NULL) {
+  if ((global_args.input_file == NULL && global_args.interface == NULL) || global_args.output_file == NULL) {
     usage();
     error("Input and outfile file parameters are mandatory\n");
   }
 
-  pcap_reader = pcap_open_offline(global_args.input_file, errbuf);
+  if (global_args.interface != NULL) {
+    if (capture_open(&capture, global_args.interface, global_args.ring_size) != 0)
+      error("Cannot capture on interface %s: %s\n", global_args.interface, strerror(errno));
+  } else {
+    if ((in_file = input_open(global_args.input_file)) == NULL)
+      error("Cannot open input file %s: %s\n", global_args.input_file, strerror(errno));
+
+    pcapng_input = pcapng_probe(in_file, global_args.input_file);
+
+    if (pcapng_input && !global_args.pcapng)
+      pcapng_input = false;
+    else if (!pcapng_input && global_args.pcapng)
+      warnx("%s is not a pcapng file - writing a pcap file\n", global_args.input_file);
 
-  if (pcap_reader == NULL)
-    error("Cannot open input file %s: %s", global_args.input_file, errbuf);
+    if (!pcapng_input) {
+      pcap_reader = pcap_fopen_offline(in_file, errbuf);
 
-  debug_print("snaplen:%i\n", pcap_snapshot(pcap_reader));
+      if (pcap_reader == NULL)
+        error("Cannot open input file %s: %s", global_args.input_file, errbuf);
+
+      debug_print("snaplen:%i\n", pcap_snapshot(pcap_reader));
+    }
+  }
 
   p = pcap_open_dead(DLT_EN10MB, MAXIMUM_SNAPLEN);
 
@@ -1057,10 +2646,16 @@ int main(int argc, char **argv) {
       error("pcap_compile() %s\n", pcap_geterr(p));
     }
   }
-  pcap_dumper = pcap_dump_open(p, global_args.output_file);
+  // Ciphers are resolved while reading the ESP configuration file
+  OpenSSL_add_all_algorithms();
 
-  if (pcap_dumper == NULL)
-    error("Cannot open output file %s : %s\n", global_args.output_file, errbuf);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  // des-cbc is only provided by the legacy provider since OpenSSL 3.0
+  if (OSSL_PROVIDER_load(NULL, "legacy") == NULL)
+    debug_print("%s\n", "OpenSSL legacy provider not available");
+  if (OSSL_PROVIDER_load(NULL, "default") == NULL)
+    error("Cannot load OpenSSL default provider\n");
+#endif
 
   // Try to read ESP configuration file
   if (global_args.esp_config_file != NULL) {
@@ -1085,18 +2680,139 @@ int main(int argc, char **argv) {
     dump_flows();
   #endif
 
-  OpenSSL_add_all_algorithms();
+  // Counters of packets filtered, or decapsulated, by this thread
+  stats_thread_init(flow_count);
+
+  if (global_args.profile)
+    profile_start();
+
+  // Split mode writes the output file itself
+  if (global_args.split > 1) {
+    if (split_process(global_args.input_file, global_args.output_file, global_args.split, bpf, p) == 0)
+      goto cleanup;
+
+    warnx("%s is not a classic pcap file, it cannot be split - processing it sequentially\n",
+      global_args.input_file);
+  }
+
+  // Blocks and packets have to be written in input order, by the reading thread
+  if (pcapng_input && (global_args.threads > 0 || global_args.async_write)) {
+    warnx("%s is a pcapng file, --threads, --async-write and --zstd are not supported - processing it sequentially\n",
+      global_args.input_file);
+    global_args.threads = 0;
+    global_args.async_write = false;
+  }
+
+  if (pcapng_input) {
+    if (is_stdio(global_args.output_file))
+      out_file = stdout;
+    else if ((out_file = fopen(global_args.output_file, "wb")) == NULL)
+      error("Cannot open output file %s : %s\n", global_args.output_file, strerror(errno));
+    pcapng_open(&pcapng, in_file, out_file);
+    pcapng_mode = true;
+  } else if (global_args.async_write) {
+    if (async_writer_open(global_args.output_file, pcap_datalink(p), pcap_snapshot(p),
+          global_args.compress ? &global_args.zstd : NULL) != 0)
+      error("Cannot open output file %s : %s\n", global_args.output_file, strerror(errno));
+  } else {
+    pcap_dumper = pcap_dump_open(p, global_args.output_file);
+
+    if (pcap_dumper == NULL)
+      error("Cannot open output file %s : %s\n", global_args.output_file, pcap_geterr(p));
+  }
+
+  // Reused for each packet, no allocation is done while processing packets
+  MALLOC(out_packet.payload, MAXIMUM_SNAPLEN, u_char);
+
+  if (global_args.threads > 0) {
+    verbose("Using %i decapsulation threads\n", global_args.threads);
+    pipeline_start(global_args.threads, decap_packet, write_packet,
+                   decap_thread_init, decap_thread_cleanup, esp_batch_flush, output_flush);
+  }
+
+  if (global_args.flush_ms > 0 && global_args.threads > 0)
+    pipeline_share();
+
+  if (global_args.flush_ms > 0 && (rc = pthread_create(&flush_thread, NULL, flush_output, NULL)) != 0)
+    error("Cannot create flush thread: %s\n", strerror(rc));
+
+  if (global_args.mmap && !pcapng_input) {
+    if (mmap_reader_open(&mmap_reader, global_args.input_file) == 0)
+      use_mmap = true;
+    else
+      warnx("%s is not a classic pcap file, it cannot be memory mapped - reading it with libpcap\n",
+        global_args.input_file);
+  }
 
   // Dispatch to handle_packet function each packet read from the pcap file
-  pcap_dispatch(pcap_reader, 0, handle_packets, (u_char *) bpf);
+  if (global_args.interface != NULL) {
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = capture_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    verbose("Capturing on %s with a %i MB ring, interrupt to stop\n",
+      global_args.interface, global_args.ring_size);
+    while (!capture_stop) {
+      if ((rc = capture_dispatch(&capture, handle_packets, (u_char *) bpf, CAPTURE_BLOCK_TIMEOUT)) == -1)
+        error("Cannot capture on interface %s: %s\n", global_args.interface, strerror(errno));
+      // Make packets of each block readable from the output file without waiting
+      if (rc > 0 && global_args.threads > 0)
+        pipeline_flush(true);
+      else if (rc > 0)
+        output_flush();
+    }
+    capture_stats(&capture);
+    capture_close(&capture);
+  } else if (pcapng_mode) {
+    verbose("Reading pcapng input file, writing pcapng output file\n");
+    pcapng_dispatch(&pcapng, handle_packets, (u_char *) bpf);
+  } else if (use_mmap) {
+    verbose("Reading input file through a memory mapping\n");
+    mmap_reader_dispatch(&mmap_reader, handle_packets, (u_char *) bpf);
+    mmap_reader_close(&mmap_reader);
+  } else {
+    pcap_dispatch(pcap_reader, 0, handle_packets, (u_char *) bpf);
+  }
+
+  // The flush thread may give batches to the decapsulation threads, it is stopped first
+  if (global_args.flush_ms > 0) {
+    atomic_store(&flush_stop, true);
+    pthread_join(flush_thread, NULL);
+  }
+
+  // Wait for the last packets to be written
+  if (global_args.threads > 0)
+    pipeline_finish();
 
-  pcap_close(pcap_reader);
+  if (pcapng_mode)
+    pcapng_close(&pcapng);
+  else if (global_args.async_write)
+    async_writer_close();
+  else
+    pcap_dump_close(pcap_dumper);
+  free(out_packet.payload);
+
+  cleanup:
+  if (pcap_reader != NULL)
+    pcap_close(pcap_reader);
+  else if (in_file != NULL && in_file != stdin && !pcapng_mode)
+    fclose(in_file);
   pcap_close(p);
-  pcap_dump_close(pcap_dumper);
 
-  EVP_cleanup();
+  if (global_args.verify_icv)
+    icv_stats_print();
+
+  if (global_args.stats || global_args.stats_json != NULL)
+    stats_report();
+
+  if (global_args.profile)
+    profile_print(verbose_stream);
 
   flows_cleanup();
 
+  EVP_cleanup();
+
   return 0;
 }
+#endif /* IPDECAP_NO_MAIN */
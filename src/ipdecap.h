@@ -35,6 +35,10 @@
 #define MAXIMUM_SNAPLEN   65535
 #define GRE_HEADERLEN     4
 #define CONF_BUFFER_SIZE  1024
+#define DECAP_MAX_DEPTH   16    // Maximum encapsulation layers removed from a packet
+
+#define ETHERTYPE_8021AD  0x88a8  // IEEE 802.1ad (QinQ) service tag
+#define ETHERTYPE_QINQ    0x9100  // Pre-standard QinQ tag
 
 #define member_size(type, member) sizeof(((type *)0)->member)
 
@@ -53,13 +57,28 @@
 #endif
 
 #define MALLOC(ptr, count, type) {                      \
-  if ( (ptr = malloc(count * sizeof(type))) == NULL) {  \
+  if ( (ptr = malloc((count) * sizeof(type))) == NULL) { \
     error("Cannot malloc");                             \
   }                                                     \
 }
 
 typedef struct pcap_pkthdr pcap_hdr;
 
+// Decapsulated packet, written by process_xx_packet functions
+typedef struct out_packet_t {
+  pcap_hdr hdr;
+  u_char *payload;        // MAXIMUM_SNAPLEN bytes
+} out_packet_t;
+
+// Inner packet left in the source packet by the decapsulations only stripping headers (IPIP, 6in4, GRE):
+// the output buffer only holds the ethernet header, written followed by this slice
+typedef struct out_slice_t {
+  const u_char *data;     // NULL if the whole packet is in the output buffer
+  int len;
+} out_slice_t;
+
+#define OUT_IOV_MAX       3     // Ethernet header, slice and zero padding of a packet
+
 typedef struct sockaddr_storage sa_sto;
 
 typedef union address {
@@ -69,29 +88,73 @@ typedef union address {
   struct sockaddr_storage sa_sto;
 } address_t;
 
+struct llflow_t;
+struct iovec;
+
+#define IP6_MAX_EXTENSIONS  8   // Extension headers walked before giving up on an IPv6 packet
+
+// Outer IP header of an encapsulated packet, IPv4 or IPv6 with its extension headers
+typedef struct ip_outer_t {
+  int family;             // AF_INET or AF_INET6
+  const void *src;        // Raw addresses: struct in_addr or struct in6_addr
+  const void *dst;
+  int hdr_len;            // IPv4 header, or IPv6 header and extension headers
+  int len;                // Whole IP packet: ip_len, or IPv6 header and payload length
+  int protocol;           // Upper layer protocol, IPPROTO_NONE if the packet cannot be decapsulated
+} ip_outer_t;
+
 void print_version(void);
 void print_algorithms(void);
 void verbose(const char *format, ...);
+bool is_stdio(const char *filename);
 void copy_n_shift(u_char *ptr, u_char *dst, u_int len);
-void *str2dec(const char *in, int maxsize);
-int add_flow(char *ip_src, char *ip_dst, char *crypt_name, char *auth_name, char *key, char *spi);
+int hex_decode(const char *in, unsigned char *out, int maxsize);
+void * flow_arena_alloc(size_t size);
+void flow_arena_reserve(size_t size);
+void flow_hmac_init(struct llflow_t *flow, char *auth_key);
+int add_flow(char *ip_src, char *ip_dst, char *crypt_name, char *auth_name, char *key, char *spi, char *auth_key);
 void dumpmem(char *prefix, const unsigned char *ptr, int size, int space);
 void dump_flows(void);
 void usage(void);
 void print_mac(const unsigned char *mac_ptr);
 void flows_cleanup(void);
-struct llflow_t * find_flow(char *ip_src, char *ip_dst, u_int32_t spi);
+void flows_thread_init(void);
+void flows_thread_cleanup(void);
+void decap_thread_init(void);
+void decap_thread_cleanup(void);
+void icv_stats_merge(void);
+void icv_stats_print(void);
+void stats_report(void);
+const void * address_bytes(const address_t *addr, int *len);
+u_int32_t flow_hash(int family, const void *ip_src, const void *ip_dst, u_int32_t spi);
+void flow_table_resize(u_int32_t size);
+void flow_table_reserve(u_int32_t count);
+void flow_table_insert(struct llflow_t *flow);
+struct llflow_t * find_flow(int family, const void *ip_src, const void *ip_dst, u_int32_t spi);
 int parse_esp_conf(char *filename);
 struct crypt_method_t * find_crypt_method(char *crypt_name);
 struct auth_method_t * find_auth_method(char *auth_name);
+int decap_packet(const pcap_hdr *in_pkthdr, const u_char *in_payload, pcap_hdr *out_pkthdr, u_char *out_payload,
+                 out_slice_t *out_slice, int packet_num);
+void decap_nested(pcap_hdr *pkthdr, u_char *payload, int layer_len, int packet_num);
+int out_packet_iov(const pcap_hdr *pkthdr, const u_char *payload, const out_slice_t *slice, struct iovec *iov);
+void output_flush(void);
+void write_packet(const pcap_hdr *pkthdr, const u_char *payload, const out_slice_t *slice);
+void * flush_output(void *arg);
+void capture_signal(int signum);
 void handle_packets(u_char *user, const struct pcap_pkthdr *h, const u_char *bytes);
 
-void remove_ieee8021q_header(const u_char *in_payload, const int in_payload_len, pcap_hdr *out_pkthdr, u_char *out_payload);
+bool ip_outer_parse(const u_char *packet, int packet_len, ip_outer_t *outer);
+void set_ethertype(u_char *packet, int protocol);
+int ieee8021q_headers_len(const u_char *packet, int packet_len);
 void process_nonip_packet(const u_char *payload, const int payload_len, pcap_hdr *new_packet_hdr, u_char *new_packet_payload);
 void process_ipip_packet(const u_char *payload, const int payload_len, pcap_hdr *new_packet_hdr, u_char *new_packet_payload);
 void process_ipv6_packet(const u_char *payload, const int payload_len, pcap_hdr *new_packet_hdr, u_char *new_packet_payload);
 void process_gre_packet(const u_char *payload, const int payload_len, pcap_hdr *new_packet_hdr, u_char *new_packet_payload);
+void esp_remove_trailer(struct llflow_t *flow, const u_char *payload, const int payload_len, pcap_hdr *new_packet_hdr,
+                        u_char *new_packet_payload, int packet_size, int block_size);
+void esp_batch_flush(void);
 void process_esp_packet(const u_char *payload, const int payload_len, pcap_hdr *new_packet_hdr, u_char *new_packet_payload);
 
-struct llflow_t *flow_head = NULL;
+extern struct llflow_t *flow_head;
 void parse_options(int argc, char **argv);
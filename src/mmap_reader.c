@@ -0,0 +1,139 @@
+/*
+  Copyright (c) 2012-2016 Loïc Pefferkorn <loic-ipdecap@loicp.eu>
+  ipdecap [http://loicpefferkorn.net/ipdecap]
+
+  This file is part of ipdecap.
+
+  Ipdecap is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Ipdecap is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ipdecap.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+#include <pcap/pcap.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "config.h"
+#include "ipdecap.h"
+#include "mmap_reader.h"
+
+static u_int32_t mmap_u32(const u_char *ptr, bool swapped) {
+
+  u_int32_t v;
+  memcpy(&v, ptr, sizeof(v));
+  return swapped ? __builtin_bswap32(v) : v;
+}
+
+/*
+ * Map a classic pcap file
+ * Returns -1 if the file cannot be mapped or is not a classic pcap file (pcapng, ...)
+ *
+ */
+int mmap_reader_open(mmap_reader_t *reader, const char *filename) {
+
+  struct stat st;
+  u_int32_t magic;
+  void *data = NULL;
+
+  memset(reader, 0, sizeof(mmap_reader_t));
+
+  if ((reader->fd = open(filename, O_RDONLY)) == -1)
+    return -1;
+
+  if (fstat(reader->fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size < MMAP_FILE_HDRLEN) {
+    close(reader->fd);
+    return -1;
+  }
+
+  reader->size = st.st_size;
+
+  data = mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+  if (data == MAP_FAILED) {
+    close(reader->fd);
+    return -1;
+  }
+  reader->data = data;
+
+  memcpy(&magic, reader->data, sizeof(magic));
+  switch (magic) {
+    case 0xa1b2c3d4: reader->swapped = false; reader->nano = false; break;
+    case 0xd4c3b2a1: reader->swapped = true;  reader->nano = false; break;
+    case 0xa1b23c4d: reader->swapped = false; reader->nano = true;  break;
+    case 0x4d3cb2a1: reader->swapped = true;  reader->nano = true;  break;
+    default:
+      mmap_reader_close(reader);
+      return -1;
+  }
+
+  reader->snaplen = mmap_u32(reader->data + 16, reader->swapped);
+  reader->linktype = mmap_u32(reader->data + 20, reader->swapped) & 0x03ffffff;
+  reader->pos = MMAP_FILE_HDRLEN;
+
+  // Read once from start to end: aggressive read-ahead, pages can be dropped soon after use
+  if (madvise((void *) reader->data, reader->size, MADV_SEQUENTIAL) != 0)
+    debug_print("%s\n", "madvise() failed");
+
+  return 0;
+}
+
+/*
+ * Give each packet to callback, like pcap_dispatch() with an unlimited count
+ * Returns the number of packets read
+ *
+ */
+int mmap_reader_dispatch(mmap_reader_t *reader, pcap_handler callback, u_char *user) {
+
+  struct pcap_pkthdr pkthdr;
+  const u_char *rec = NULL;
+  u_int32_t ts_frac;
+  int count = 0;
+
+  while (reader->pos + MMAP_RECORD_HDRLEN <= reader->size) {
+
+    rec = reader->data + reader->pos;
+    pkthdr.ts.tv_sec = mmap_u32(rec, reader->swapped);
+    ts_frac = mmap_u32(rec + 4, reader->swapped);
+    pkthdr.ts.tv_usec = reader->nano ? ts_frac / 1000 : ts_frac;
+    pkthdr.caplen = mmap_u32(rec + 8, reader->swapped);
+    pkthdr.len = mmap_u32(rec + 12, reader->swapped);
+
+    if (reader->pos + MMAP_RECORD_HDRLEN + pkthdr.caplen > reader->size) {
+      warnx("truncated packet at offset %zu, stopping\n", reader->pos);
+      break;
+    }
+
+    reader->pos += MMAP_RECORD_HDRLEN + pkthdr.caplen;
+    callback(user, &pkthdr, rec + MMAP_RECORD_HDRLEN);
+    count++;
+  }
+
+  return count;
+}
+
+void mmap_reader_close(mmap_reader_t *reader) {
+
+  if (reader->data != NULL)
+    munmap((void *) reader->data, reader->size);
+  close(reader->fd);
+  reader->data = NULL;
+}
@@ -0,0 +1,42 @@
+/*
+  Copyright (c) 2012-2016 Loïc Pefferkorn <loic-ipdecap@loicp.eu>
+  ipdecap [http://loicpefferkorn.net/ipdecap]
+
+  This file is part of ipdecap.
+
+  Ipdecap is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Ipdecap is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ipdecap.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Built-in reader for classic pcap files: the file is memory mapped and packets
+ * are given to the callback with pointers into the read-only mapping, without copy.
+ */
+
+#define MMAP_FILE_HDRLEN    24        // struct pcap_file_header
+#define MMAP_RECORD_HDRLEN  16        // ts_sec, ts_usec, caplen, len
+
+typedef struct mmap_reader_t {
+  int fd;
+  const u_char *data;
+  size_t size;
+  size_t pos;             // Offset of the next record
+  bool swapped;
+  bool nano;              // Nanosecond timestamps, given in microseconds like libpcap does
+  u_int32_t snaplen;
+  int linktype;
+} mmap_reader_t;
+
+int mmap_reader_open(mmap_reader_t *reader, const char *filename);
+int mmap_reader_dispatch(mmap_reader_t *reader, pcap_handler callback, u_char *user);
+void mmap_reader_close(mmap_reader_t *reader);
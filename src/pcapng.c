@@ -0,0 +1,302 @@
+/*
+  Copyright (c) 2012-2016 Loïc Pefferkorn <loic-ipdecap@loicp.eu>
+  ipdecap [http://loicpefferkorn.net/ipdecap]
+
+  This file is part of ipdecap.
+
+  Ipdecap is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Ipdecap is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ipdecap.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+#include <pcap/pcap.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include "config.h"
+#include "ipdecap.h"
+#include "pcapng.h"
+#include "input.h"
+
+static u_int32_t ng_u32(const pcapng_t *ng, const u_char *ptr) {
+
+  u_int32_t v;
+  memcpy(&v, ptr, sizeof(v));
+  return ng->swapped ? __builtin_bswap32(v) : v;
+}
+
+static u_int16_t ng_u16(const pcapng_t *ng, const u_char *ptr) {
+
+  u_int16_t v;
+  memcpy(&v, ptr, sizeof(v));
+  return ng->swapped ? __builtin_bswap16(v) : v;
+}
+
+static void ng_put_u32(const pcapng_t *ng, u_char *ptr, u_int32_t v) {
+
+  if (ng->swapped)
+    v = __builtin_bswap32(v);
+  memcpy(ptr, &v, sizeof(v));
+}
+
+/*
+ * Tell if the stream opened by input_open() is a pcapng file. It is left positioned
+ * at the start of the file, for pcap_fopen_offline() or pcapng_open().
+ *
+ */
+bool pcapng_probe(FILE *in, const char *filename) {
+
+  u_char magic[4];
+  size_t len;
+
+  len = fread(magic, 1, sizeof(magic), in);
+  input_unread(in, magic, len, filename);
+
+  return len == sizeof(magic) && memcmp(magic, "\x0a\x0d\x0d\x0a", sizeof(magic)) == 0;
+}
+
+void pcapng_open(pcapng_t *ng, FILE *in, FILE *out) {
+
+  memset(ng, 0, sizeof(pcapng_t));
+  ng->in = in;
+  ng->out = out;
+}
+
+/*
+ * Make sure current block can hold len bytes, and its rewritten copy a decapsulated packet more
+ *
+ */
+static void pcapng_block_reserve(pcapng_t *ng, u_int32_t len) {
+
+  if (len <= ng->block_alloc)
+    return;
+
+  ng->block_alloc = len;
+  if ((ng->block = realloc(ng->block, len)) == NULL
+    || (ng->out_block = realloc(ng->out_block, len + MAXIMUM_SNAPLEN + 64)) == NULL)
+    error("Cannot malloc");
+}
+
+/*
+ * Read next block, the byte order of a Section Header Block applies to its section
+ * Returns 1 if a block is read, 0 at end of file, -1 if the block is truncated or invalid
+ *
+ */
+static int pcapng_read_block(pcapng_t *ng, u_int32_t *type, u_int32_t *len) {
+
+  u_char hdr[12];
+  u_int32_t bom;
+  size_t hdr_len = 8;
+
+  if (fread(hdr, 1, 8, ng->in) != 8)
+    return feof(ng->in) && !ferror(ng->in) ? 0 : -1;
+
+  memcpy(type, hdr, sizeof(u_int32_t));
+
+  if (*type == PCAPNG_MAGIC) {
+    if (fread(hdr + 8, 1, 4, ng->in) != 4)
+      return -1;
+    memcpy(&bom, hdr + 8, sizeof(bom));
+    if (bom == PCAPNG_BYTE_ORDER)
+      ng->swapped = false;
+    else if (bom == __builtin_bswap32(PCAPNG_BYTE_ORDER))
+      ng->swapped = true;
+    else
+      return -1;
+    hdr_len = 12;
+  }
+
+  *type = ng_u32(ng, hdr);
+  *len = ng_u32(ng, hdr + 4);
+
+  if (*len < 12 || *len % 4 != 0 || *len > PCAPNG_MAX_BLOCK)
+    return -1;
+
+  pcapng_block_reserve(ng, *len);
+  memcpy(ng->block, hdr, hdr_len);
+
+  if (fread(ng->block + hdr_len, 1, *len - hdr_len, ng->in) != *len - hdr_len)
+    return -1;
+
+  return 1;
+}
+
+/*
+ * Record link type and timestamp resolution of an Interface Description Block
+ *
+ */
+static void pcapng_add_interface(pcapng_t *ng, u_int32_t len) {
+
+  pcapng_interface_t *iface = NULL;
+  u_int32_t pos = 16;   // Options
+  u_int16_t code, opt_len;
+  u_int8_t tsresol;
+  int i;
+
+  if (ng->if_count == ng->if_alloc) {
+    ng->if_alloc = ng->if_alloc ? ng->if_alloc * 2 : 4;
+    if ((ng->interfaces = realloc(ng->interfaces, ng->if_alloc * sizeof(pcapng_interface_t))) == NULL)
+      error("Cannot malloc");
+  }
+
+  iface = &ng->interfaces[ng->if_count++];
+  iface->linktype = (len >= 20) ? ng_u16(ng, ng->block + 8) : 0;
+  iface->ts_units = 1000000;
+
+  while (pos + 4 <= len - 4) {
+    code = ng_u16(ng, ng->block + pos);
+    opt_len = ng_u16(ng, ng->block + pos + 2);
+    if (code == PCAPNG_OPT_ENDOFOPT || pos + 4 + opt_len > len - 4)
+      break;
+    if (code == PCAPNG_OPT_IF_TSRESOL && opt_len >= 1) {
+      tsresol = ng->block[pos + 4];
+      iface->ts_units = 1;
+      for (i=0;i<(tsresol & 0x7f) && i<63;i++)
+        iface->ts_units *= (tsresol & 0x80) ? 2 : 10;
+    }
+    pos += 4 + PCAPNG_PAD4(opt_len);
+  }
+}
+
+/*
+ * Give Enhanced Packet Blocks of Ethernet interfaces to callback, copy other blocks to output
+ * Returns the number of packets given to callback
+ *
+ */
+int pcapng_dispatch(pcapng_t *ng, pcap_handler callback, u_char *user) {
+
+  struct pcap_pkthdr pkthdr;
+  pcapng_interface_t *iface = NULL;
+  u_int32_t type, len, if_id;
+  u_int64_t ts;
+  int count = 0;
+  int rc;
+
+  while ((rc = pcapng_read_block(ng, &type, &len)) == 1) {
+
+    switch (type) {
+
+      case PCAPNG_MAGIC:
+        // Interface ids are local to a section
+        ng->if_count = 0;
+        break;
+
+      case PCAPNG_IDB:
+        pcapng_add_interface(ng, len);
+        break;
+
+      case PCAPNG_EPB:
+        if (len < PCAPNG_EPB_HDRLEN + 4)
+          break;
+        if_id = ng_u32(ng, ng->block + 8);
+        pkthdr.caplen = ng_u32(ng, ng->block + 20);
+        pkthdr.len = ng_u32(ng, ng->block + 24);
+        if (if_id >= ng->if_count || pkthdr.caplen > len - PCAPNG_EPB_HDRLEN - 4)
+          break;
+
+        // Only Ethernet packets can be decapsulated
+        iface = &ng->interfaces[if_id];
+        if (iface->linktype != PCAPNG_LINKTYPE_ETHERNET)
+          break;
+
+        ts = ((u_int64_t) ng_u32(ng, ng->block + 12) << 32) | ng_u32(ng, ng->block + 16);
+        pkthdr.ts.tv_sec = ts / iface->ts_units;
+        pkthdr.ts.tv_usec = (double) (ts % iface->ts_units) * 1000000 / iface->ts_units;
+
+        callback(user, &pkthdr, ng->block + PCAPNG_EPB_HDRLEN);
+        count++;
+        continue;
+
+      default:
+        break;
+    }
+
+    if (fwrite(ng->block, 1, len, ng->out) != len)
+      error("Cannot write output file: %s\n", strerror(errno));
+  }
+
+  if (rc == -1)
+    warnx("truncated or invalid pcapng block, stopping\n");
+
+  return count;
+}
+
+/*
+ * Write the decapsulated packet of the current Enhanced Packet Block. Interface id,
+ * timestamp and options are kept, except the packet hash which no longer applies.
+ *
+ */
+void pcapng_write_packet(pcapng_t *ng, const pcap_hdr *pkthdr, const struct iovec *iov, int iovcnt) {
+
+  u_int32_t in_len = ng_u32(ng, ng->block + 4);
+  u_int32_t pos = PCAPNG_EPB_HDRLEN + PCAPNG_PAD4(ng_u32(ng, ng->block + 20));
+  u_int32_t out_len = PCAPNG_EPB_HDRLEN;
+  u_int16_t code, opt_len;
+  u_char *dst = ng->out_block + PCAPNG_EPB_HDRLEN;
+  int i;
+
+  // Block type, interface id and timestamp
+  memcpy(ng->out_block, ng->block, 20);
+  ng_put_u32(ng, ng->out_block + 20, pkthdr->caplen);
+  ng_put_u32(ng, ng->out_block + 24, pkthdr->len);
+
+  // Packet data gathered from iov, which may point into the source block
+  for (i=0;i<iovcnt;i++) {
+    memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+    dst += iov[i].iov_len;
+  }
+  memset(ng->out_block + out_len + pkthdr->caplen, 0, PCAPNG_PAD4(pkthdr->caplen) - pkthdr->caplen);
+  out_len += PCAPNG_PAD4(pkthdr->caplen);
+
+  while (pos + 4 <= in_len - 4) {
+    code = ng_u16(ng, ng->block + pos);
+    opt_len = ng_u16(ng, ng->block + pos + 2);
+    if (pos + 4 + PCAPNG_PAD4(opt_len) > in_len - 4)
+      break;
+    if (code != PCAPNG_OPT_EPB_HASH) {
+      memcpy(ng->out_block + out_len, ng->block + pos, 4 + PCAPNG_PAD4(opt_len));
+      out_len += 4 + PCAPNG_PAD4(opt_len);
+    }
+    if (code == PCAPNG_OPT_ENDOFOPT)
+      break;
+    pos += 4 + PCAPNG_PAD4(opt_len);
+  }
+
+  out_len += 4;
+  ng_put_u32(ng, ng->out_block + 4, out_len);
+  ng_put_u32(ng, ng->out_block + out_len - 4, out_len);
+
+  if (fwrite(ng->out_block, 1, out_len, ng->out) != out_len)
+    error("Cannot write output file: %s\n", strerror(errno));
+}
+
+void pcapng_close(pcapng_t *ng) {
+
+  if (ng->out != stdout)
+    fclose(ng->out);
+  else
+    fflush(ng->out);
+  if (ng->in != stdin)
+    fclose(ng->in);
+  free(ng->block);
+  free(ng->out_block);
+  free(ng->interfaces);
+}
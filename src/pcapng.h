@@ -0,0 +1,62 @@
+/*
+  Copyright (c) 2012-2016 Loïc Pefferkorn <loic-ipdecap@loicp.eu>
+  ipdecap [http://loicpefferkorn.net/ipdecap]
+
+  This file is part of ipdecap.
+
+  Ipdecap is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Ipdecap is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ipdecap.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Streaming pcapng reader and writer: blocks are read one at a time, Enhanced Packet
+ * Blocks of Ethernet interfaces are given to the callback and rewritten with the
+ * decapsulated packet. All the other blocks (Section Header, Interface Description,
+ * statistics, name resolution, ...) are copied unchanged to the output.
+ */
+
+#define PCAPNG_MAGIC            0x0a0d0d0a    // Section Header Block type
+#define PCAPNG_BYTE_ORDER       0x1a2b3c4d
+#define PCAPNG_IDB              0x00000001
+#define PCAPNG_EPB              0x00000006
+#define PCAPNG_MAX_BLOCK        (16*1024*1024)
+#define PCAPNG_EPB_HDRLEN       28            // Block type to original length
+#define PCAPNG_LINKTYPE_ETHERNET 1
+#define PCAPNG_OPT_ENDOFOPT     0
+#define PCAPNG_OPT_IF_TSRESOL   9
+#define PCAPNG_OPT_EPB_HASH     3
+
+#define PCAPNG_PAD4(len)        (((len) + 3) & ~3U)
+
+typedef struct pcapng_interface_t {
+  u_int16_t linktype;
+  u_int64_t ts_units;           // Timestamp units per second (if_tsresol)
+} pcapng_interface_t;
+
+typedef struct pcapng_t {
+  FILE *in;
+  FILE *out;
+  bool swapped;                 // Current section is in the other byte order
+  u_char *block;                // Current block
+  u_char *out_block;            // Rewritten Enhanced Packet Block
+  u_int32_t block_alloc;
+  pcapng_interface_t *interfaces;
+  u_int32_t if_count;
+  u_int32_t if_alloc;
+} pcapng_t;
+
+bool pcapng_probe(FILE *in, const char *filename);
+void pcapng_open(pcapng_t *ng, FILE *in, FILE *out);
+int pcapng_dispatch(pcapng_t *ng, pcap_handler callback, u_char *user);
+void pcapng_write_packet(pcapng_t *ng, const pcap_hdr *pkthdr, const struct iovec *iov, int iovcnt);
+void pcapng_close(pcapng_t *ng);
@@ -0,0 +1,400 @@
+/*
+  Copyright (c) 2012-2016 Loïc Pefferkorn <loic-ipdecap@loicp.eu>
+  ipdecap [http://loicpefferkorn.net/ipdecap]
+
+  This file is part of ipdecap.
+
+  Ipdecap is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Ipdecap is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ipdecap.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <pcap/pcap.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <net/ethernet.h>
+
+#include "config.h"
+#include "ipdecap.h"
+#include "pipeline.h"
+#include "probes.h"
+
+static pipeline_worker_t *workers = NULL;
+static int worker_count = 0;
+static pthread_t writer_thread;
+static decap_func_t decap_func = NULL;
+static write_func_t write_func = NULL;
+static thread_func_t worker_init_func = NULL;
+static thread_func_t worker_cleanup_func = NULL;
+static thread_func_t batch_done_func = NULL;
+static thread_func_t output_flush_func = NULL;
+
+// Batch being filled by the reader, and its sequence number. The lock lets the
+// time based flush policy thread hand a partial batch to the decapsulation threads,
+// it is only taken once pipeline_share() was called.
+static packet_batch_t *current_batch = NULL;
+static unsigned long batch_seq = 0;
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool batch_shared = false;
+
+/*
+ * Initialize an empty ring
+ *
+ */
+void ring_init(ring_t *ring) {
+
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  atomic_init(&ring->waiters, 0);
+  pthread_mutex_init(&ring->lock, NULL);
+  pthread_cond_init(&ring->cond, NULL);
+}
+
+/*
+ * Wait until the ring tail (full) or head (empty) moves from value, spinning a while then sleeping:
+ * idle threads of a live capture or of a slow input do not use a whole processor
+ *
+ */
+static void ring_wait(ring_t *ring, _Atomic unsigned int *index, unsigned int value) {
+
+  int spins;
+
+  for (spins = 0; spins < PIPELINE_RING_SPINS; spins++) {
+    if (atomic_load_explicit(index, memory_order_acquire) != value)
+      return;
+    sched_yield();
+  }
+
+  pthread_mutex_lock(&ring->lock);
+  // Sequentially consistent with ring_wake(): either it sees the waiter, or the index has moved
+  atomic_fetch_add(&ring->waiters, 1);
+  while (atomic_load(index) == value)
+    pthread_cond_wait(&ring->cond, &ring->lock);
+  atomic_fetch_sub(&ring->waiters, 1);
+  pthread_mutex_unlock(&ring->lock);
+}
+
+/*
+ * Wake up the other side of the ring if it sleeps, after head or tail moved
+ *
+ */
+static void ring_wake(ring_t *ring) {
+
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&ring->waiters, memory_order_relaxed) == 0)
+    return;
+
+  pthread_mutex_lock(&ring->lock);
+  pthread_cond_broadcast(&ring->cond);
+  pthread_mutex_unlock(&ring->lock);
+}
+
+/*
+ * Push an item to a ring, wait if it is full
+ *
+ */
+void ring_push(ring_t *ring, void *item) {
+
+  unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+  if (tail - head == PIPELINE_RING_SIZE)
+    ring_wait(ring, &ring->head, head);
+
+  ring->items[tail & (PIPELINE_RING_SIZE - 1)] = item;
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+  ring_wake(ring);
+}
+
+/*
+ * Pop an item from a ring, wait if it is empty
+ *
+ */
+void * ring_pop(ring_t *ring) {
+
+  void *item = NULL;
+  unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+  if (atomic_load_explicit(&ring->tail, memory_order_acquire) == head)
+    ring_wait(ring, &ring->tail, head);
+
+  item = ring->items[head & (PIPELINE_RING_SIZE - 1)];
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  ring_wake(ring);
+  return item;
+}
+
+/*
+ * Number of items in a ring, only meaningful for its consumer
+ *
+ */
+unsigned int ring_count(ring_t *ring) {
+
+  return atomic_load_explicit(&ring->tail, memory_order_acquire)
+    - atomic_load_explicit(&ring->head, memory_order_relaxed);
+}
+
+/*
+ * Decapsulation thread: decapsulate each packet of the batches given by the reader.
+ * Decapsulated packets are stored one after the other in out_data, the buffer has
+ * MAXIMUM_SNAPLEN spare bytes so the last packet has as much room as in single thread mode.
+ * Only the ethernet header of a packet left in in_data (out_slice) is stored, in_data is
+ * kept until the batch is written.
+ *
+ */
+void * pipeline_worker(void *arg) {
+
+  pipeline_worker_t *w = arg;
+  packet_batch_t *batch = NULL;
+  batch_packet_t *pkt = NULL;
+  u_int32_t out_used;
+  int i;
+
+  if (worker_init_func != NULL)
+    worker_init_func();
+
+  while ((batch = ring_pop(&w->todo)) != NULL) {
+
+    out_used = 0;
+    for (i=0;i<batch->count;i++) {
+      pkt = &batch->packets[i];
+      pkt->out_offset = out_used;
+      pkt->write = decap_func(&pkt->in_hdr, batch->in_data + pkt->in_offset,
+                              &pkt->out_hdr, batch->out_data + out_used, &pkt->out_slice, pkt->num);
+      if (pkt->write == 1)
+        out_used += pkt->out_slice.data != NULL ? sizeof(struct ether_header) : pkt->out_hdr.caplen;
+    }
+
+    // Packets whose processing was deferred, to be done by batch, are finished before writing
+    if (batch_done_func != NULL)
+      batch_done_func();
+
+    ring_push(&w->done, batch);
+  }
+
+  // Tell the writer there is nothing more from this thread
+  ring_push(&w->done, NULL);
+
+  if (worker_cleanup_func != NULL)
+    worker_cleanup_func();
+
+  return NULL;
+}
+
+/*
+ * Writer thread: write decapsulated packets in input order, and give batches back to the reader
+ *
+ */
+void * pipeline_writer(void *arg) {
+
+  pipeline_worker_t *w = NULL;
+  packet_batch_t *batch = NULL;
+  unsigned long seq;
+  int i;
+
+  (void) arg;
+
+  for (seq = 0; ; seq++) {
+    w = &workers[seq % worker_count];
+
+    // Batches are given round-robin, the first end marker found in that order means all were written
+    if ((batch = ring_pop(&w->done)) == NULL)
+      break;
+
+    for (i=0;i<batch->count;i++) {
+      if (batch->packets[i].write == 1) {
+        PROBE_PACKET_WRITE(batch->packets[i].num, batch->packets[i].out_hdr.caplen, batch->packets[i].out_hdr.len);
+        write_func(&batch->packets[i].out_hdr, batch->out_data + batch->packets[i].out_offset,
+                   &batch->packets[i].out_slice);
+      }
+    }
+
+    if (batch->flush && output_flush_func != NULL)
+      output_flush_func();
+
+    batch->count = 0;
+    batch->in_used = 0;
+    batch->flush = false;
+    ring_push(&w->free, batch);
+  }
+
+  return NULL;
+}
+
+/*
+ * Allocate batches and start the decapsulation and writer threads
+ *
+ */
+void pipeline_start(int count, decap_func_t decap_fn, write_func_t write_fn,
+                    thread_func_t worker_init, thread_func_t worker_cleanup, thread_func_t batch_done,
+                    thread_func_t output_flush) {
+
+  int i, j;
+  packet_batch_t *batch = NULL;
+
+  worker_count = count;
+  decap_func = decap_fn;
+  write_func = write_fn;
+  worker_init_func = worker_init;
+  worker_cleanup_func = worker_cleanup;
+  batch_done_func = batch_done;
+  output_flush_func = output_flush;
+
+  MALLOC(workers, worker_count, pipeline_worker_t);
+  memset(workers, 0, worker_count * sizeof(pipeline_worker_t));
+
+  for (i=0;i<worker_count;i++) {
+    ring_init(&workers[i].todo);
+    ring_init(&workers[i].done);
+    ring_init(&workers[i].free);
+
+    for (j=0;j<PIPELINE_WORKER_BATCHES;j++) {
+      MALLOC(batch, 1, packet_batch_t);
+      MALLOC(batch->in_data, PIPELINE_BATCH_BYTES, u_char);
+      MALLOC(batch->out_data, PIPELINE_BATCH_BYTES + MAXIMUM_SNAPLEN, u_char);
+      batch->count = 0;
+      batch->in_used = 0;
+      batch->flush = false;
+      workers[i].batches[j] = batch;
+      ring_push(&workers[i].free, batch);
+    }
+
+    if (pthread_create(&workers[i].thread, NULL, pipeline_worker, &workers[i]) != 0)
+      error("Cannot create decapsulation thread\n");
+  }
+
+  if (pthread_create(&writer_thread, NULL, pipeline_writer, NULL) != 0)
+    error("Cannot create writer thread\n");
+
+  batch_seq = 0;
+  current_batch = NULL;
+  batch_shared = false;
+}
+
+/*
+ * Let another thread than the reader call pipeline_flush(), from now on
+ *
+ */
+void pipeline_share(void) {
+
+  batch_shared = true;
+}
+
+/*
+ * Give the current batch to its decapsulation thread, batch_lock held if shared
+ *
+ */
+static void pipeline_push(void) {
+
+  if (current_batch == NULL)
+    return;
+
+  ring_push(&workers[batch_seq % worker_count].todo, current_batch);
+  current_batch = NULL;
+  batch_seq++;
+}
+
+/*
+ * Give the current batch to its decapsulation thread without waiting for it to be full, for flush
+ * policies and live capture. With output, the writer thread also flushes the output once it is
+ * written: an empty batch is sent if there is no current one, to flush after the previous ones.
+ * Can be called by another thread than the reader once pipeline_share() was called.
+ *
+ */
+void pipeline_flush(bool output) {
+
+  if (batch_shared)
+    pthread_mutex_lock(&batch_lock);
+
+  if (current_batch == NULL && output)
+    current_batch = ring_pop(&workers[batch_seq % worker_count].free);
+
+  if (current_batch != NULL) {
+    current_batch->flush = output;
+    pipeline_push();
+  }
+
+  if (batch_shared)
+    pthread_mutex_unlock(&batch_lock);
+}
+
+/*
+ * Reader side: copy a packet into the current batch
+ *
+ */
+void pipeline_submit(const pcap_hdr *pkthdr, const u_char *bytes, int packet_num) {
+
+  batch_packet_t *pkt = NULL;
+  u_int32_t caplen = pkthdr->caplen;
+
+  // Oversized packets are only given for decap_func to report them
+  if (caplen > MAXIMUM_SNAPLEN)
+    caplen = 0;
+
+  if (batch_shared)
+    pthread_mutex_lock(&batch_lock);
+
+  if (current_batch != NULL
+    && (current_batch->count == PIPELINE_BATCH_PACKETS
+      || current_batch->in_used + caplen > PIPELINE_BATCH_BYTES))
+    pipeline_push();
+
+  if (current_batch == NULL)
+    current_batch = ring_pop(&workers[batch_seq % worker_count].free);
+
+  pkt = &current_batch->packets[current_batch->count++];
+  pkt->in_hdr = *pkthdr;
+  pkt->in_offset = current_batch->in_used;
+  pkt->num = packet_num;
+  memcpy(current_batch->in_data + current_batch->in_used, bytes, caplen);
+  current_batch->in_used += caplen;
+
+  if (batch_shared)
+    pthread_mutex_unlock(&batch_lock);
+}
+
+/*
+ * Wait for all packets to be written, then stop threads and free batches
+ *
+ */
+void pipeline_finish(void) {
+
+  int i, j;
+
+  pipeline_flush(false);
+
+  for (i=0;i<worker_count;i++)
+    ring_push(&workers[i].todo, NULL);
+
+  for (i=0;i<worker_count;i++)
+    pthread_join(workers[i].thread, NULL);
+  pthread_join(writer_thread, NULL);
+
+  for (i=0;i<worker_count;i++) {
+    for (j=0;j<PIPELINE_WORKER_BATCHES;j++) {
+      free(workers[i].batches[j]->in_data);
+      free(workers[i].batches[j]->out_data);
+      free(workers[i].batches[j]);
+    }
+  }
+
+  free(workers);
+  workers = NULL;
+}
@@ -0,0 +1,89 @@
+/*
+  Copyright (c) 2012-2016 Loïc Pefferkorn <loic-ipdecap@loicp.eu>
+  ipdecap [http://loicpefferkorn.net/ipdecap]
+
+  This file is part of ipdecap.
+
+  Ipdecap is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Ipdecap is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ipdecap.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Multi-threaded decapsulation: the reader (pcap_dispatch callback) copies packets
+ * into batches, given round-robin to the decapsulation threads through lock-free
+ * single producer/single consumer rings. The writer thread takes decapsulated batches
+ * back in the same round-robin order, so packets are written in their input order.
+ */
+
+#define PIPELINE_MAX_WORKERS      256
+#define PIPELINE_BATCH_PACKETS    1024          // Maximum packets in a batch
+#define PIPELINE_BATCH_BYTES      (1024*1024)   // Maximum captured bytes in a batch
+#define PIPELINE_WORKER_BATCHES   4             // Batches owned by each decapsulation thread
+#define PIPELINE_RING_SIZE        8             // Power of 2, greater than PIPELINE_WORKER_BATCHES
+#define PIPELINE_RING_SPINS       64            // Yields before blocking on an empty or full ring
+
+// Lock-free single producer/single consumer ring of pointers. A side waiting longer than
+// PIPELINE_RING_SPINS sleeps on cond, the other side only locks when waiters is not 0.
+typedef struct ring_t {
+  _Atomic unsigned int head;    // Next item to pop, only written by the consumer
+  _Atomic unsigned int tail;    // Next free item, only written by the producer
+  void *items[PIPELINE_RING_SIZE];
+  _Atomic int waiters;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} ring_t;
+
+typedef struct batch_packet_t {
+  pcap_hdr in_hdr;
+  u_int32_t in_offset;          // Offset of captured bytes in batch in_data
+  pcap_hdr out_hdr;
+  u_int32_t out_offset;         // Offset of decapsulated bytes in batch out_data
+  out_slice_t out_slice;        // Inner packet left in batch in_data, only its ethernet header is in out_data
+  int num;                      // Packet number in input file
+  int write;                    // 1 if decapsulated packet has to be written
+} batch_packet_t;
+
+typedef struct packet_batch_t {
+  int count;
+  u_int32_t in_used;
+  bool flush;                   // Flush the output once the batch is written
+  u_char *in_data;              // PIPELINE_BATCH_BYTES
+  u_char *out_data;             // PIPELINE_BATCH_BYTES + MAXIMUM_SNAPLEN
+  batch_packet_t packets[PIPELINE_BATCH_PACKETS];
+} packet_batch_t;
+
+typedef struct pipeline_worker_t {
+  pthread_t thread;
+  ring_t todo;                  // reader -> worker
+  ring_t done;                  // worker -> writer
+  ring_t free;                  // writer -> reader
+  packet_batch_t *batches[PIPELINE_WORKER_BATCHES];
+} pipeline_worker_t;
+
+typedef int (*decap_func_t)(const pcap_hdr *in_pkthdr, const u_char *in_payload, pcap_hdr *out_pkthdr, u_char *out_payload,
+                            out_slice_t *out_slice, int packet_num);
+typedef void (*write_func_t)(const pcap_hdr *pkthdr, const u_char *payload, const out_slice_t *slice);
+typedef void (*thread_func_t)(void);
+
+void ring_init(ring_t *ring);
+void ring_push(ring_t *ring, void *item);
+void * ring_pop(ring_t *ring);
+unsigned int ring_count(ring_t *ring);
+
+void pipeline_start(int workers, decap_func_t decap_fn, write_func_t write_fn,
+                    thread_func_t worker_init, thread_func_t worker_cleanup, thread_func_t batch_done,
+                    thread_func_t output_flush);
+void pipeline_submit(const pcap_hdr *pkthdr, const u_char *bytes, int packet_num);
+void pipeline_share(void);
+void pipeline_flush(bool output);
+void pipeline_finish(void);
@@ -0,0 +1,56 @@
+/*
+  Copyright (c) 2012-2016 Loïc Pefferkorn <loic-ipdecap@loicp.eu>
+  ipdecap [http://loicpefferkorn.net/ipdecap]
+
+  This file is part of ipdecap.
+
+  Ipdecap is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Ipdecap is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ipdecap.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * USDT static tracepoints of the ipdecap provider, for bpftrace, perf or SystemTap.
+ * With sys/sdt.h, a probe is a nop and a note in the binary, it costs nothing while
+ * no tracer is attached. Without it, probes are compiled out.
+ *
+ *   packet__start   packet number, captured length, original length
+ *   packet__encap   packet number, ethernet type, IP protocol (0 if not IP)
+ *   packet__done    packet number, 1 if written, decapsulated length (final once decrypted if queued)
+ *   sa__lookup      packet number, SPI, 1 if a SA was found
+ *   decrypt__start  packet number, SPI, length to decrypt
+ *   decrypt__done   packet number, SPI, decrypted length, 1 if successful
+ *   packet__write   packet number, captured length, length
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define PROBE_PACKET_START(num, caplen, len)      DTRACE_PROBE3(ipdecap, packet__start, num, caplen, len)
+#define PROBE_PACKET_ENCAP(num, ethertype, proto) DTRACE_PROBE3(ipdecap, packet__encap, num, ethertype, proto)
+#define PROBE_PACKET_DONE(num, write, len)        DTRACE_PROBE3(ipdecap, packet__done, num, write, len)
+#define PROBE_SA_LOOKUP(num, spi, found)          DTRACE_PROBE3(ipdecap, sa__lookup, num, spi, found)
+#define PROBE_DECRYPT_START(num, spi, len)        DTRACE_PROBE3(ipdecap, decrypt__start, num, spi, len)
+#define PROBE_DECRYPT_DONE(num, spi, len, ok)     DTRACE_PROBE4(ipdecap, decrypt__done, num, spi, len, ok)
+#define PROBE_PACKET_WRITE(num, caplen, len)      DTRACE_PROBE3(ipdecap, packet__write, num, caplen, len)
+
+#else
+
+#define PROBE_PACKET_START(num, caplen, len)      do {} while (0)
+#define PROBE_PACKET_ENCAP(num, ethertype, proto) do {} while (0)
+#define PROBE_PACKET_DONE(num, write, len)        do {} while (0)
+#define PROBE_SA_LOOKUP(num, spi, found)          do {} while (0)
+#define PROBE_DECRYPT_START(num, spi, len)        do {} while (0)
+#define PROBE_DECRYPT_DONE(num, spi, len, ok)     do {} while (0)
+#define PROBE_PACKET_WRITE(num, caplen, len)      do {} while (0)
+
+#endif
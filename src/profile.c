@@ -0,0 +1,179 @@
+/*
+  Copyright (c) 2012-2016 Loïc Pefferkorn <loic-ipdecap@loicp.eu>
+  ipdecap [http://loicpefferkorn.net/ipdecap]
+
+  This file is part of ipdecap.
+
+  Ipdecap is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Ipdecap is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ipdecap.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <pcap/pcap.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "config.h"
+#include "ipdecap.h"
+#include "profile.h"
+
+bool profile_enabled = false;
+__thread thread_profile_t *thread_profile = NULL;
+
+// Counters of every thread which measured a stage, kept until they are printed
+static thread_profile_t *profiles = NULL;
+static pthread_mutex_t profiles_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Cycles counter and clock at start, to convert cycles to nanoseconds
+static u_int64_t start_cycles;
+static struct timespec start_time;
+
+static const char *stage_names[PROFILE_STAGES] = {
+  [PROFILE_READ] = "read",
+  [PROFILE_FILTER] = "filter",
+  [PROFILE_SUBMIT] = "submit",
+  [PROFILE_DECAP] = "decap",
+  [PROFILE_ESP_LOOKUP] = "esp lookup",
+  [PROFILE_ESP_ICV] = "esp icv",
+  [PROFILE_ESP_DECRYPT] = "esp decrypt",
+  [PROFILE_WRITE] = "write"
+};
+
+void profile_start() {
+
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+  start_cycles = profile_cycles();
+  profile_enabled = true;
+}
+
+/*
+ * Counters of the calling thread, allocated the first time it measures a stage
+ *
+ */
+thread_profile_t * profile_thread_register() {
+
+  thread_profile_t *p = NULL;
+
+  MALLOC(p, 1, thread_profile_t);
+  memset(p, 0, sizeof(thread_profile_t));
+
+  pthread_mutex_lock(&profiles_lock);
+  p->next = profiles;
+  profiles = p;
+  pthread_mutex_unlock(&profiles_lock);
+
+  return p;
+}
+
+/*
+ * Duration in nanoseconds of the upper bound of the first histogram bucket
+ * reaching fraction of the calls, at most the longest call
+ *
+ */
+static double percentile(const stage_profile_t *s, double fraction, double ns_per_cycle) {
+
+  unsigned long count = 0;
+  int i;
+
+  for (i=0;i<PROFILE_BUCKETS;i++) {
+    count += s->histogram[i];
+    if (count >= fraction * s->calls)
+      break;
+  }
+
+  if (i == 0)
+    return 0;
+
+  return (i >= 64 || (1ULL << i) > s->max ? (double) s->max : (double) (1ULL << i)) * ns_per_cycle;
+}
+
+/*
+ * Print the stages of all threads: total time, share, average and percentiles, then their
+ * latency histograms. Called once all threads have ended.
+ *
+ */
+void profile_print(FILE *fp) {
+
+  stage_profile_t total[PROFILE_STAGES];
+  thread_profile_t *p = NULL, *next = NULL;
+  struct timespec end_time;
+  u_int64_t cycles, all = 0;
+  double elapsed_ns, ns_per_cycle, lo, hi;
+  int i, j;
+
+  cycles = profile_cycles() - start_cycles;
+  clock_gettime(CLOCK_MONOTONIC, &end_time);
+  elapsed_ns = (end_time.tv_sec - start_time.tv_sec) * 1e9 + (end_time.tv_nsec - start_time.tv_nsec);
+  ns_per_cycle = cycles > 0 ? elapsed_ns / cycles : 1;
+
+  memset(total, 0, sizeof(total));
+  for (p = profiles; p != NULL; p = p->next) {
+    for (i=0;i<PROFILE_STAGES;i++) {
+      total[i].calls += p->stages[i].calls;
+      total[i].cycles += p->stages[i].cycles;
+      if (p->stages[i].max > total[i].max)
+        total[i].max = p->stages[i].max;
+      for (j=0;j<PROFILE_BUCKETS;j++)
+        total[i].histogram[j] += p->stages[i].histogram[j];
+    }
+  }
+
+  for (i=0;i<PROFILE_STAGES;i++)
+    all += total[i].cycles;
+
+#ifdef PROFILE_TSC
+  fprintf(fp, "Profile: %.3f s elapsed, time stamp counter at %.3f GHz\n", elapsed_ns / 1e9, 1 / ns_per_cycle);
+#else
+  fprintf(fp, "Profile: %.3f s elapsed, monotonic clock\n", elapsed_ns / 1e9);
+#endif
+  fprintf(fp, "%-12s %12s %12s %7s %10s %10s %10s %10s %12s\n",
+    "stage", "calls", "total ms", "share", "avg ns", "p50 ns", "p90 ns", "p99 ns", "max ns");
+
+  for (i=0;i<PROFILE_STAGES;i++) {
+    if (total[i].calls == 0)
+      continue;
+    fprintf(fp, "%-12s %12lu %12.3f %6.1f%% %10.1f %10.0f %10.0f %10.0f %12.0f\n",
+      stage_names[i], total[i].calls, total[i].cycles * ns_per_cycle / 1e6,
+      all > 0 ? 100.0 * total[i].cycles / all : 0,
+      total[i].cycles * ns_per_cycle / total[i].calls,
+      percentile(&total[i], 0.5, ns_per_cycle), percentile(&total[i], 0.9, ns_per_cycle),
+      percentile(&total[i], 0.99, ns_per_cycle), total[i].max * ns_per_cycle);
+  }
+
+  fprintf(fp, "Latency histograms, ns: calls\n");
+  for (i=0;i<PROFILE_STAGES;i++) {
+    if (total[i].calls == 0)
+      continue;
+    fprintf(fp, "%-12s", stage_names[i]);
+    for (j=0;j<PROFILE_BUCKETS;j++) {
+      if (total[i].histogram[j] == 0)
+        continue;
+      lo = j == 0 ? 0 : (1ULL << (j - 1)) * ns_per_cycle;
+      hi = j == 0 ? 0 : (j >= 64 ? (double) total[i].max : (double) (1ULL << j)) * ns_per_cycle;
+      fprintf(fp, " %.0f-%.0f: %lu", lo, hi, total[i].histogram[j]);
+    }
+    fprintf(fp, "\n");
+  }
+
+  for (p = profiles; p != NULL; p = next) {
+    next = p->next;
+    free(p);
+  }
+  profiles = NULL;
+}
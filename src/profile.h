@@ -0,0 +1,120 @@
+/*
+  Copyright (c) 2012-2016 Loïc Pefferkorn <loic-ipdecap@loicp.eu>
+  ipdecap [http://loicpefferkorn.net/ipdecap]
+
+  This file is part of ipdecap.
+
+  Ipdecap is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Ipdecap is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ipdecap.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * --profile: time spent in each processing stage, measured with the time stamp
+ * counter on x86, or the monotonic clock. Each thread has its own counters,
+ * added together when they are printed. Without --profile, a stage boundary
+ * only costs the test of profile_enabled.
+ */
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && defined(HAVE_X86INTRIN_H)
+#define PROFILE_TSC
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+typedef enum profile_stage_t {
+  PROFILE_READ,           // Between two packets given by the reader: libpcap, mmap or capture ring
+  PROFILE_FILTER,         // BPF filter
+  PROFILE_SUBMIT,         // Copy to a decapsulation thread batch
+  PROFILE_DECAP,          // Headers parsing and copy, without the ESP stages
+  PROFILE_ESP_LOOKUP,     // Security association lookup
+  PROFILE_ESP_ICV,        // HMAC verification
+  PROFILE_ESP_DECRYPT,    // Decryption, AEAD tag verification
+  PROFILE_WRITE,          // pcap_dump() or output buffer copy
+  PROFILE_STAGES
+} profile_stage_t;
+
+#define PROFILE_BUCKETS   65    // Latency histogram: bucket n counts durations of [2^(n-1), 2^n[ cycles, 0 for none
+
+typedef struct stage_profile_t {
+  unsigned long calls;
+  u_int64_t cycles;
+  u_int64_t max;
+  unsigned long histogram[PROFILE_BUCKETS];
+} stage_profile_t;
+
+typedef struct thread_profile_t {
+  stage_profile_t stages[PROFILE_STAGES];
+  u_int64_t nested;       // Cycles of all stages ended, subtracted from the stages enclosing them
+  struct thread_profile_t *next;
+} thread_profile_t;
+
+// Start of a stage
+typedef struct profile_mark_t {
+  u_int64_t start;
+  u_int64_t nested;
+} profile_mark_t;
+
+extern bool profile_enabled;
+extern __thread thread_profile_t *thread_profile;
+
+void profile_start(void);
+thread_profile_t * profile_thread_register(void);
+void profile_print(FILE *fp);
+
+static inline u_int64_t profile_cycles(void) {
+
+#ifdef PROFILE_TSC
+  return __rdtsc();
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static inline void profile_begin(profile_mark_t *mark) {
+
+  if (thread_profile == NULL)
+    thread_profile = profile_thread_register();
+
+  mark->nested = thread_profile->nested;
+  mark->start = profile_cycles();
+}
+
+/*
+ * Count the cycles since the mark in stage, without the ones of the stages ended meanwhile
+ *
+ */
+static inline void profile_end(profile_mark_t *mark, profile_stage_t stage) {
+
+  stage_profile_t *s = &thread_profile->stages[stage];
+  u_int64_t total = profile_cycles() - mark->start;
+  u_int64_t self = total - (thread_profile->nested - mark->nested);
+
+  // Counters of other processors, or nested stages rounding
+  if ((int64_t) self < 0)
+    self = 0;
+
+  s->calls++;
+  s->cycles += self;
+  if (self > s->max)
+    s->max = self;
+  s->histogram[self == 0 ? 0 : 64 - __builtin_clzll(self)]++;
+
+  thread_profile->nested = mark->nested + total;
+}
+
+#define PROFILE_BEGIN(mark)       do { if (profile_enabled) profile_begin(&(mark)); } while (0)
+#define PROFILE_END(mark, stage)  do { if (profile_enabled) profile_end(&(mark), (stage)); } while (0)
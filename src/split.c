@@ -0,0 +1,377 @@
+/*
+  Copyright (c) 2012-2016 Loïc Pefferkorn <loic-ipdecap@loicp.eu>
+  ipdecap [http://loicpefferkorn.net/ipdecap]
+
+  This file is part of ipdecap.
+
+  Ipdecap is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Ipdecap is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ipdecap.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+#include <pthread.h>
+#include <pcap/pcap.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include "config.h"
+#include "ipdecap.h"
+#include "split.h"
+#include "writer.h"
+#include "stats.h"
+#include "profile.h"
+#include "probes.h"
+
+u_int32_t split_u32(const u_char *ptr, bool swapped) {
+
+  u_int32_t v;
+  memcpy(&v, ptr, sizeof(v));
+  return swapped ? __builtin_bswap32(v) : v;
+}
+
+/*
+ * Check if a chain of sane record headers starts at offset in buf.
+ * buf holds buf_len bytes read from file offset offset.
+ *
+ */
+bool split_records_valid(const split_file_t *info, const u_char *buf, size_t buf_len, off_t offset) {
+
+  size_t pos = 0;
+  int count = 0;
+  u_int32_t ts_sec, ts_usec, caplen, len, prev_sec = 0;
+
+  while (count < SPLIT_CHECK_RECORDS) {
+
+    // Last record ends exactly at the end of file
+    if (offset + (off_t) pos == info->size)
+      return count > 0;
+
+    // Not enough data read to check more records
+    if (pos + SPLIT_RECORD_HDRLEN > buf_len)
+      return count > 0;
+
+    ts_sec = split_u32(buf + pos, info->swapped);
+    ts_usec = split_u32(buf + pos + 4, info->swapped);
+    caplen = split_u32(buf + pos + 8, info->swapped);
+    len = split_u32(buf + pos + 12, info->swapped);
+
+    // Zero filled payloads must not look like empty records
+    if (caplen == 0 || caplen > info->snaplen || caplen > len || len > SPLIT_MAX_CAPLEN
+      || ts_usec >= info->usec_max || ts_sec + SPLIT_MAX_TS_DELTA < info->first_sec)
+      return false;
+
+    if (count > 0 && (ts_sec > prev_sec + SPLIT_MAX_TS_DELTA || ts_sec + SPLIT_MAX_TS_DELTA < prev_sec))
+      return false;
+
+    if (offset + (off_t) (pos + SPLIT_RECORD_HDRLEN + caplen) > info->size)
+      return false;
+
+    prev_sec = ts_sec;
+    pos += SPLIT_RECORD_HDRLEN + caplen;
+    count++;
+  }
+  return true;
+}
+
+/*
+ * Find the first record boundary at or after target, -1 if none
+ *
+ */
+off_t split_find_boundary(const split_file_t *info, off_t target) {
+
+  u_char *buf = NULL;
+  size_t buf_size, search;
+  ssize_t rc;
+  size_t i;
+  off_t boundary = -1;
+
+  // A record starts in any window of the largest record size, and is followed by SPLIT_CHECK_RECORDS records
+  search = SPLIT_RECORD_HDRLEN + SPLIT_MAX_CAPLEN;
+  buf_size = search * (SPLIT_CHECK_RECORDS + 1);
+  MALLOC(buf, buf_size, u_char);
+
+  if ((rc = pread(info->fd, buf, buf_size, target)) < 0)
+    error("Cannot read input file: %s\n", strerror(errno));
+
+  for (i=0;i<search && i<(size_t) rc;i++) {
+    if (split_records_valid(info, buf + i, rc - i, target + i)) {
+      boundary = target + i;
+      break;
+    }
+  }
+
+  free(buf);
+  return boundary;
+}
+
+/*
+ * Decapsulate the records of one part, with the same processing as handle_packets().
+ * Packet numbers of verbose messages and tracepoints restart from 0 in each part.
+ *
+ */
+void * split_worker(void *arg) {
+
+  split_part_t *part = arg;
+  char errbuf[PCAP_ERRBUF_SIZE];
+  FILE *in = NULL;
+  FILE *out_file = NULL;
+  pcap_t *reader = NULL;
+  pcap_dumper_t *dumper = NULL;
+  struct pcap_pkthdr *pkthdr = NULL;
+  const u_char *bytes = NULL;
+  out_packet_t out;
+  out_slice_t slice;
+  struct iovec iov[OUT_IOV_MAX];
+  int iovcnt;
+  off_t pos;
+  profile_mark_t mark = { 0, 0 };
+  int packet_num = 0;
+  int rc;
+
+  if ((in = fopen(part->input_file, "rb")) == NULL)
+    error("Cannot open input file %s: %s\n", part->input_file, strerror(errno));
+
+  // libpcap reads the file header, then records are read from where the FILE is
+  if ((reader = pcap_fopen_offline(in, errbuf)) == NULL)
+    error("Cannot open input file %s: %s\n", part->input_file, errbuf);
+
+  if (fseeko(in, part->start, SEEK_SET) != 0)
+    error("Cannot seek input file %s: %s\n", part->input_file, strerror(errno));
+
+  if (part->segment == NULL)
+    out_file = fopen(part->output_file, "wb");
+  else
+    out_file = fopen(part->segment, "wb");
+
+  if (out_file == NULL || (dumper = pcap_dump_fopen(part->dead, out_file)) == NULL)
+    error("Cannot open output file for part at offset %lld\n", (long long) part->start);
+
+  flows_thread_init();
+  MALLOC(out.payload, MAXIMUM_SNAPLEN, u_char);
+
+  pos = part->start;
+  while (pos < part->end && pcap_next_ex(reader, &pkthdr, &bytes) == 1) {
+
+    pos += SPLIT_RECORD_HDRLEN + pkthdr->caplen;
+
+    if (part->bpf != NULL) {
+      PROFILE_BEGIN(mark);
+      rc = pcap_offline_filter(part->bpf, pkthdr, bytes);
+      PROFILE_END(mark, PROFILE_FILTER);
+
+      if (rc == 0) {
+        stats.filtered++;
+        verbose("Packet %i of part at offset %lld does not match bpf filter\n", packet_num, (long long) part->start);
+        packet_num++;
+        continue;
+      }
+    }
+
+    if (decap_packet(pkthdr, bytes, &out.hdr, out.payload, &slice, packet_num) == 1) {
+      PROBE_PACKET_WRITE(packet_num, out.hdr.caplen, out.hdr.len);
+      PROFILE_BEGIN(mark);
+      iovcnt = out_packet_iov(&out.hdr, out.payload, &slice, iov);
+      writer_pcap_dump(dumper, &out.hdr, iov, iovcnt);
+      PROFILE_END(mark, PROFILE_WRITE);
+    }
+
+    packet_num++;
+  }
+
+  // Checked by split_process(): a boundary found inside a record would not be reached
+  part->stop = pos;
+
+  free(out.payload);
+  flows_thread_cleanup();
+  pcap_dump_close(dumper);
+  pcap_close(reader);
+  return NULL;
+}
+
+/*
+ * Append a segment, without its file header, to the output file
+ *
+ */
+void split_append(int out_fd, off_t *out_offset, const char *segment) {
+
+  int fd;
+  off_t in_offset = SPLIT_FILE_HDRLEN;
+  ssize_t rc;
+  char *buf = NULL;
+
+  if ((fd = open(segment, O_RDONLY)) == -1)
+    error("Cannot open segment %s: %s\n", segment, strerror(errno));
+
+#ifdef HAVE_COPY_FILE_RANGE
+  // Data stays in the kernel (and may even not be copied, depending on the file system)
+  while ((rc = copy_file_range(fd, &in_offset, out_fd, out_offset, SPLIT_COPY_SIZE, 0)) > 0)
+    ;
+
+  if (rc == 0) {
+    close(fd);
+    return;
+  }
+
+  if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)
+    error("Cannot append segment %s: %s\n", segment, strerror(errno));
+#endif
+
+  MALLOC(buf, SPLIT_COPY_SIZE, char);
+  while ((rc = pread(fd, buf, SPLIT_COPY_SIZE, in_offset)) > 0) {
+    if (pwrite(out_fd, buf, rc, *out_offset) != rc)
+      error("Cannot append segment %s: %s\n", segment, strerror(errno));
+    in_offset += rc;
+    *out_offset += rc;
+  }
+
+  if (rc < 0)
+    error("Cannot read segment %s: %s\n", segment, strerror(errno));
+
+  free(buf);
+  close(fd);
+}
+
+/*
+ * Decapsulate input_file in parts parallel parts.
+ * Returns -1 if the input file cannot be split (not a classic pcap file), nothing is written then.
+ *
+ */
+int split_process(const char *input_file, const char *output_file, int parts, struct bpf_program *bpf, pcap_t *dead) {
+
+  split_file_t info;
+  split_part_t *part = NULL;
+  u_char hdr[SPLIT_FILE_HDRLEN + SPLIT_RECORD_HDRLEN];
+  struct stat st;
+  u_int32_t magic;
+  off_t boundary, out_offset;
+  int i, j, count, fd, out_fd;
+  size_t name_len;
+
+  if ((info.fd = open(input_file, O_RDONLY)) == -1)
+    return -1;
+
+  if (fstat(info.fd, &st) == -1 || !S_ISREG(st.st_mode)
+    || pread(info.fd, hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+    close(info.fd);
+    return -1;
+  }
+
+  info.size = st.st_size;
+  memcpy(&magic, hdr, sizeof(magic));
+
+  switch (magic) {
+    case 0xa1b2c3d4: info.swapped = false; info.usec_max = 1000000; break;
+    case 0xd4c3b2a1: info.swapped = true;  info.usec_max = 1000000; break;
+    case 0xa1b23c4d: info.swapped = false; info.usec_max = 1000000000; break;
+    case 0x4d3cb2a1: info.swapped = true;  info.usec_max = 1000000000; break;
+    default: // pcapng or modified pcap format
+      close(info.fd);
+      return -1;
+  }
+
+  info.first_sec = split_u32(hdr + SPLIT_FILE_HDRLEN, info.swapped);
+  info.snaplen = split_u32(hdr + 16, info.swapped);
+  if (info.snaplen == 0 || info.snaplen > SPLIT_MAX_CAPLEN)
+    info.snaplen = SPLIT_MAX_CAPLEN;
+
+#ifdef HAVE_POSIX_FADVISE
+  // Only a few windows are read to find boundaries, no need to read ahead
+  if (posix_fadvise(info.fd, 0, 0, POSIX_FADV_RANDOM) != 0)
+    debug_print("%s\n", "posix_fadvise() failed");
+#endif
+
+  MALLOC(part, parts, split_part_t);
+  memset(part, 0, parts * sizeof(split_part_t));
+
+  // Record boundaries near each 1/parts of the file, parts too small are merged
+  count = 0;
+  part[0].start = SPLIT_FILE_HDRLEN;
+  for (i=1;i<parts;i++) {
+    boundary = split_find_boundary(&info, SPLIT_FILE_HDRLEN + (info.size - SPLIT_FILE_HDRLEN) / parts * i);
+    if (boundary == -1 || boundary <= part[count].start)
+      continue;
+
+    part[count].end = boundary;
+    count++;
+    part[count].start = boundary;
+  }
+  part[count].end = info.size;
+  count++;
+  close(info.fd);
+
+  verbose("Splitting %s in %i parts\n", input_file, count);
+
+  name_len = strlen(output_file) + 32;
+  for (i=0;i<count;i++) {
+    part[i].input_file = input_file;
+    part[i].output_file = output_file;
+    part[i].bpf = bpf;
+    part[i].dead = dead;
+
+    // Segments are created next to the output file, so they can be appended without copy on some file systems
+    if (i > 0) {
+      MALLOC(part[i].segment, name_len, char);
+      snprintf(part[i].segment, name_len, "%s.part%i.XXXXXX", output_file, i);
+      if ((fd = mkstemp(part[i].segment)) == -1)
+        error("Cannot create temporary segment %s: %s\n", part[i].segment, strerror(errno));
+      close(fd);
+    }
+
+    debug_print("split part %i: [%lld, %lld)\n", i, (long long) part[i].start, (long long) part[i].end);
+
+    if (pthread_create(&part[i].thread, NULL, split_worker, &part[i]) != 0)
+      error("Cannot create split thread\n");
+  }
+
+  for (i=0;i<count;i++)
+    pthread_join(part[i].thread, NULL);
+
+  // Boundaries are only plausible: a part running over the next one means the next one
+  // started inside a record, its packets are garbage or duplicated
+  for (i=0;i<count-1;i++) {
+    if (part[i].stop != part[i].end) {
+      for (j=1;j<count;j++)
+        unlink(part[j].segment);
+      error("%s: part at offset %lld ends at %lld, not on the record boundary found at %lld - "
+        "the file cannot be split, run without --split\n", input_file,
+        (long long) part[i].start, (long long) part[i].stop, (long long) part[i].end);
+    }
+  }
+
+  // Concatenate segments in order
+  if ((out_fd = open(output_file, O_WRONLY)) == -1)
+    error("Cannot open output file %s: %s\n", output_file, strerror(errno));
+
+  out_offset = lseek(out_fd, 0, SEEK_END);
+  for (i=1;i<count;i++) {
+    split_append(out_fd, &out_offset, part[i].segment);
+    unlink(part[i].segment);
+    free(part[i].segment);
+  }
+
+  close(out_fd);
+  free(part);
+  return 0;
+}
@@ -0,0 +1,64 @@
+/*
+  Copyright (c) 2012-2016 Loïc Pefferkorn <loic-ipdecap@loicp.eu>
+  ipdecap [http://loicpefferkorn.net/ipdecap]
+
+  This file is part of ipdecap.
+
+  Ipdecap is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Ipdecap is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ipdecap.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Split mode: a classic pcap file is cut into contiguous parts on record boundaries,
+ * each part is decapsulated by its own thread into a temporary segment, then segments
+ * are appended in order to the output file.
+ * Packets are numbered from the first record of their part: numbers from the start of
+ * the file would need the records of the previous parts to be counted, read twice.
+ */
+
+#define SPLIT_MAX_PARTS         256
+#define SPLIT_FILE_HDRLEN       24        // struct pcap_file_header
+#define SPLIT_RECORD_HDRLEN     16        // ts_sec, ts_usec, caplen, len
+#define SPLIT_MAX_CAPLEN        262144    // Largest record accepted by libpcap
+#define SPLIT_CHECK_RECORDS     16        // Consecutive valid records needed to accept a boundary
+#define SPLIT_MAX_TS_DELTA      86400     // Maximum seconds between two consecutive records
+#define SPLIT_COPY_SIZE         (1024*1024)
+
+// Classic pcap file header fields needed to walk records
+typedef struct split_file_t {
+  int fd;
+  off_t size;
+  bool swapped;
+  u_int32_t usec_max;     // 1000000, or 1000000000 for nanosecond files
+  u_int32_t snaplen;
+  u_int32_t first_sec;    // Timestamp of the first record, no record can be much older
+} split_file_t;
+
+typedef struct split_part_t {
+  off_t start;            // Offset of the first record
+  off_t end;              // Offset after the last record
+  off_t stop;             // Offset after the last record read by the worker, end if the records chain ends there
+  char *segment;          // Temporary file, NULL for the first part written directly to the output file
+  pthread_t thread;
+  const char *input_file;
+  const char *output_file;
+  struct bpf_program *bpf;
+  pcap_t *dead;
+} split_part_t;
+
+u_int32_t split_u32(const u_char *ptr, bool swapped);
+bool split_records_valid(const split_file_t *info, const u_char *buf, size_t buf_len, off_t offset);
+off_t split_find_boundary(const split_file_t *info, off_t target);
+void * split_worker(void *arg);
+void split_append(int out_fd, off_t *out_offset, const char *segment);
+int split_process(const char *input_file, const char *output_file, int parts, struct bpf_program *bpf, pcap_t *dead);
@@ -0,0 +1,192 @@
+/*
+  Copyright (c) 2012-2016 Loïc Pefferkorn <loic-ipdecap@loicp.eu>
+  ipdecap [http://loicpefferkorn.net/ipdecap]
+
+  This file is part of ipdecap.
+
+  Ipdecap is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Ipdecap is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ipdecap.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <pcap/pcap.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "config.h"
+#include "ipdecap.h"
+#include "stats.h"
+
+__thread stats_t stats;
+
+// Counters of all threads that ended
+static stats_t total;
+static pthread_mutex_t total_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *proto_names[STATS_PROTO_COUNT] = {
+  [STATS_NONE] = "none",
+  [STATS_IPIP] = "ipip",
+  [STATS_IPV6] = "6in4",
+  [STATS_GRE] = "gre",
+  [STATS_ESP] = "esp"
+};
+
+/*
+ * Give the calling thread its security associations counters, once the
+ * ESP configuration file is read
+ *
+ */
+void stats_thread_init(int sa_count) {
+
+  if (sa_count == 0 || stats.sa != NULL)
+    return;
+
+  MALLOC(stats.sa, sa_count, sa_stats_t);
+  memset(stats.sa, 0, sa_count * sizeof(sa_stats_t));
+  stats.sa_count = sa_count;
+}
+
+/*
+ * Add the counters of the calling thread to the total, and reset them
+ *
+ */
+void stats_thread_merge() {
+
+  int i;
+
+  pthread_mutex_lock(&total_lock);
+
+  for (i=0;i<STATS_PROTO_COUNT;i++) {
+    total.proto[i].packets += stats.proto[i].packets;
+    total.proto[i].bytes_in += stats.proto[i].bytes_in;
+    total.proto[i].bytes_out += stats.proto[i].bytes_out;
+  }
+  total.vlan += stats.vlan;
+  total.filtered += stats.filtered;
+  total.ignored += stats.ignored;
+  total.esp_no_sa += stats.esp_no_sa;
+  total.esp_failed += stats.esp_failed;
+  total.esp_bad_pad += stats.esp_bad_pad;
+
+  if (stats.sa_count > total.sa_count) {
+    if ((total.sa = realloc(total.sa, stats.sa_count * sizeof(sa_stats_t))) == NULL)
+      error("Cannot malloc");
+    memset(total.sa + total.sa_count, 0, (stats.sa_count - total.sa_count) * sizeof(sa_stats_t));
+    total.sa_count = stats.sa_count;
+  }
+
+  for (i=0;i<stats.sa_count;i++) {
+    total.sa[i].packets += stats.sa[i].packets;
+    total.sa[i].bytes += stats.sa[i].bytes;
+    total.sa[i].failed += stats.sa[i].failed;
+  }
+
+  pthread_mutex_unlock(&total_lock);
+
+  free(stats.sa);
+  memset(&stats, 0, sizeof(stats_t));
+}
+
+/*
+ * Print the counters of all threads, then the ones of each security association
+ * described by sa_info, in the ESP configuration file order
+ *
+ */
+void stats_print(FILE *fp, const sa_info_t *sa_info) {
+
+  proto_stats_t sum = { 0, 0, 0 };
+  char spi[16];
+  int i;
+
+  stats_thread_merge();
+
+  fprintf(fp, "%-8s %12s %16s %16s\n", "type", "packets", "bytes in", "bytes out");
+  for (i=0;i<STATS_PROTO_COUNT;i++) {
+    fprintf(fp, "%-8s %12lu %16lu %16lu\n", proto_names[i],
+      total.proto[i].packets, total.proto[i].bytes_in, total.proto[i].bytes_out);
+    sum.packets += total.proto[i].packets;
+    sum.bytes_in += total.proto[i].bytes_in;
+    sum.bytes_out += total.proto[i].bytes_out;
+  }
+  fprintf(fp, "%-8s %12lu %16lu %16lu\n", "total", sum.packets, sum.bytes_in, sum.bytes_out);
+
+  fprintf(fp, "802.1Q headers removed: %lu, not matching filter: %lu, ignored: %lu\n",
+    total.vlan, total.filtered, total.ignored);
+  fprintf(fp, "ESP: %lu without SA, %lu decryption failures, %lu bad pad_len\n",
+    total.esp_no_sa, total.esp_failed, total.esp_bad_pad);
+
+  if (total.sa_count == 0)
+    return;
+
+  fprintf(fp, "%-40s %-40s %-10s %-36s %12s %16s %10s\n",
+    "source", "destination", "spi", "algorithms", "packets", "bytes", "failed");
+  for (i=0;i<total.sa_count;i++) {
+    snprintf(spi, sizeof(spi), "0x%08x", sa_info[i].spi);
+    fprintf(fp, "%-40s %-40s %-10s %-17s %-18s %12lu %16lu %10lu\n",
+      sa_info[i].src, sa_info[i].dst, spi, sa_info[i].crypt_name, sa_info[i].auth_name,
+      total.sa[i].packets, total.sa[i].bytes, total.sa[i].failed);
+  }
+}
+
+/*
+ * Write the counters of all threads as a JSON object, to filename or standard output if "-"
+ * Returns -1 if the file cannot be written
+ *
+ */
+int stats_write_json(const char *filename, const sa_info_t *sa_info) {
+
+  FILE *fp = NULL;
+  int i, rc;
+
+  stats_thread_merge();
+
+  if (is_stdio(filename))
+    fp = stdout;
+  else if ((fp = fopen(filename, "w")) == NULL)
+    return -1;
+
+  fprintf(fp, "{\n  \"protocols\": {");
+  for (i=0;i<STATS_PROTO_COUNT;i++)
+    fprintf(fp, "%s\n    \"%s\": { \"packets\": %lu, \"bytes_in\": %lu, \"bytes_out\": %lu }",
+      i == 0 ? "" : ",", proto_names[i],
+      total.proto[i].packets, total.proto[i].bytes_in, total.proto[i].bytes_out);
+  fprintf(fp, "\n  },\n");
+
+  fprintf(fp, "  \"vlan\": %lu,\n  \"filtered\": %lu,\n  \"ignored\": %lu,\n",
+    total.vlan, total.filtered, total.ignored);
+  fprintf(fp, "  \"esp\": { \"no_sa\": %lu, \"failed\": %lu, \"bad_pad\": %lu },\n",
+    total.esp_no_sa, total.esp_failed, total.esp_bad_pad);
+
+  // Addresses and algorithm names never need escaping
+  fprintf(fp, "  \"sa\": [");
+  for (i=0;i<total.sa_count;i++)
+    fprintf(fp, "%s\n    { \"src\": \"%s\", \"dst\": \"%s\", \"spi\": %u, \"encryption\": \"%s\", \"authentication\": \"%s\", "
+      "\"packets\": %lu, \"bytes\": %lu, \"failed\": %lu }",
+      i == 0 ? "" : ",", sa_info[i].src, sa_info[i].dst, sa_info[i].spi, sa_info[i].crypt_name, sa_info[i].auth_name,
+      total.sa[i].packets, total.sa[i].bytes, total.sa[i].failed);
+  fprintf(fp, "%s]\n}\n", total.sa_count > 0 ? "\n  " : "");
+
+  rc = ferror(fp) ? -1 : 0;
+  if (fp != stdout && fclose(fp) != 0)
+    rc = -1;
+  else if (fp == stdout)
+    fflush(stdout);
+
+  return rc;
+}
@@ -0,0 +1,75 @@
+/*
+  Copyright (c) 2012-2016 Loïc Pefferkorn <loic-ipdecap@loicp.eu>
+  ipdecap [http://loicpefferkorn.net/ipdecap]
+
+  This file is part of ipdecap.
+
+  Ipdecap is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Ipdecap is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ipdecap.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Processing counters: each thread counts in its own stats_t, added to the
+ * total when it ends. They are printed at exit, as text or JSON.
+ */
+
+// Encapsulation types, from the outer IP protocol
+typedef enum stats_proto_t {
+  STATS_NONE,                   // Non IP, or not encapsulated: copied
+  STATS_IPIP,
+  STATS_IPV6,
+  STATS_GRE,
+  STATS_ESP,
+  STATS_PROTO_COUNT
+} stats_proto_t;
+
+typedef struct proto_stats_t {
+  unsigned long packets;
+  unsigned long bytes_in;       // Captured bytes of the source packets
+  unsigned long bytes_out;      // Bytes of the decapsulated packets
+} proto_stats_t;
+
+// Counters of an ESP security association, a line of the configuration file
+typedef struct sa_stats_t {
+  unsigned long packets;
+  unsigned long bytes;          // Captured bytes of the ESP packets
+  unsigned long failed;         // Decryption or ICV verification failures, bad pad_len: copied raw
+} sa_stats_t;
+
+// What is printed of a security association
+typedef struct sa_info_t {
+  char src[INET6_ADDRSTRLEN];
+  char dst[INET6_ADDRSTRLEN];
+  u_int32_t spi;
+  const char *crypt_name;
+  const char *auth_name;
+} sa_info_t;
+
+typedef struct stats_t {
+  proto_stats_t proto[STATS_PROTO_COUNT];
+  unsigned long vlan;           // IEEE 802.1Q headers removed
+  unsigned long filtered;       // Not matching the BPF filter, not written
+  unsigned long ignored;        // Captured length too long, or ESP without configuration: not written
+  unsigned long esp_no_sa;      // No matching line in the ESP configuration file: copied
+  unsigned long esp_failed;     // Truncated or EVP_DecryptUpdate() error: copied raw
+  unsigned long esp_bad_pad;    // pad_len cannot be right, wrong key ? copied raw
+  sa_stats_t *sa;               // Indexed by llflow_t.index, NULL before stats_thread_init()
+  int sa_count;
+} stats_t;
+
+extern __thread stats_t stats;
+
+void stats_thread_init(int sa_count);
+void stats_thread_merge(void);
+void stats_print(FILE *fp, const sa_info_t *sa_info);
+int stats_write_json(const char *filename, const sa_info_t *sa_info);
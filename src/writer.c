@@ -0,0 +1,516 @@
+/*
+  Copyright (c) 2012-2016 Loïc Pefferkorn <loic-ipdecap@loicp.eu>
+  ipdecap [http://loicpefferkorn.net/ipdecap]
+
+  This file is part of ipdecap.
+
+  Ipdecap is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Ipdecap is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ipdecap.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <pcap/pcap.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "config.h"
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+#include "ipdecap.h"
+#include "pipeline.h"
+#include "writer.h"
+
+#define PCAP_MAGIC          0xa1b2c3d4
+#define PCAP_FILE_HDRLEN    24
+#define PCAP_RECORD_HDRLEN  16
+
+// On-disk file header, as written by pcap_dump_open() in host byte order
+typedef struct pcap_file_hdr_t {
+  u_int32_t magic;
+  u_int16_t version_major;
+  u_int16_t version_minor;
+  int32_t thiszone;
+  u_int32_t sigfigs;
+  u_int32_t snaplen;
+  u_int32_t linktype;
+} pcap_file_hdr_t;
+
+// On-disk record header, timestamps are 32 bits whatever the platform
+typedef struct pcap_record_hdr_t {
+  u_int32_t ts_sec;
+  u_int32_t ts_usec;
+  u_int32_t caplen;
+  u_int32_t len;
+} pcap_record_hdr_t;
+
+static int out_fd = -1;
+static bool out_stream = false; // Standard output or compressed: written in sequence, offsets are not used
+static off_t out_offset = 0;    // Offset of the next buffer in output file
+static writer_buffer_t buffers[WRITER_BUFFERS];
+static writer_buffer_t *current = NULL;
+static bool use_uring = false;  // io_uring, else I/O thread
+
+#ifdef HAVE_LIBURING
+static struct io_uring uring;
+static writer_buffer_t *free_buffers[WRITER_BUFFERS];
+static int free_count = 0;
+static int inflight = 0;
+#endif
+
+static pthread_t io_thread;
+static ring_t full_ring;        // writer -> I/O thread
+static ring_t free_ring;        // I/O thread -> writer
+
+#ifdef HAVE_LIBZSTD
+static ZSTD_CCtx *cctx = NULL;  // NULL if output is not compressed
+static u_char *zbuf = NULL;
+static size_t zbuf_size = 0;
+#endif
+
+/*
+ * Write the whole buffer at offset, after a short write or an error
+ *
+ */
+static void pwrite_all(const u_char *data, size_t len, off_t offset) {
+
+  ssize_t rc;
+
+  while (len > 0) {
+    rc = out_stream ? write(out_fd, data, len) : pwrite(out_fd, data, len, offset);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc <= 0)
+      error("Cannot write output file: %s\n", strerror(errno));
+    data += rc;
+    len -= rc;
+    offset += rc;
+  }
+}
+
+#ifdef HAVE_LIBURING
+
+/*
+ * Wait for the oldest io_uring write, and give its buffer back
+ *
+ */
+static void uring_complete(void) {
+
+  struct io_uring_cqe *cqe = NULL;
+  writer_buffer_t *buf = NULL;
+  int rc;
+
+  if ((rc = io_uring_wait_cqe(&uring, &cqe)) < 0)
+    error("io_uring_wait_cqe() failed: %s\n", strerror(-rc));
+
+  buf = io_uring_cqe_get_data(cqe);
+  if (cqe->res < 0)
+    error("Cannot write output file: %s\n", strerror(-cqe->res));
+  if ((size_t) cqe->res < buf->used)
+    pwrite_all(buf->data + cqe->res, buf->used - cqe->res, buf->offset + cqe->res);
+  io_uring_cqe_seen(&uring, cqe);
+
+  buf->used = 0;
+  free_buffers[free_count++] = buf;
+  inflight--;
+}
+
+static void uring_submit(writer_buffer_t *buf) {
+
+  struct io_uring_sqe *sqe = NULL;
+
+  // Writes in flight can complete in any order, a stream is written synchronously
+  if (out_stream) {
+    pwrite_all(buf->data, buf->used, 0);
+    buf->used = 0;
+    free_buffers[free_count++] = buf;
+    return;
+  }
+
+  if ((sqe = io_uring_get_sqe(&uring)) == NULL)
+    error("io_uring submission queue is full\n");
+
+  io_uring_prep_write(sqe, out_fd, buf->data, buf->used, buf->offset);
+  io_uring_sqe_set_data(sqe, buf);
+  io_uring_submit(&uring);
+  inflight++;
+}
+
+#endif
+
+#ifdef HAVE_LIBZSTD
+
+/*
+ * Compress a buffer and write the compressed bytes. With end, the zstd frame is
+ * finished; with flush, everything given so far can be decompressed by the reader.
+ * With several compression threads, zstd compresses in the background and this
+ * mostly hands data over.
+ *
+ */
+static void zstd_write(const u_char *data, size_t len, ZSTD_EndDirective mode) {
+
+  ZSTD_inBuffer zin = { data, len, 0 };
+  ZSTD_outBuffer zout;
+  size_t rc;
+
+  do {
+    zout.dst = zbuf;
+    zout.size = zbuf_size;
+    zout.pos = 0;
+    rc = ZSTD_compressStream2(cctx, &zout, &zin, mode);
+    if (ZSTD_isError(rc))
+      error("Cannot compress output: %s\n", ZSTD_getErrorName(rc));
+    pwrite_all(zbuf, zout.pos, 0);
+  } while (mode == ZSTD_e_continue ? zin.pos < zin.size : rc != 0);
+}
+
+/*
+ * Set a compression parameter, name is the option it comes from
+ *
+ */
+static void zstd_set(ZSTD_cParameter param, int value, const char *name) {
+
+  size_t rc = ZSTD_CCtx_setParameter(cctx, param, value);
+
+  if (ZSTD_isError(rc))
+    error("Cannot set zstd %s to %i: %s\n", name, value, ZSTD_getErrorName(rc));
+}
+
+#endif
+
+/*
+ * Write buffers with a single pwritev(), or compress them one by one
+ *
+ */
+static void io_write(writer_buffer_t **batch, int count) {
+
+  struct iovec iov[WRITER_BUFFERS];
+  size_t len = 0, done;
+  ssize_t rc;
+  int i;
+
+#ifdef HAVE_LIBZSTD
+  if (cctx != NULL) {
+    for (i=0;i<count;i++)
+      zstd_write(batch[i]->data, batch[i]->used, batch[i]->flush ? ZSTD_e_flush : ZSTD_e_continue);
+    return;
+  }
+#endif
+
+  for (i=0;i<count;i++) {
+    iov[i].iov_base = batch[i]->data;
+    iov[i].iov_len = batch[i]->used;
+    len += batch[i]->used;
+  }
+
+  // Queued buffers are contiguous in output file
+  do {
+    rc = out_stream ? writev(out_fd, iov, count) : pwritev(out_fd, iov, count, batch[0]->offset);
+  } while (rc < 0 && errno == EINTR);
+
+  if (rc < 0)
+    error("Cannot write output file: %s\n", strerror(errno));
+
+  // Short write: finish buffer by buffer
+  if ((size_t) rc < len) {
+    done = rc;
+    for (i=0;i<count;i++) {
+      if (done < batch[i]->used)
+        pwrite_all(batch[i]->data + done, batch[i]->used - done, batch[i]->offset + done);
+      done = (done > batch[i]->used) ? done - batch[i]->used : 0;
+    }
+  }
+}
+
+/*
+ * I/O thread: write full buffers in order, all the queued ones at once
+ *
+ */
+static void * writer_io_thread(void *arg) {
+
+  writer_buffer_t *batch[WRITER_BUFFERS];
+  writer_buffer_t *buf = NULL;
+  bool last = false;
+  int count, i;
+
+  (void) arg;
+
+  while (!last) {
+
+    if ((buf = ring_pop(&full_ring)) == NULL)
+      break;
+
+    count = 0;
+    batch[count++] = buf;
+    while (count < WRITER_BUFFERS && ring_count(&full_ring) > 0) {
+      if ((buf = ring_pop(&full_ring)) == NULL) {
+        last = true;
+        break;
+      }
+      batch[count++] = buf;
+    }
+
+    io_write(batch, count);
+
+    for (i=0;i<count;i++) {
+      batch[i]->used = 0;
+      batch[i]->flush = false;
+      ring_push(&free_ring, batch[i]);
+    }
+  }
+
+#ifdef HAVE_LIBZSTD
+  if (cctx != NULL)
+    zstd_write(NULL, 0, ZSTD_e_end);
+#endif
+
+  return NULL;
+}
+
+/*
+ * Hand the current buffer to the I/O side and take a free one
+ *
+ */
+static void writer_submit(void) {
+
+  if (current->used == 0)
+    return;
+
+  current->offset = out_offset;
+  out_offset += current->used;
+
+#ifdef HAVE_LIBURING
+  if (use_uring) {
+    uring_submit(current);
+    if (free_count == 0)
+      uring_complete();
+    current = free_buffers[--free_count];
+    return;
+  }
+#endif
+
+  ring_push(&full_ring, current);
+  current = ring_pop(&free_ring);
+}
+
+/*
+ * Make packets written so far readable from the output file
+ *
+ */
+void async_writer_flush(void) {
+
+  // Else the flag would stay on the buffer, and flush the compressor at a later packet
+  if (current->used == 0)
+    return;
+
+  current->flush = true;
+  writer_submit();
+}
+
+/*
+ * Create output file and write the pcap file header, like pcap_dump_open()
+ * zstd: compression parameters, NULL to write an uncompressed file
+ * Returns -1 if the file cannot be created
+ *
+ */
+int async_writer_open(const char *filename, int linktype, int snaplen, const writer_zstd_t *zstd) {
+
+  pcap_file_hdr_t file_hdr;
+  int i, rc;
+
+  out_stream = (strcmp(filename, "-") == 0);
+
+  if (out_stream)
+    out_fd = STDOUT_FILENO;
+  else if ((out_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1)
+    return -1;
+
+  out_offset = 0;
+
+  for (i=0;i<WRITER_BUFFERS;i++) {
+    if ((rc = posix_memalign((void **) &buffers[i].data, WRITER_ALIGN, WRITER_BUFFER_SIZE)) != 0)
+      error("Cannot malloc");
+    buffers[i].used = 0;
+    buffers[i].flush = false;
+  }
+
+  if (zstd != NULL) {
+#ifdef HAVE_LIBZSTD
+    // Compressed size is not known in advance, the file is written in sequence
+    out_stream = true;
+    if ((cctx = ZSTD_createCCtx()) == NULL)
+      error("ZSTD_createCCtx() failed\n");
+    zstd_set(ZSTD_c_compressionLevel, zstd->level, "compression level");
+    zstd_set(ZSTD_c_checksumFlag, 1, "checksum");
+    // The window the man page documents (zstd --long=27), whatever the level defaults to
+    if (zstd->long_window) {
+      zstd_set(ZSTD_c_enableLongDistanceMatching, 1, "long distance matching");
+      zstd_set(ZSTD_c_windowLog, WRITER_ZSTD_LONG_WINDOW_LOG, "window log");
+    }
+    // Fails if libzstd is built without multi-threading: compression is then done by the I/O thread
+    if (zstd->workers > 0 && ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, zstd->workers)))
+      warnx("libzstd is built without multi-threading support, compressing with a single thread\n");
+    zbuf_size = ZSTD_CStreamOutSize();
+    MALLOC(zbuf, zbuf_size, u_char);
+#else
+    error("ipdecap is built without libzstd, output cannot be compressed\n");
+#endif
+  }
+
+#ifdef HAVE_LIBURING
+  use_uring = (zstd == NULL);
+#endif
+
+  if (use_uring) {
+#ifdef HAVE_LIBURING
+    if ((rc = io_uring_queue_init(WRITER_BUFFERS, &uring, 0)) < 0)
+      error("io_uring_queue_init() failed: %s\n", strerror(-rc));
+    for (i=1;i<WRITER_BUFFERS;i++)
+      free_buffers[free_count++] = &buffers[i];
+#endif
+  } else {
+    ring_init(&full_ring);
+    ring_init(&free_ring);
+    for (i=1;i<WRITER_BUFFERS;i++)
+      ring_push(&free_ring, &buffers[i]);
+    if ((rc = pthread_create(&io_thread, NULL, writer_io_thread, NULL)) != 0)
+      error("Cannot create I/O thread: %s\n", strerror(rc));
+  }
+
+  current = &buffers[0];
+
+  file_hdr.magic = PCAP_MAGIC;
+  file_hdr.version_major = 2;
+  file_hdr.version_minor = 4;
+  file_hdr.thiszone = 0;
+  file_hdr.sigfigs = 0;
+  file_hdr.snaplen = snaplen;
+  file_hdr.linktype = linktype;
+  memcpy(current->data, &file_hdr, PCAP_FILE_HDRLEN);
+  current->used = PCAP_FILE_HDRLEN;
+
+  return 0;
+}
+
+/*
+ * Append a packet record, like pcap_dump(). The caplen bytes of the packet are gathered from iov.
+ *
+ */
+void async_writer_write(const pcap_hdr *pkthdr, const struct iovec *iov, int iovcnt) {
+
+  pcap_record_hdr_t rec;
+  u_char *dst = NULL;
+  int i;
+
+  if (pkthdr->caplen > WRITER_BUFFER_SIZE - PCAP_RECORD_HDRLEN)
+    error("Packet too big for output buffer: %u bytes\n", pkthdr->caplen);
+
+  if (current->used + PCAP_RECORD_HDRLEN + pkthdr->caplen > WRITER_BUFFER_SIZE)
+    writer_submit();
+
+  rec.ts_sec = pkthdr->ts.tv_sec;
+  rec.ts_usec = pkthdr->ts.tv_usec;
+  rec.caplen = pkthdr->caplen;
+  rec.len = pkthdr->len;
+
+  memcpy(current->data + current->used, &rec, PCAP_RECORD_HDRLEN);
+  dst = current->data + current->used + PCAP_RECORD_HDRLEN;
+  for (i=0;i<iovcnt;i++) {
+    memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+    dst += iov[i].iov_len;
+  }
+  current->used += PCAP_RECORD_HDRLEN + pkthdr->caplen;
+}
+
+/*
+ * pcap_dump() of a packet gathered from iov, written to the dumper stream piece by piece
+ *
+ */
+void writer_pcap_dump(pcap_dumper_t *dumper, const pcap_hdr *pkthdr, const struct iovec *iov, int iovcnt) {
+
+  pcap_record_hdr_t rec;
+  FILE *out = NULL;
+  int i;
+
+  if (iovcnt == 1) {
+    pcap_dump((u_char *) dumper, pkthdr, iov[0].iov_base);
+    return;
+  }
+
+  rec.ts_sec = pkthdr->ts.tv_sec;
+  rec.ts_usec = pkthdr->ts.tv_usec;
+  rec.caplen = pkthdr->caplen;
+  rec.len = pkthdr->len;
+
+  // Errors are reported by pcap_dump_flush() or pcap_dump_close(), as for pcap_dump()
+  out = pcap_dump_file(dumper);
+  fwrite(&rec, PCAP_RECORD_HDRLEN, 1, out);
+  for (i=0;i<iovcnt;i++)
+    fwrite(iov[i].iov_base, iov[i].iov_len, 1, out);
+}
+
+/*
+ * Write remaining buffers, wait for all writes and close output file
+ *
+ */
+void async_writer_close(void) {
+
+  int i;
+
+  writer_submit();
+
+  if (use_uring) {
+#ifdef HAVE_LIBURING
+    while (inflight > 0)
+      uring_complete();
+    io_uring_queue_exit(&uring);
+#endif
+  } else {
+    ring_push(&full_ring, NULL);
+    pthread_join(io_thread, NULL);
+    // Empty free ring for a next use
+    while (ring_count(&free_ring) > 0)
+      ring_pop(&free_ring);
+  }
+
+#ifdef HAVE_LIBZSTD
+  if (cctx != NULL) {
+    ZSTD_freeCCtx(cctx);
+    free(zbuf);
+    cctx = NULL;
+  }
+#endif
+
+  if (close(out_fd) != 0)
+    error("Cannot close output file: %s\n", strerror(errno));
+
+  for (i=0;i<WRITER_BUFFERS;i++)
+    free(buffers[i].data);
+  out_fd = -1;
+}
@@ -0,0 +1,57 @@
+/*
+  Copyright (c) 2012-2016 Loïc Pefferkorn <loic-ipdecap@loicp.eu>
+  ipdecap [http://loicpefferkorn.net/ipdecap]
+
+  This file is part of ipdecap.
+
+  Ipdecap is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Ipdecap is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ipdecap.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Output backend writing pcap records into large aligned buffers. Full buffers are
+ * written by io_uring when available, or by an I/O thread with pwritev(), while the
+ * next buffer is filled: disk writes overlap with packet processing.
+ * Written files are identical to pcap_dump_open()/pcap_dump() ones.
+ * Filename "-" is standard output, written in sequence since it can be a pipe.
+ * Output can be zstd compressed, by the I/O thread and zstd worker threads.
+ */
+
+#define WRITER_BUFFER_SIZE    (1024*1024)   // Multiple of WRITER_ALIGN
+#define WRITER_BUFFERS        4             // At least 2, lower than PIPELINE_RING_SIZE
+#define WRITER_ALIGN          4096
+
+typedef struct writer_buffer_t {
+  u_char *data;                 // WRITER_BUFFER_SIZE bytes, WRITER_ALIGN aligned
+  size_t used;
+  off_t offset;                 // Offset of data in output file
+  bool flush;                   // Compressed output: make data readable once written
+} writer_buffer_t;
+
+// zstd compressed output
+typedef struct writer_zstd_t {
+  int level;
+  int workers;                  // zstd compression threads, 0 to compress in the I/O thread
+  bool long_window;             // Long distance matching, 128MB window
+} writer_zstd_t;
+
+#define WRITER_ZSTD_MIN_LEVEL     1
+#define WRITER_ZSTD_MAX_LEVEL     19
+#define WRITER_ZSTD_MAX_WORKERS   64
+#define WRITER_ZSTD_LONG_WINDOW_LOG  27   // 128MB window of --zstd-long
+
+int async_writer_open(const char *filename, int linktype, int snaplen, const writer_zstd_t *zstd);
+void async_writer_write(const pcap_hdr *pkthdr, const struct iovec *iov, int iovcnt);
+void async_writer_flush(void);
+void async_writer_close(void);
+void writer_pcap_dump(pcap_dumper_t *dumper, const pcap_hdr *pkthdr, const struct iovec *iov, int iovcnt);
@@ -67,7 +67,24 @@ BEGIN {
         if ($2 == "hmac-md5")
           auth[entry] = "hmac_md5-96"
         else
-          auth[entry] = $2
+          if ($2 == "hmac-sha256")
+            auth[entry] = "hmac_sha256-128"
+          else
+            if ($2 == "hmac-sha384")
+              auth[entry] = "hmac_sha384-192"
+            else
+              if ($2 == "hmac-sha512")
+                auth[entry] = "hmac_sha512-256"
+              else
+                auth[entry] = $2
+
+    # Authentication key, to check ICVs
+    if ($2 != "null") {
+      auth_key[entry]="0x"
+      for (a=3;a<=NF;a++) {
+        auth_key[entry] = auth_key[entry] $a
+      }
+    }
 }
 
 # Dummy, increase number of entries found
@@ -79,5 +96,5 @@ BEGIN {
 END {
     # display each entry
     for(i=0;i<entry;i++)
-      printf("%s\t%s\t%s\t%s\t%s\t%s\n", src[i], dst[i], crypt[i], auth[i], key[i], spi[i])
+      printf("%s\t%s\t%s\t%s\t%s\t%s\t%s\n", src[i], dst[i], crypt[i], auth[i], key[i], spi[i], auth_key[i])
 }